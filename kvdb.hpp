@@ -15,22 +15,105 @@
 #include <string>
 #include <list>
 #include <set>
+#include <map>
+#include <unordered_set>
 #include <mutex>
+#include <shared_mutex>
 #include <type_traits>
 #include <cassert>
 #include <cstring> 
 #include <functional>
 #include <cmath>
+#include <algorithm>
+#include <new>
+#include <cstdlib>
+#include <climits>
+#include <filesystem>
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <iterator>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
+#include <bit>
+#include <charconv>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define KVDB_POSIX_IO 1
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#endif
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define KVDB_IO_URING 1
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <cerrno>
+#endif
 
 
 #define KVDB_RESERVED_TABLE_SIZE 1000
+#define KVDB_TABLE_GROWTH 2.0 // each new key table is this much larger than previous one
+#define KVDB_MAX_TABLE_SIZE (1 << 20) // up to this many entries
+#define KVDB_TABLE_DIRECTORY_MIN 64 // entries of first table directory
+#define KVDB_TABLE_READ_SIZE (4 << 20) // bytes of key entries per read on open
+#define KVDB_TABLE_READ_WINDOW (64 << 20) // bytes of key entries read in parallel on open
 #define KVDB_MIN_DATA_SIZE 256
+#define KVDB_COMPACT_FIT_SCAN 64 // free extents checked for a hole below value moved by compaction
+#define KVDB_MMAP_MIN_SIZE (1 << 20)
+#define KVDB_VALUE_ALIGNMENT 4096 // block of aligned values, see setValueAlignment()
+#define KVDB_ALIGNED_FIT_SCAN 64 // free extents checked for a block aligned start
+#define KVDB_APPEND_GROWTH 2.0 // value outgrown by append() moves to extent this much larger than its length
 
 #define KVDB_FILE_VERSION 2
+#define KVDB_INDEX_VERSION 1
+#define KVDB_INDEX_FILE_EXT ".idx"
+#define KVDB_WAL_FILE_EXT ".wal"
+#define KVDB_SHARD_VERSION 1
+#define KVDB_SHARD_FILE_EXT ".shards"
+#define KVDB_WAL_CHECKPOINT_SIZE (64 << 20)
+#define KVDB_HELD_FREE_SIZE (64 << 20) // freed bytes waiting for key table write or checkpoint
+
+#define KVDB_WAL_PUT 1
+#define KVDB_WAL_ERASE 2
+#define KVDB_WAL_PATCH 3 // bytes at offset of stored value
+#define KVDB_WAL_CONTINUED 0x100 // more records of same batch follow
+
+#define KVDB_DURABILITY_NONE 0 // log is written, never synced
+#define KVDB_DURABILITY_PERIODIC 1 // log is synced by background thread
+#define KVDB_DURABILITY_COMMIT 2 // save returns after log is synced
+
+#define KVDB_ENTRY_COMPRESSED 0x1 // value is stored by TLzCodec
+#define KVDB_COMPRESS_MIN_SIZE 64 // smaller values are stored raw
+#define KVDB_RANGE_BATCH 256 // keys fetched by range iterator under one shared lock
+#define KVDB_URING_ENTRIES 256 // reads in flight
+#define KVDB_MULTI_GET_GAP 4096 // values of multi-get closer than this are read by one call
+#define KVDB_CACHE_SHARDS 16 // value cache parts with own lock
+#define KVDB_CACHE_SHARD_MIN_SIZE (1 << 20) // smaller caches use fewer shards
+#define KVDB_TABLE_PAGE_SIZE 4096 // key table page buffer unit, power of two
+#define KVDB_TABLE_BUFFER_SIZE (1 << 20) // dirty key table pages are written when they reach this size
+#define KVDB_TABLE_BUFFER_MS 100 // or when oldest change is this old
+#define KVDB_READV_MAX 256 // buffers per vectored read
+#define KVDB_LATENCY_BUCKETS 40 // power of two buckets from 1 ns
+
+#define KVDB_LOG_VERSION 1
+#define KVDB_LOG_SEGMENT_SIZE (64 << 20) // active segment is sealed when full
+#define KVDB_LOG_SEGMENT_EXT ".seg"
+#define KVDB_LOG_HINT_EXT ".hint"
+#define KVDB_LOG_PUT 1
+#define KVDB_LOG_ERASE 2
+#define KVDB_LOG_CONTINUED 0x100 // more records of same batch follow
 
 #define KVDB_OK 0
 #define KVDB_ERROR_OPEN_FILE -1
 #define KVDB_ERROR_INCORRECT_FILE_VERSION -2
+#define KVDB_ERROR_DAMAGED_FILE -3
+#define KVDB_ERROR_SHARD_COUNT -4
 
 
 typedef uint32_t uint32;
@@ -77,6 +160,285 @@ namespace kvdb {
 		}
 	}
 
+	// fast non-cryptographic checksum, 8 bytes per step
+	inline ulong64 checksum(const byte* data, size_t size, ulong64 seed = 0) {
+		const ulong64 m = 0x9e3779b97f4a7c15ULL;
+		ulong64 h = seed ^ (size * m);
+		size_t i = 0;
+		for (; i + 8 <= size; i += 8) {
+			ulong64 w;
+			std::memcpy(&w, data + i, 8);
+			h = (h ^ (w * m)) * 0xff51afd7ed558ccdULL;
+			h ^= h >> 32;
+		}
+		for (; i < size; i++) {
+			h = (h ^ data[i]) * m;
+		}
+		h ^= h >> 29;
+		return h;
+	}
+
+	// key hash, word at a time. Called with constant size it unrolls to a few multiplies.
+	inline ulong64 hashKey(const byte* key, size_t size) {
+		ulong64 h = 0x9e3779b97f4a7c15ULL ^ size;
+		size_t i = 0;
+		for (; i + 8 <= size; i += 8) {
+			ulong64 w;
+			std::memcpy(&w, key + i, 8);
+			h = (h ^ w) * 0xbf58476d1ce4e5b9ULL;
+			h ^= h >> 31;
+		}
+		if (i + 4 <= size) {
+			uint32 w;
+			std::memcpy(&w, key + i, 4);
+			h = (h ^ w) * 0x94d049bb133111ebULL;
+			h ^= h >> 29;
+			i += 4;
+		}
+		for (; i < size; i++) {
+			h = (h ^ key[i]) * 0x100000001b3ULL;
+		}
+		h ^= h >> 32;
+		h *= 0xd6e8feb86659fd93ULL;
+		h ^= h >> 32;
+		return h;
+	}
+
+#ifdef KVDB_POSIX_IO
+	inline bool preadFull(int fd, byte* dst, size_t length, ulong64 pos) {
+		while (length > 0) {
+			ssize_t n = ::pread(fd, dst, length, (off_t)pos);
+			if (n <= 0) return false;
+			dst += n;
+			pos += n;
+			length -= n;
+		}
+		return true;
+	}
+
+	inline bool preadvFull(int fd, struct iovec* iov, int count, ulong64 pos) {
+		while (count > 0) {
+			ssize_t n = ::preadv(fd, iov, count, (off_t)pos);
+			if (n <= 0) return false;
+			pos += n;
+			for (; count > 0 && (size_t)n >= iov->iov_len; iov++, count--) n -= iov->iov_len;
+			if (count > 0) {
+				iov->iov_base = (byte*)iov->iov_base + n;
+				iov->iov_len -= n;
+			}
+		}
+		return true;
+	}
+
+	inline bool pwriteFull(int fd, const byte* src, size_t length, ulong64 pos) {
+		while (length > 0) {
+			ssize_t n = ::pwrite(fd, src, length, (off_t)pos);
+			if (n <= 0) return false;
+			src += n;
+			pos += n;
+			length -= n;
+		}
+		return true;
+	}
+
+	// reads length bytes, or at least need bytes if file ends earlier
+	inline bool preadAtLeast(int fd, byte* dst, size_t length, size_t need, ulong64 pos) {
+		size_t done = 0;
+		while (done < need) {
+			ssize_t n = ::pread(fd, dst + done, length - done, (off_t)(pos + done));
+			if (n <= 0) return false;
+			done += n;
+		}
+		return true;
+	}
+
+	// heap block with given alignment, for direct I/O buffers
+	typedef std::unique_ptr<byte, void(*)(void*)> TAlignedBlock;
+
+	inline TAlignedBlock alignedBlock(size_t alignment, size_t size) {
+		return TAlignedBlock((byte*)std::aligned_alloc(alignment, size), std::free);
+	}
+#endif
+
+	//============================================================================
+	// Key order
+	// values of keys with near order codes are placed near each other on disk
+	//============================================================================
+	typedef ulong64 (*TKeyOrderFunc)(const byte* key, size_t size);
+
+	// 21 low bits of v moved to every third bit
+	inline ulong64 spreadBits3(ulong64 v) {
+		v &= 0x1fffff;
+		v = (v | v << 32) & 0x1f00000000ffffULL;
+		v = (v | v << 16) & 0x1f0000ff0000ffULL;
+		v = (v | v << 8) & 0x100f00f00f00f00fULL;
+		v = (v | v << 4) & 0x10c30c30c30c30c3ULL;
+		v = (v | v << 2) & 0x1249249249249249ULL;
+		return v;
+	}
+
+	// Morton (Z-order) code of 3D point, coordinates are taken modulo 2^21 around zero
+	inline ulong64 mortonCode(int32_t x, int32_t y, int32_t z) {
+		const uint32 bias = 1 << 20;
+		return spreadBits3((uint32)x + bias) | (spreadBits3((uint32)y + bias) << 1) | (spreadBits3((uint32)z + bias) << 2);
+	}
+
+	// Morton code for keys of three int32 coordinates, other keys keep insertion order. 
+	// Opt-in order for voxel keys, see setKeyOrder() and create()
+	inline ulong64 mortonKeyOrder(const byte* key, size_t size) {
+		if (size != 3 * sizeof(int32_t)) return 0;
+		int32_t c[3];
+		std::memcpy(c, key, sizeof(c));
+		return mortonCode(c[0], c[1], c[2]);
+	}
+
+	//============================================================================
+	// Value compression
+	// byte oriented LZ77 in the manner of LZ4: sequences of literals and matches 
+	// within 64 KB window. Compressed value starts with uint32 raw size.
+	//============================================================================
+	class TLzCodec {
+
+	private:
+		static constexpr size_t MIN_MATCH = 4;
+		static constexpr size_t HASH_BITS = 12;
+		static constexpr size_t MAX_OFFSET = 65535;
+
+		static uint32 load32(const byte* p) {
+			uint32 v;
+			std::memcpy(&v, p, 4);
+			return v;
+		}
+
+		static void writeLength(TValueData& dst, size_t length) {
+			while (length >= 255) {
+				dst.push_back(255);
+				length -= 255;
+			}
+			dst.push_back((byte)length);
+		}
+
+		static bool readLength(const byte*& ip, const byte* end, size_t& length) {
+			byte b;
+			do {
+				if (ip == end) return false;
+				b = *ip++;
+				length += b;
+			} while (b == 255);
+			return true;
+		}
+
+		static void writeSequence(TValueData& dst, const byte* literals, size_t literalLength, size_t offset, size_t matchLength) {
+			const size_t m = (matchLength > 0) ? matchLength - MIN_MATCH : 0;
+			dst.push_back((byte)((std::min<size_t>(literalLength, 15) << 4) | std::min<size_t>(m, 15)));
+			if (literalLength >= 15) writeLength(dst, literalLength - 15);
+			dst.insert(dst.end(), literals, literals + literalLength);
+			if (matchLength == 0) return; // last sequence
+			dst.push_back((byte)offset);
+			dst.push_back((byte)(offset >> 8));
+			if (m >= 15) writeLength(dst, m - 15);
+		}
+
+	public:
+		static constexpr size_t HEADER_SIZE = 4;
+
+		// false if compressed value is not smaller than raw one
+		static bool compress(const byte* src, size_t size, TValueData& dst) {
+			dst.clear();
+			if (size <= HEADER_SIZE || size > UINT32_MAX) return false;
+			dst.reserve(size);
+
+			const uint32 rawSize = (uint32)size;
+			dst.insert(dst.end(), (const byte*)&rawSize, (const byte*)&rawSize + 4);
+
+			uint32 table[1 << HASH_BITS];
+			std::fill(std::begin(table), std::end(table), UINT32_MAX);
+
+			size_t anchor = 0;
+			size_t i = 0;
+			const size_t limit = (size > MIN_MATCH) ? size - MIN_MATCH : 0;
+
+			while (i < limit) {
+				const uint32 seq = load32(src + i);
+				const uint32 h = (seq * 2654435761u) >> (32 - HASH_BITS);
+				const size_t candidate = table[h];
+				table[h] = (uint32)i;
+
+				if (candidate == UINT32_MAX || i - candidate > MAX_OFFSET || load32(src + candidate) != seq) {
+					i += 1 + ((i - anchor) >> 6); // skip faster through data that does not match
+					continue;
+				}
+
+				size_t length = MIN_MATCH;
+				while (i + length < size && src[candidate + length] == src[i + length]) length++;
+
+				writeSequence(dst, src + anchor, i - anchor, i - candidate, length);
+				if (dst.size() >= size) return false;
+
+				i += length;
+				anchor = i;
+			}
+
+			if (anchor < size) writeSequence(dst, src + anchor, size - anchor, 0, 0);
+			return dst.size() < size;
+		}
+
+		// raw size of compressed value, 0 if it is malformed
+		static size_t rawSize(const byte* src, size_t size) {
+			return (size < HEADER_SIZE) ? 0 : load32(src);
+		}
+
+		// dst has rawSize() bytes, false if data is malformed
+		static bool decompress(const byte* src, size_t size, byte* dst, size_t dstSize) {
+			if (size < HEADER_SIZE || load32(src) != dstSize) return false;
+
+			const byte* ip = src + HEADER_SIZE;
+			const byte* end = src + size;
+			byte* op = dst;
+			byte* const opEnd = dst + dstSize;
+
+			while (ip < end) {
+				const byte token = *ip++;
+
+				size_t literalLength = token >> 4;
+				if (literalLength == 15 && !readLength(ip, end, literalLength)) return false;
+				if ((size_t)(end - ip) < literalLength || (size_t)(opEnd - op) < literalLength) return false;
+				if (literalLength <= 16 && end - ip >= 16 && opEnd - op >= 16) {
+					std::memcpy(op, ip, 16); // fixed size copy, extra bytes are overwritten later
+				} else {
+					std::memcpy(op, ip, literalLength);
+				}
+				ip += literalLength;
+				op += literalLength;
+
+				if (ip == end) break; // last sequence has no match
+
+				if (end - ip < 2) return false;
+				const size_t offset = ip[0] | ((size_t)ip[1] << 8);
+				ip += 2;
+
+				size_t matchLength = token & 15;
+				if (matchLength == 15 && !readLength(ip, end, matchLength)) return false;
+				matchLength += MIN_MATCH;
+
+				if (offset == 0 || offset > (size_t)(op - dst) || (size_t)(opEnd - op) < matchLength) return false;
+
+				// overlapped run is copied in pieces of offset bytes
+				const byte* match = op - offset;
+				if (matchLength <= 16 && offset >= 16 && opEnd - op >= 16) {
+					std::memcpy(op, match, 16);
+				} else {
+					for (size_t k = 0; k < matchLength; k += offset) {
+						std::memcpy(op + k, match + k, std::min(offset, matchLength - k));
+					}
+				}
+				op += matchLength;
+			}
+
+			return op == opEnd;
+		}
+	};
+
 	//============================================================================
 	// File position
 	//============================================================================
@@ -104,9 +466,10 @@ namespace kvdb {
 		char h[4] = {'K', 'V', 'D', 'B'};
 		uint32 version = KVDB_FILE_VERSION;
 		uint32 keySize = 0;
-		ulong64 timestamp = 0;
+		ulong64 timestamp = 0; // stamp of matching index snapshot, 0 if modified after
 		uint32  endOfHeaderOffset = (uint32)sizeof(TFileHeader);
-		char reverved1[16] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+		ulong64 tableDirectory = 0; // position of table directory, 0 if tables are found by links only
+		char reverved1[8] = {0, 0, 0, 0, 0, 0, 0, 0};
 		char reverved2[16] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
 	} TFileHeader;
 	#pragma pack(pop)
@@ -121,6 +484,24 @@ namespace kvdb {
 		return is;
 	}
 
+	//============================================================================
+	// Index snapshot header
+	//============================================================================
+	#pragma pack(push,1)
+	typedef struct TIndexHeader {
+		char h[4] = {'K', 'V', 'D', 'I'};
+		uint32 version = KVDB_INDEX_VERSION;
+		uint32 keySize = 0;
+		ulong64 stamp = 0;
+		ulong64 fileSize = 0;
+		ulong64 tableCount = 0;
+		ulong64 liveCount = 0;
+		ulong64 freeCount = 0;
+		ulong64 reservedCount = 0;
+		ulong64 checksum = 0; // of data after header
+	} TIndexHeader;
+	#pragma pack(pop)
+
 	//============================================================================
 	// Table header
 	//============================================================================
@@ -133,6 +514,20 @@ namespace kvdb {
 
 	typedef TPosWrapper<TTableHeader> TTableHeaderInfo;
 
+	// positions of all key tables in link order, followed by capacity entries
+	#pragma pack(push,1)
+	typedef struct TTableDirectoryHeader {
+		ulong64 capacity = 0;
+		ulong64 count = 0;
+		ulong64 checksum = 0; // of count entries
+	} TTableDirectoryHeader;
+
+	typedef struct TTableDirectoryEntry {
+		ulong64 pos = 0;
+		ulong64 recordCount = 0;
+	} TTableDirectoryEntry;
+	#pragma pack(pop)
+
 	inline std::ostream* operator << (std::ostream* os, const TTableHeader& obj) {
 		write(os, obj);
 		return os;
@@ -152,7 +547,7 @@ namespace kvdb {
 		ulong64 dataLength = 0;
 		ulong64 initialDataLength = 0;
 		uint16 keySize = 0; //reserved
-		uint16 payloadSize = 0; //reserved
+		uint16 entryFlags = 0; // KVDB_ENTRY_* bits
 		ulong64 flags = 0;
 		//ulong64 payload = 0;
 	} TKeyEntryHeader;
@@ -163,550 +558,5576 @@ namespace kvdb {
 		TKeyData freeKeyData;
 	} TKeyEntry;
 
-	typedef TPosWrapper<TKeyEntry> TKeyEntryInfo;
-
-	struct TKeyInfoComparatorByInitialLength {
-		bool operator() (const TKeyEntryInfo& lhs, const TKeyEntryInfo& rhs) const {
-			return (lhs().header.initialDataLength > rhs().header.initialDataLength);
-		}
-	};
-
 	inline std::ostream* operator << (std::ostream* os, const TKeyEntry& obj) {
 		write(os, obj.header);
 		os->write((char*)obj.freeKeyData.data(), obj.freeKeyData.size());
 		return os;
 	}
 
-	inline std::ostream* operator << (std::ostream* os, const TKeyEntryInfo& objInfo) {
-		os->seekp(objInfo.pos);
-		os << objInfo();
-		return os;
-	}
+	//============================================================================
+	// In-memory key record
+	// what lookups and writes need, key itself is kept by the key map
+	//============================================================================
+	#pragma pack(push,1)
+	typedef struct TKeyRecord {
+		ulong64 dataPos = 0;
+		ulong64 slotPos = 0; // position of key entry in table
+		ulong64 dataLength = 0;
+		ulong64 capacity = 0; // initialDataLength
+		ulong64 flags = 0;
+		uint16 entryFlags = 0;
+	} TKeyRecord;
+	#pragma pack(pop)
 
 	//============================================================================
-	// File db
+	// Key map
+	// open addressing with linear probing over small slots (control byte and entry index),
+	// key and value are stored once in dense chunks. Lookup reads control bytes and 
+	// compares keys in place without allocation, find<N>() is specialized for key size 
+	// known at compile time. Values keep their address on insert, but erase moves last
+	// entry into the hole, so pointers returned by find() are invalid after any erase.
 	//============================================================================
+	template <typename T>
+	class TKeyMap {
 
-	class KvRawFile {
+		static_assert(std::is_trivially_copyable<T>::value && alignof(T) == 1, "packed value expected");
 
-	protected:
+	private:
+		static constexpr byte EMPTY = 0;
+		static constexpr byte DELETED = 1;
+		static constexpr size_t CHUNK_BITS = 10; // 1024 entries per chunk
+		static constexpr size_t CHUNK_MASK = ((size_t)1 << CHUNK_BITS) - 1;
+
+		size_t keyLength = 0;
+		size_t stride = 0; // key followed by value
+		size_t mask = 0;
+		size_t count = 0;
+		size_t used = 0; // full and deleted slots
+		std::vector<byte> ctrl; // EMPTY, DELETED or 0x80 | 7 bits of hash
+		std::vector<uint32> slots; // entry index of full slot
+		std::vector<std::unique_ptr<byte[]>> chunks; // entries 0..count-1 without holes
+
+		static byte tagOf(ulong64 h) {
+			return (byte)(0x80 | (h >> 57));
+		}
 
-		std::unordered_map<TKeyData, TKeyEntryInfo> dataMap;
-		std::fstream* filePtr = nullptr;
-		std::list<TKeyEntryInfo> reservedKeyList;
-		std::set<TKeyEntryInfo, TKeyInfoComparatorByInitialLength> deletedKeyList;
-		std::list<TTableHeaderInfo> tableList;
-		mutable std::mutex fileSharedMutex;
+		byte* entry(size_t n) const {
+			return chunks[n >> CHUNK_BITS].get() + (n & CHUNK_MASK) * stride;
+		}
 
-		const uint32 reservedKeys = KVDB_RESERVED_TABLE_SIZE;
+		T* valueOf(size_t n) const {
+			return reinterpret_cast<T*>(entry(n) + keyLength);
+		}
 
-	protected:
-		const volatile uint32 expandDataTo = 0; 
-		uint32 keySize = 0;
+		// put entry index to first free slot of its probe sequence
+		size_t place(ulong64 h, uint32 n) {
+			size_t i = h & mask;
+			while (ctrl[i] >= 0x80) i = (i + 1) & mask;
+			if (ctrl[i] == EMPTY) used++;
+			ctrl[i] = tagOf(h);
+			slots[i] = n;
+			return i;
+		}
 
-	protected:
+		void rehash(size_t newCapacity) {
+			ctrl.assign(newCapacity, EMPTY);
+			slots.assign(newCapacity, 0);
+			mask = newCapacity - 1;
+			used = 0;
 
-		void rewritePair(TKeyEntryInfo& keyInfo, const TValueData& valueData, const ulong64 k_flags) {
-			// rewrite value data
-			filePtr->seekp(keyInfo().header.dataPos);
-			filePtr->write((char*)valueData.data(), valueData.size());
-			// rewrite key data
-			keyInfo().header.dataLength = valueData.size(); // new length
-			keyInfo().header.flags = k_flags;
-			filePtr << keyInfo;
+			for (size_t n = 0; n < count; n++) {
+				place(hashKey(entry(n), keyLength), (uint32)n);
+			}
 		}
 
-		void earsePair(TKeyEntryInfo& keyInfo) {
-			// rewrite key data
-			keyInfo().header.dataLength = 0; // new length
-			keyInfo().header.flags = 0;
-			filePtr << keyInfo;
-			deletedKeyList.insert(keyInfo);
-			dataMap.erase(keyInfo().freeKeyData);
+		void grow() {
+			const size_t capacity = ctrl.size();
+			if (capacity == 0) {
+				rehash(16);
+			} else if ((count + 1) * 2 > capacity) {
+				rehash(capacity * 2);
+			} else {
+				rehash(capacity); // drop tombstones
+			}
 		}
 
-		void expandValueData(const TValueData& valueDataSrc, TValueData& valueDataNew, size_t size) {
-			valueDataNew.resize(size);
-			std::fill(valueDataNew.begin(), valueDataNew.end(), 0);
-			std::memcpy(valueDataNew.data(), valueDataSrc.data(), valueDataSrc.size());
+		template <size_t N>
+		size_t slotOf(const byte* key) const {
+			if (count == 0) return SIZE_MAX;
+			const size_t n = N ? N : keyLength;
+			const ulong64 h = hashKey(key, n);
+			const byte tag = tagOf(h);
+			for (size_t i = h & mask;; i = (i + 1) & mask) {
+				const byte c = ctrl[i];
+				if (c == EMPTY) return SIZE_MAX;
+				if (c == tag && std::memcmp(entry(slots[i]), key, n) == 0) return i;
+			}
 		}
 
-		void newPairFromReserved(const TKeyData& keyData, const TValueData& valueData, const ulong64 k_flags) {
-			// has reserved key slots
-			TKeyEntryInfo& keyInfo = reservedKeyList.front();
-			TValueData valueDataExp;
+	public:
+		void setKeySize(size_t size) {
+			assert(count == 0);
+			keyLength = size;
+			stride = size + sizeof(T);
+			ctrl.clear();
+			slots.clear();
+			chunks.clear();
+			used = 0;
+		}
 
-			if (expandDataTo > 0) {
-				uint32 n = (uint32)std::round((float)valueData.size() / (float)expandDataTo) + 1;
-				expandValueData(valueData, valueDataExp, (ulong64)n * (ulong64)expandDataTo);
-			} else {
-				valueDataExp = std::move(valueData);
-			}
+		size_t keySize() const { return keyLength; }
+		size_t size() const { return count; }
 
-			filePtr->seekp(0, std::ios::end); // to end-of-file
-			ulong64 endFile = (ulong64)(filePtr->tellp());
-			filePtr->write((char*)valueDataExp.data(), valueDataExp.size());
+		template <size_t N = 0>
+		T* find(const byte* key) {
+			assert(N == 0 || N == keyLength);
+			size_t i = slotOf<N>(key);
+			return (i == SIZE_MAX) ? nullptr : valueOf(slots[i]);
+		}
 
-			// fill key data
-			keyInfo().header.dataLength = valueData.size(); // length
-			keyInfo().header.initialDataLength = valueDataExp.size(); // length
-			keyInfo().header.dataPos = (valueData.size() > 0) ? endFile : 1; // allow zero length value
-			keyInfo().freeKeyData = keyData;
-			keyInfo().header.flags = k_flags;
-			filePtr << keyInfo;
+		template <size_t N = 0>
+		const T* find(const byte* key) const {
+			assert(N == 0 || N == keyLength);
+			size_t i = slotOf<N>(key);
+			return (i == SIZE_MAX) ? nullptr : valueOf(slots[i]);
+		}
 
-			// add new pair to table 
-			dataMap.insert({ keyInfo().freeKeyData, keyInfo });
-			reservedKeyList.pop_front();
+		T* find(const TKeyData& kd) {
+			return (kd.size() == keyLength) ? find(kd.data()) : nullptr;
 		}
 
-		void readKey(std::istream* is, TKeyEntry& ke) {
-			read(is, ke.header);
-			ke.freeKeyData.resize(keySize);
-			is->read((char*)ke.freeKeyData.data(), keySize);
+		const T* find(const TKeyData& kd) const {
+			return (kd.size() == keyLength) ? find(kd.data()) : nullptr;
 		}
 
-		static void writeKey(std::ostream* os, TKeyEntry& ke, uint32 size) {
-			if(ke.freeKeyData.size() == 0){
-				TKeyData kd;
-				kd.resize(size);
-				std::fill(kd.begin(), kd.end(), 0);
-				ke.freeKeyData = kd;
+		// insert or replace
+		T& insert(const byte* key, const T& value) {
+			if (T* v = find(key)) {
+				*v = value;
+				return *v;
 			}
 
-			os << ke;
+			if ((used + 1) * 4 > ctrl.size() * 3) grow(); // max load 3/4
+			assert(count < UINT32_MAX);
+
+			const size_t n = count;
+			if ((n >> CHUNK_BITS) == chunks.size()) {
+				chunks.emplace_back(new byte[(CHUNK_MASK + 1) * stride]);
+			}
+
+			std::memcpy(entry(n), key, keyLength);
+			std::memcpy(entry(n) + keyLength, &value, sizeof(T));
+			place(hashKey(key, keyLength), (uint32)n);
+			count++;
+			return *valueOf(n);
+		}
+
+		T& insert(const TKeyData& kd, const T& value) {
+			assert(kd.size() == keyLength);
+			return insert(kd.data(), value);
 		}
 
-		ulong64 readTable() {
-			ulong64 tablePos = (ulong64)filePtr->tellg();
+		// last entry moves into the hole, so entries stay dense and pointer to it is stale
+		bool erase(const byte* key) {
+			size_t i = slotOf<0>(key);
+			if (i == SIZE_MAX) return false;
+
+			const uint32 n = slots[i];
+			ctrl[i] = DELETED;
+			count--;
+
+			if (n != count) {
+				std::memcpy(entry(n), entry(count), stride);
+				const ulong64 h = hashKey(entry(n), keyLength);
+				size_t j = h & mask;
+				while (ctrl[j] < 0x80 || slots[j] != count) j = (j + 1) & mask;
+				slots[j] = n;
+			}
 
-			TTableHeader tableHeader;
-			filePtr >> tableHeader;
+			// keep one spare chunk
+			while (chunks.size() > (count >> CHUNK_BITS) + 2) chunks.pop_back();
+			return true;
+		}
 
-			for (unsigned int i = 0; i < tableHeader.recordCount; i++) {
-				ulong64 pos = (ulong64)filePtr->tellg();
-				TKeyEntry keyEntry;
-				readKey(filePtr, keyEntry);
+		bool erase(const TKeyData& kd) {
+			return (kd.size() == keyLength) ? erase(kd.data()) : false;
+		}
 
-				TKeyEntryInfo keyInfo(keyEntry, pos);
-				if (keyInfo().header.dataLength > 0) { 
-					dataMap.insert({ keyEntry.freeKeyData, keyInfo });
-				} else {
-					if (keyInfo().header.initialDataLength == 0) { 
-						if(keyInfo().header.dataPos == 1){ 
-							dataMap.insert({ keyEntry.freeKeyData, keyInfo }); // key with zero length data
-						} else {
-							reservedKeyList.push_back(keyInfo); // reserved key slot
-						}
-					} else {
-						deletedKeyList.insert(keyInfo); // marked as deleted pair
-					}
-				}
+		// deep copy, key size is taken from other
+		void copyFrom(const TKeyMap& other) {
+			keyLength = other.keyLength;
+			stride = other.stride;
+			mask = other.mask;
+			count = other.count;
+			used = other.used;
+			ctrl = other.ctrl;
+			slots = other.slots;
+			chunks.clear();
+			for (const auto& c : other.chunks) {
+				chunks.emplace_back(new byte[(CHUNK_MASK + 1) * stride]);
+				std::memcpy(chunks.back().get(), c.get(), (CHUNK_MASK + 1) * stride);
 			}
+		}
 
-			tableList.push_back(TTableHeaderInfo(tableHeader, tablePos));
-			return tableHeader.nextTable;
+		void reserve(size_t n) {
+			size_t capacity = 16;
+			while (capacity < n * 2) capacity *= 2;
+			if (capacity > ctrl.size()) rehash(capacity);
 		}
 
-		void createNewTable() {
-			filePtr->seekp(0, std::ios::end); // to end-of-file
-			ulong64 newTablePos = (ulong64)filePtr->tellp();
+		void clear() {
+			count = 0;
+			setKeySize(keyLength);
+		}
 
-			// write new table
-			TTableHeader newTable{reservedKeys, 0};
-			filePtr << newTable;
+		// heap bytes held by map
+		size_t memoryUsage() const {
+			return ctrl.capacity() + slots.capacity() * sizeof(uint32) 
+				+ chunks.capacity() * sizeof(chunks[0]) + chunks.size() * (CHUNK_MASK + 1) * stride;
+		}
 
-			// write reserved keys
-			for (uint32 i = 0; i < reservedKeys; i++) {
-				uint32 newReservedKeyPos = (uint32)filePtr->tellp();
-				TKeyEntry newReservedKey;
-				writeKey(filePtr, newReservedKey, keySize);
-				TKeyEntryInfo keyInfo(newReservedKey, newReservedKeyPos);
-				reservedKeyList.push_back(keyInfo);
-			}
+		// func(const byte* key, T& value), map must not change while iterated
+		template <typename F>
+		void forEach(F func) {
+			for (size_t n = 0; n < count; n++) func(entry(n), *valueOf(n));
+		}
 
-			// read previous last table 
-			TTableHeaderInfo& lastTable = tableList.back();
+		template <typename F>
+		void forEach(F func) const {
+			for (size_t n = 0; n < count; n++) func(entry(n), (const T&)*valueOf(n));
+		}
+	};
 
-			// add link to new table
-			lastTable().nextTable = newTablePos;
+	//============================================================================
+	// Ordered key index
+	// keys sorted by (order code, key bytes) in blocks of up to BLOCK_MAX entries.
+	// Lookup searches block bounds first, then entries of one block.
+	//============================================================================
+	class TOrderedIndex {
 
-			// rewrite previous last table
-			filePtr->seekp(lastTable.pos);
-			filePtr << lastTable();
+	private:
+		static constexpr size_t BLOCK_MAX = 512;
 
-			// add new table to internal list
-			tableList.push_back(TTableHeaderInfo(newTable, newTablePos));
+		typedef struct TBlock {
+			std::vector<ulong64> codes;
+			std::vector<byte> keys;
+		} TBlock;
+
+		size_t keyLength = 0;
+		size_t count = 0;
+		std::vector<TBlock> blocks;
+
+		bool less(ulong64 codeA, const byte* keyA, ulong64 codeB, const byte* keyB) const {
+			if (codeA != codeB) return codeA < codeB;
+			return std::memcmp(keyA, keyB, keyLength) < 0;
 		}
 
-		bool hasReserved() const {
-			return reservedKeyList.size() > 0;
+		const byte* keyAt(const TBlock& b, size_t i) const {
+			return b.keys.data() + i * keyLength;
 		}
 
-		bool tryWriteToSuitableDeletedPair(const TKeyData& keyData, const TValueData& valueData, const ulong64 k_flags) {
-			for (auto itr = deletedKeyList.begin(); itr != deletedKeyList.end();) {
-				TKeyEntryInfo keyInfo = *itr;
-				if (keyInfo().header.initialDataLength >= valueData.size()) {
-					keyInfo().freeKeyData = keyData;
-					keyInfo().header.flags = k_flags;
-					rewritePair(keyInfo, valueData, k_flags);
-					dataMap.insert({ keyInfo().freeKeyData, keyInfo });
-					itr = deletedKeyList.erase(itr);
-					return true;
-				} else {
-					++itr;
-				}
+		// first block with last entry not less than (code, key)
+		size_t blockOf(ulong64 code, const byte* key) const {
+			size_t lo = 0, hi = blocks.size();
+			while (lo < hi) {
+				const size_t mid = (lo + hi) / 2;
+				const TBlock& b = blocks[mid];
+				if (less(b.codes.back(), keyAt(b, b.codes.size() - 1), code, key)) lo = mid + 1; else hi = mid;
 			}
-			return false;
+			return lo;
 		}
 
-		void addNew(const TKeyData& keyData, const TValueData& valueData, const ulong64 k_flags) {
-			if (!tryWriteToSuitableDeletedPair(keyData, valueData, k_flags)) {
-				if (hasReserved()) {
-					newPairFromReserved(keyData, valueData, k_flags);
-				} else {
-					createNewTable();
-					newPairFromReserved(keyData, valueData, k_flags);
-				}
+		// first entry of block not less than (code, key)
+		size_t entryOf(const TBlock& b, ulong64 code, const byte* key) const {
+			size_t lo = 0, hi = b.codes.size();
+			while (lo < hi) {
+				const size_t mid = (lo + hi) / 2;
+				if (less(b.codes[mid], keyAt(b, mid), code, key)) lo = mid + 1; else hi = mid;
 			}
+			return lo;
 		}
 
-		void change(const TKeyData& keyData, const TValueData& valueData, const ulong64 k_flags) {
-			TKeyEntryInfo& keyInfo = dataMap[keyData];
-			if (valueData.size() > 0) {
-				if (keyInfo().header.initialDataLength >= valueData.size()) {
-					rewritePair(keyInfo, valueData, k_flags);
-				} else {
-					//remove old and create new
-					earsePair(keyInfo);
-					addNew(keyData, valueData, k_flags);
-				}
-			} else {
-				// erase
-				earsePair(keyInfo);
-			}
+		bool equal(const TBlock& b, size_t i, ulong64 code, const byte* key) const {
+			return i < b.codes.size() && b.codes[i] == code && std::memcmp(keyAt(b, i), key, keyLength) == 0;
 		}
 
 	public:
-
-		KvRawFile() { }
-
-		explicit KvRawFile(uint32 s) : expandDataTo(s) { }
-
-		~KvRawFile() {
-			close();
+		void setKeySize(size_t size) {
+			keyLength = size;
+			clear();
 		}
 
-		void close() {
-			if (!isOpen()) return;
-			filePtr->close();
-			dataMap.clear();
-			reservedKeyList.clear();
-			deletedKeyList.clear();
-			tableList.clear();
+		void clear() {
+			blocks.clear();
+			count = 0;
 		}
 
-		bool isOpen() const {
-			return filePtr && filePtr->is_open();
-		}
+		size_t size() const { return count; }
 
-		int open(const std::string& file) {
-			filePtr = new std::fstream(file, std::ios::in | std::ios::out | std::ios::binary);
+		void insert(ulong64 code, const byte* key) {
+			size_t bi = 0;
+			if (blocks.empty()) {
+				blocks.emplace_back();
+			} else {
+				bi = std::min(blockOf(code, key), blocks.size() - 1);
+			}
 
-			if (!isOpen()) return KVDB_ERROR_OPEN_FILE;
+			TBlock& b = blocks[bi];
+			const size_t i = entryOf(b, code, key);
+			if (equal(b, i, code, key)) return;
+
+			b.codes.insert(b.codes.begin() + i, code);
+			b.keys.insert(b.keys.begin() + i * keyLength, key, key + keyLength);
+			count++;
+
+			if (b.codes.size() > BLOCK_MAX) {
+				const size_t half = b.codes.size() / 2;
+				TBlock upper;
+				upper.codes.assign(b.codes.begin() + half, b.codes.end());
+				upper.keys.assign(b.keys.begin() + half * keyLength, b.keys.end());
+				b.codes.resize(half);
+				b.keys.resize(half * keyLength);
+				blocks.insert(blocks.begin() + bi + 1, std::move(upper));
+			}
+		}
 
-			TFileHeader fileHeader;
-			filePtr >> fileHeader;
+		void erase(ulong64 code, const byte* key) {
+			const size_t bi = blockOf(code, key);
+			if (bi == blocks.size()) return;
 
-			if(fileHeader.version != KVDB_FILE_VERSION){
-				filePtr->close();
-				return KVDB_ERROR_INCORRECT_FILE_VERSION;
-			}
+			TBlock& b = blocks[bi];
+			const size_t i = entryOf(b, code, key);
+			if (!equal(b, i, code, key)) return;
 
-			ulong64 nextTablePos = readTable();
-			while (nextTablePos > 0) {
-				filePtr->seekg(nextTablePos);
-				nextTablePos = readTable();
-			}
+			b.codes.erase(b.codes.begin() + i);
+			b.keys.erase(b.keys.begin() + i * keyLength, b.keys.begin() + (i + 1) * keyLength);
+			count--;
 
-			return KVDB_OK;
+			if (b.codes.empty()) blocks.erase(blocks.begin() + bi);
 		}
 
-		size_t size() {
-			if (!isOpen()) {
-				return 0;
-			} else {
-				return dataMap.size();
+		// bulk load of unordered (code, key) pairs
+		void build(std::vector<std::pair<ulong64, const byte*>>& entries) {
+			clear();
+			std::sort(entries.begin(), entries.end(), [&](const auto& a, const auto& b) { return less(a.first, a.second, b.first, b.second); });
+
+			for (size_t i = 0; i < entries.size(); i += BLOCK_MAX / 2) {
+				TBlock b;
+				const size_t n = std::min(BLOCK_MAX / 2, entries.size() - i);
+				b.codes.reserve(n);
+				b.keys.reserve(n * keyLength);
+				for (size_t k = i; k < i + n; k++) {
+					b.codes.push_back(entries[k].first);
+					b.keys.insert(b.keys.end(), entries[k].second, entries[k].second + keyLength);
+				}
+				blocks.push_back(std::move(b));
 			}
-		}
 
-		bool isExist(const TKeyData& kd) {
-			if (!isOpen()) return false;
-			std::lock_guard<std::mutex> guard(fileSharedMutex);
-			return !(dataMap.find(kd) == dataMap.end());
+			count = entries.size();
 		}
 
-		ulong64 k_flags(const TKeyData& kd) const {
-			if (!isOpen()) return 0;
+		// append up to max keys from (code, key) to (hiCode, hiKey) inclusive, starting after 
+		// (code, key) if exclusive. Returns number of keys appended.
+		size_t scan(ulong64 code, const byte* key, bool exclusive, ulong64 hiCode, const byte* hiKey, size_t max, std::vector<byte>& out) const {
+			size_t n = 0;
+			size_t bi = blockOf(code, key);
+			size_t i = (bi < blocks.size()) ? entryOf(blocks[bi], code, key) : 0;
+
+			for (; bi < blocks.size() && n < max; bi++, i = 0) {
+				const TBlock& b = blocks[bi];
+				for (; i < b.codes.size() && n < max; i++) {
+					if (less(hiCode, hiKey, b.codes[i], keyAt(b, i))) return n;
+					if (exclusive && equal(b, i, code, key)) continue;
+					out.insert(out.end(), keyAt(b, i), keyAt(b, i) + keyLength);
+					n++;
+				}
+			}
 
-			std::lock_guard<std::mutex> guard(fileSharedMutex);
+			return n;
+		}
 
-			if (auto a = dataMap.find(kd); a != dataMap.end()) {
-				const auto ki = a->second;
-				return ki().header.flags;
-			}
-			
-			return 0;
+		size_t memoryUsage() const {
+			size_t bytes = blocks.capacity() * sizeof(TBlock);
+			for (const auto& b : blocks) bytes += b.codes.capacity() * sizeof(ulong64) + b.keys.capacity();
+			return bytes;
 		}
+	};
 
-		TValueDataPtr loadData(const TKeyData& kd) const {
-			if (!isOpen()) return nullptr;
+	//============================================================================
+	// Free space
+	// every free value extent is kept on disk as deleted key slot
+	//============================================================================
+	typedef struct TFreeExtent {
+		ulong64 dataPos = 0;
+		ulong64 length = 0;
+		ulong64 slotPos = 0;
+	} TFreeExtent;
 
-			std::lock_guard<std::mutex> guard(fileSharedMutex);
+	class TFreeSpace {
 
-			auto got = dataMap.find(kd);
-			if (got == dataMap.end()) return nullptr;
+	private:
+		std::map<ulong64, TFreeExtent> byPos;
+		std::set<std::pair<ulong64, ulong64>> bySize; // length, dataPos
+		ulong64 totalLength = 0;
 
-			const TKeyEntryInfo& i = got->second;
-			const TKeyEntry& e = i();
+	public:
+		void insert(const TFreeExtent& e) {
+			byPos[e.dataPos] = e;
+			bySize.insert({ e.length, e.dataPos });
+			totalLength += e.length;
+		}
 
-			filePtr->seekg(e.header.dataPos);
+		void remove(ulong64 dataPos) {
+			auto itr = byPos.find(dataPos);
+			if (itr == byPos.end()) return;
+			bySize.erase({ itr->second.length, dataPos });
+			totalLength -= itr->second.length;
+			byPos.erase(itr);
+		}
 
-			TValueDataPtr dataPtr = TValueDataPtr(new TValueData);
-			dataPtr->resize(e.header.dataLength);
+		// smallest extent not less than size
+		const TFreeExtent* bestFit(ulong64 size) const {
+			auto itr = bySize.lower_bound({ size, 0 });
+			if (itr == bySize.end()) return nullptr;
+			return &byPos.find(itr->second)->second;
+		}
 
-			if (filePtr->read((char*)dataPtr->data(), e.header.dataLength)) {
-				return dataPtr;
+		// smallest of first few extents not less than size that start at multiple of alignment
+		const TFreeExtent* bestFitAligned(ulong64 size, ulong64 alignment) const {
+			auto itr = bySize.lower_bound({ size, 0 });
+			for (int i = 0; itr != bySize.end() && i < KVDB_ALIGNED_FIT_SCAN; ++itr, i++) {
+				if (itr->second % alignment == 0) return &byPos.find(itr->second)->second;
 			}
-
 			return nullptr;
 		}
 
-		void erase(const TKeyData& kd) {
-			if (!isOpen()) return;
-			std::lock_guard<std::mutex> guard(fileSharedMutex);
+		// smallest of first few extents not less than size that starts below limit
+		const TFreeExtent* bestFitBelow(ulong64 size, ulong64 limit) const {
+			auto itr = bySize.lower_bound({ size, 0 });
+			for (int i = 0; itr != bySize.end() && i < KVDB_COMPACT_FIT_SCAN; ++itr, i++) {
+				if (itr->second < limit) return &byPos.find(itr->second)->second;
+			}
+			return nullptr;
+		}
 
-			if (auto i = dataMap.find(kd); i != dataMap.end()) {
-				earsePair(i->second);
+		// lowest of first few extents below limit which fits size
+		const TFreeExtent* firstFitBelow(ulong64 size, ulong64 limit) const {
+			auto itr = byPos.begin();
+			for (int i = 0; itr != byPos.end() && itr->first < limit && i < KVDB_COMPACT_FIT_SCAN; ++itr, i++) {
+				if (itr->second.length >= size) return &itr->second;
 			}
+			return nullptr;
+		}
+
+		const TFreeExtent* first() const {
+			return byPos.empty() ? nullptr : &byPos.begin()->second;
+		}
+
+		const TFreeExtent* last() const {
+			return byPos.empty() ? nullptr : &byPos.rbegin()->second;
+		}
+
+		// extent starting at pos
+		const TFreeExtent* at(ulong64 pos) const {
+			auto itr = byPos.find(pos);
+			return (itr == byPos.end()) ? nullptr : &itr->second;
+		}
+
+		// extent ending at pos
+		const TFreeExtent* before(ulong64 pos) const {
+			auto itr = byPos.lower_bound(pos);
+			if (itr == byPos.begin()) return nullptr;
+			--itr;
+			return (itr->second.dataPos + itr->second.length == pos) ? &itr->second : nullptr;
+		}
+
+		size_t size() const { return byPos.size(); }
+		ulong64 bytes() const { return totalLength; }
+		ulong64 largest() const { return bySize.empty() ? 0 : bySize.rbegin()->first; }
+
+		void clear() {
+			byPos.clear();
+			bySize.clear();
+			totalLength = 0;
+		}
+
+		const std::map<ulong64, TFreeExtent>& extents() const { return byPos; }
+	};
+
+	//============================================================================
+	// Read-only value view
+	//============================================================================
+	class TValueView {
+
+	private:
+		const byte* ptr = nullptr;
+		size_t length = 0;
+		std::shared_ptr<const void> guard; // keeps mapping or buffer alive
+
+	public:
+		TValueView() {};
+		TValueView(const byte* p, size_t l, std::shared_ptr<const void> g) : ptr(p), length(l), guard(std::move(g)) {};
+
+		const byte* data() const { return ptr; }
+		size_t size() const { return length; }
+		const byte* begin() const { return ptr; }
+		const byte* end() const { return ptr + length; }
+		explicit operator bool() const { return guard != nullptr; }
+	};
+
+	template <typename V>
+	class TValueRef {
+
+		static_assert(std::is_trivially_copyable<V>::value, "TValueRef requires trivially copyable value type");
+
+	private:
+		TValueView view;
+		V copy{};
+		bool inplace = false;
+
+	public:
+		TValueRef() {};
+
+		explicit TValueRef(TValueView v) : view(std::move(v)) {
+			if (!view) return;
+			if (view.size() >= sizeof(V) && ((uintptr_t)view.data() % alignof(V)) == 0) {
+				inplace = true;
+			} else {
+				// unaligned or short value: fall back to a private copy
+				std::memcpy(&copy, view.data(), std::min(view.size(), sizeof(V)));
+			}
+		}
+
+		const V* get() const { return inplace ? std::launder(reinterpret_cast<const V*>(view.data())) : &copy; }
+		const V& operator*() const { return *get(); }
+		const V* operator->() const { return get(); }
+		explicit operator bool() const { return (bool)view; }
+	};
+
+#ifdef KVDB_POSIX_IO
+	//============================================================================
+	// Memory mapping
+	//============================================================================
+	class TFileMapping {
+
+	private:
+		byte* addr = nullptr;
+		size_t length = 0;
+
+	public:
+		TFileMapping(byte* a, size_t l) : addr(a), length(l) {};
+		TFileMapping(const TFileMapping&) = delete;
+		TFileMapping& operator=(const TFileMapping&) = delete;
+
+		~TFileMapping() {
+			if (addr) munmap(addr, length);
+		}
+
+		const byte* data() const { return addr; }
+		size_t size() const { return length; }
+
+		static std::shared_ptr<TFileMapping> map(int fd, size_t length) {
+			void* a = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+			if (a == MAP_FAILED) return nullptr;
+			return std::make_shared<TFileMapping>((byte*)a, length);
+		}
+	};
+#endif
+
+	//============================================================================
+	// Write batch
+	//============================================================================
+	class TWriteBatch {
+
+	public:
+		typedef struct TBatchOp {
+			TKeyData key;
+			TValueData value;
+			ulong64 flags = 0;
+			bool erase = false;
+			bool patch = false; // value is written at offset of stored value
+			ulong64 offset = 0;
+			bool append = false; // patch at end of stored value
+		} TBatchOp;
+
+	private:
+		std::vector<TBatchOp> opList;
+
+	public:
+		void put(const TKeyData& kd, const TValueData& valueData, const ulong64 k_flags = 0x0) {
+			opList.push_back(TBatchOp{ kd, valueData, k_flags, false });
+		}
+
+		void put(TKeyData&& kd, TValueData&& valueData, const ulong64 k_flags = 0x0) {
+			opList.push_back(TBatchOp{ std::move(kd), std::move(valueData), k_flags, false });
+		}
+
+		void erase(const TKeyData& kd) {
+			opList.push_back(TBatchOp{ kd, TValueData(), 0, true });
+		}
+
+		// partial update of existing value, see KvRawFile::update()
+		void update(const TKeyData& kd, ulong64 offset, const TValueData& bytes) {
+			opList.push_back(TBatchOp{ kd, bytes, 0, false, true, offset });
+		}
+
+		// bytes after end of value, see KvRawFile::append()
+		void append(const TKeyData& kd, const TValueData& bytes) {
+			opList.push_back(TBatchOp{ kd, bytes, 0, false, true, 0, true });
+		}
+
+		void clear() { opList.clear(); }
+		size_t size() const { return opList.size(); }
+		const std::vector<TBatchOp>& ops() const { return opList; }
+	};
+
+	//============================================================================
+	// Write buffer
+	// collects writes of one batch: appends go to one sequential block,
+	// overlapping or adjacent patches are merged into larger writes
+	//============================================================================
+	class TWriteBuffer {
+
+	public:
+		ulong64 appendPos = 0;
+		std::vector<byte> appendData;
+		std::map<ulong64, std::vector<byte>> patches;
+
+		explicit TWriteBuffer(ulong64 endOfFile) : appendPos(endOfFile) {};
+
+		ulong64 append(const byte* src, size_t size) {
+			ulong64 pos = appendPos + appendData.size();
+			appendData.insert(appendData.end(), src, src + size);
+			return pos;
+		}
+
+		void patch(ulong64 pos, const byte* src, size_t size) {
+			if (size == 0) return;
+
+			if (pos >= appendPos) {
+				// not yet written tail
+				assert(pos + size <= appendPos + appendData.size());
+				std::memcpy(appendData.data() + (pos - appendPos), src, size);
+				return;
+			}
+
+			const ulong64 end = pos + size;
+			auto first = patches.upper_bound(pos);
+			if (first != patches.begin()) {
+				auto prev = std::prev(first);
+				if (prev->first + prev->second.size() >= pos) first = prev;
+			}
+
+			auto last = first;
+			ulong64 start = pos;
+			ulong64 stop = end;
+			while (last != patches.end() && last->first <= end) {
+				start = std::min(start, last->first);
+				stop = std::max(stop, last->first + last->second.size());
+				++last;
+			}
+
+			if (first != patches.end() && std::next(first) == last && first->first <= pos) {
+				// extend single patch in place, common case for sequential key slots
+				std::vector<byte>& data = first->second;
+				if (data.size() < stop - start) data.resize(stop - start);
+				std::memcpy(data.data() + (pos - start), src, size);
+				return;
+			}
+
+			std::vector<byte> merged(stop - start);
+			for (auto i = first; i != last; ++i) {
+				std::memcpy(merged.data() + (i->first - start), i->second.data(), i->second.size());
+			}
+			std::memcpy(merged.data() + (pos - start), src, size);
+
+			patches.erase(first, last);
+			patches.emplace(start, std::move(merged));
+		}
+	};
+
+	//============================================================================
+	// Key table pages
+	// dirty pages of key tables, changed entries are kept here and written back
+	// page by page in file order. Page is clipped to key entries of its table.
+	//============================================================================
+	class TTablePages {
+
+	private:
+		std::map<ulong64, std::vector<byte>> pages; // by start position
+		size_t total = 0;
+		std::chrono::steady_clock::time_point since; // first change after last flush
+
+	public:
+		// entry at pos lies in key entries [first, last) of one table,
+		// load(pos, dst, size) reads page from file when it is not buffered yet
+		template <typename F>
+		bool patch(ulong64 pos, const byte* src, size_t size, ulong64 first, ulong64 last, F load) {
+			if (pages.empty()) since = std::chrono::steady_clock::now();
+
+			while (size > 0) {
+				const ulong64 aligned = pos & ~(ulong64)(KVDB_TABLE_PAGE_SIZE - 1);
+				const ulong64 start = std::max(aligned, first);
+				const ulong64 end = std::min(aligned + KVDB_TABLE_PAGE_SIZE, last);
+
+				auto itr = pages.find(start);
+				if (itr == pages.end()) {
+					std::vector<byte> page(end - start);
+					if (!load(start, page.data(), page.size())) return false;
+					total += page.size();
+					itr = pages.emplace(start, std::move(page)).first;
+				}
+
+				const size_t n = (size_t)std::min<ulong64>(size, end - pos);
+				std::memcpy(itr->second.data() + (pos - start), src, n);
+				pos += n;
+				src += n;
+				size -= n;
+			}
+			return true;
+		}
+
+		bool due(size_t maxBytes, uint32 intervalMs) const {
+			if (pages.empty()) return false;
+			return total >= maxBytes || std::chrono::steady_clock::now() - since >= std::chrono::milliseconds(intervalMs);
+		}
+
+		// write(pos, data, size), adjacent pages go in one call
+		template <typename F>
+		void flush(F write) {
+			std::vector<byte> run;
+			ulong64 runPos = 0;
+			for (const auto& p : pages) {
+				if (!run.empty() && runPos + run.size() != p.first) {
+					write(runPos, run.data(), run.size());
+					run.clear();
+				}
+				if (run.empty()) runPos = p.first;
+				run.insert(run.end(), p.second.begin(), p.second.end());
+			}
+			if (!run.empty()) write(runPos, run.data(), run.size());
+			clear();
+		}
+
+		void clear() {
+			pages.clear();
+			total = 0;
+		}
+
+		bool empty() const { return pages.empty(); }
+		size_t bytes() const { return total; }
+	};
+
+	//============================================================================
+	// Write-ahead log
+	//============================================================================
+	#pragma pack(push,1)
+	typedef struct TWalRecordHeader {
+		ulong64 checksum = 0; // of fields below and record body
+		uint32 type = 0;
+		uint32 keySize = 0;
+		ulong64 valueSize = 0;
+		ulong64 flags = 0;
+		ulong64 offset = 0; // of patch
+	} TWalRecordHeader;
+	#pragma pack(pop)
+
+	class TWalFile {
+
+	private:
+		std::string path;
+#ifdef KVDB_POSIX_IO
+		int fd = -1;
+#else
+		std::ofstream* out = nullptr;
+#endif
+		ulong64 length = 0;
+
+	public:
+		~TWalFile() {
+			close();
+		}
+
+		bool open(const std::string& file) {
+			path = file;
+			std::error_code ec;
+			length = std::filesystem::exists(path, ec) ? (ulong64)std::filesystem::file_size(path, ec) : 0;
+#ifdef KVDB_POSIX_IO
+			fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+			return fd >= 0;
+#else
+			out = new std::ofstream(path, std::ios::out | std::ios::binary | std::ios::app);
+			return out->is_open();
+#endif
+		}
+
+		void close() {
+#ifdef KVDB_POSIX_IO
+			if (fd >= 0) ::close(fd);
+			fd = -1;
+#else
+			delete out;
+			out = nullptr;
+#endif
+		}
+
+		bool append(const std::vector<byte>& data) {
+			length += data.size();
+#ifdef KVDB_POSIX_IO
+			const byte* src = data.data();
+			size_t size = data.size();
+			while (size > 0) {
+				ssize_t n = ::write(fd, src, size);
+				if (n <= 0) return false;
+				src += n;
+				size -= n;
+			}
+			return true;
+#else
+			out->write((char*)data.data(), data.size());
+			out->flush();
+			return (bool)*out;
+#endif
+		}
+
+		// no real sync without posix io
+		void sync() {
+#ifdef KVDB_POSIX_IO
+			if (fd >= 0) fdatasync(fd);
+#endif
+		}
+
+		void truncate() {
+			std::error_code ec;
+			std::filesystem::resize_file(path, 0, ec);
+			length = 0;
+			sync();
+		}
+
+		ulong64 size() const { return length; }
+
+		bool isOpen() const {
+#ifdef KVDB_POSIX_IO
+			return fd >= 0;
+#else
+			return out != nullptr;
+#endif
+		}
+
+		static void encode(const TWriteBatch& batch, std::vector<byte>& out) {
+			const auto& ops = batch.ops();
+			for (size_t i = 0; i < ops.size(); i++) {
+				const auto& op = ops[i];
+
+				TWalRecordHeader h;
+				h.type = (op.erase ? KVDB_WAL_ERASE : op.patch ? KVDB_WAL_PATCH : KVDB_WAL_PUT) | ((i + 1 < ops.size()) ? KVDB_WAL_CONTINUED : 0);
+				h.keySize = (uint32)op.key.size();
+				h.valueSize = op.value.size();
+				h.flags = op.flags;
+				h.offset = op.offset;
+
+				const size_t start = out.size();
+				out.resize(start + sizeof(TWalRecordHeader));
+				out.insert(out.end(), op.key.begin(), op.key.end());
+				out.insert(out.end(), op.value.begin(), op.value.end());
+
+				const size_t offset = sizeof(h.checksum);
+				std::memcpy(out.data() + start, &h, sizeof(TWalRecordHeader));
+				h.checksum = checksum(out.data() + start + offset, out.size() - start - offset);
+				std::memcpy(out.data() + start, &h.checksum, sizeof(h.checksum));
+			}
+		}
+
+		// complete batches of log, stops at first torn or corrupted record
+		static std::vector<TWriteBatch> decode(const std::string& file) {
+			std::vector<TWriteBatch> result;
+
+			std::ifstream in(file, std::ios::in | std::ios::binary);
+			if (!in) return result;
+			std::vector<byte> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+			TWriteBatch pending;
+			size_t pos = 0;
+			while (pos + sizeof(TWalRecordHeader) <= data.size()) {
+				TWalRecordHeader h;
+				std::memcpy(&h, data.data() + pos, sizeof(TWalRecordHeader));
+
+				const ulong64 end = pos + sizeof(TWalRecordHeader) + h.keySize + h.valueSize;
+				if (end > data.size() || end < pos) break;
+
+				const size_t offset = sizeof(h.checksum);
+				if (checksum(data.data() + pos + offset, end - pos - offset) != h.checksum) break;
+
+				const byte* body = data.data() + pos + sizeof(TWalRecordHeader);
+				TKeyData kd(body, body + h.keySize);
+				if ((h.type & 0xff) == KVDB_WAL_ERASE) {
+					pending.erase(kd);
+				} else if ((h.type & 0xff) == KVDB_WAL_PATCH) {
+					pending.update(kd, h.offset, TValueData(body + h.keySize, body + h.keySize + h.valueSize));
+				} else {
+					pending.put(std::move(kd), TValueData(body + h.keySize, body + h.keySize + h.valueSize), h.flags);
+				}
+
+				if ((h.type & KVDB_WAL_CONTINUED) == 0) {
+					result.push_back(std::move(pending));
+					pending.clear();
+				}
+
+				pos = end;
+			}
+
+			return result;
+		}
+	};
+
+	//============================================================================
+	// Value cache
+	// byte bounded segmented LRU. New values enter probation segment and move to
+	// protected segment when read again, so values read once by a scan are evicted
+	// before values that are read repeatedly. Cached buffers are shared with callers.
+	//============================================================================
+	typedef struct TCacheStats {
+		ulong64 hits = 0;
+		ulong64 misses = 0;
+		ulong64 evictions = 0;
+		ulong64 bytes = 0;
+		ulong64 entries = 0;
+	} TCacheStats;
+
+	class TValueCache {
+
+	private:
+		static constexpr uint32 NIL = UINT32_MAX;
+		static constexpr int PROBATION = 0;
+		static constexpr int PROTECTED = 1;
+
+		#pragma pack(push,1)
+		typedef struct TCacheSlot {
+			uint32 index = 0;
+		} TCacheSlot;
+		#pragma pack(pop)
+
+		typedef struct TCacheEntry {
+			TValueDataPtr value;
+			TKeyData key;
+			size_t cost = 0;
+			uint32 prev = NIL;
+			uint32 next = NIL;
+			int segment = PROBATION;
+		} TCacheEntry;
+
+		typedef struct TSegment {
+			uint32 head = NIL;
+			uint32 tail = NIL;
+			size_t bytes = 0;
+		} TSegment;
+
+		// part of the cache behind its own mutex, keys are spread by hash
+		class TShard {
+
+		public:
+			std::mutex mutex;
+			size_t capacity = 0;
+			TKeyMap<TCacheSlot> index;
+			std::vector<TCacheEntry> entries;
+			std::vector<uint32> freeList;
+			TSegment segments[2];
+			ulong64 hits = 0;
+			ulong64 misses = 0;
+			ulong64 evictions = 0;
+
+			void unlink(uint32 i) {
+				TCacheEntry& e = entries[i];
+				TSegment& s = segments[e.segment];
+				if (e.prev != NIL) entries[e.prev].next = e.next; else s.head = e.next;
+				if (e.next != NIL) entries[e.next].prev = e.prev; else s.tail = e.prev;
+				s.bytes -= e.cost;
+				e.prev = e.next = NIL;
+			}
+
+			void pushFront(int segment, uint32 i) {
+				TCacheEntry& e = entries[i];
+				TSegment& s = segments[segment];
+				e.segment = segment;
+				e.prev = NIL;
+				e.next = s.head;
+				if (s.head != NIL) entries[s.head].prev = i; else s.tail = i;
+				s.head = i;
+				s.bytes += e.cost;
+			}
+
+			void drop(uint32 i) {
+				unlink(i);
+				index.erase(entries[i].key.data());
+				entries[i] = TCacheEntry();
+				freeList.push_back(i);
+			}
+
+			// protected segment keeps up to 80% of budget, its tail goes back to probation
+			void balance() {
+				const size_t limit = capacity / 5 * 4;
+				while (segments[PROTECTED].bytes > limit && segments[PROTECTED].tail != NIL) {
+					const uint32 i = segments[PROTECTED].tail;
+					unlink(i);
+					pushFront(PROBATION, i);
+				}
+			}
+
+			void evict() {
+				while (segments[PROBATION].bytes + segments[PROTECTED].bytes > capacity) {
+					uint32 victim = segments[PROBATION].tail;
+					if (victim == NIL) victim = segments[PROTECTED].tail;
+					if (victim == NIL) break;
+					drop(victim);
+					evictions++;
+				}
+			}
+
+			void clear() {
+				index.clear();
+				entries.clear();
+				freeList.clear();
+				segments[PROBATION] = TSegment();
+				segments[PROTECTED] = TSegment();
+			}
+
+			size_t costOf(const TValueDataPtr& value) const {
+				return value->capacity() + index.keySize() + sizeof(TCacheEntry) + sizeof(TCacheSlot) * 2;
+			}
+		};
+
+		mutable TShard shards[KVDB_CACHE_SHARDS];
+		std::atomic<size_t> capacity{0};
+		std::atomic<size_t> keySize{0};
+		std::atomic<uint32> shardCount{1};
+
+		// high hash bits, key map of each shard indexes by low bits
+		static uint32 shardOf(ulong64 hash, uint32 count) {
+			return (uint32)((hash >> 40) % count);
+		}
+
+		// calls f with locked shard of key. Shard count changes only while all shards are locked
+		template <typename F>
+		auto withShard(const byte* key, F f) {
+			const ulong64 hash = hashKey(key, keySize);
+			for (;;) {
+				const uint32 count = shardCount;
+				TShard& shard = shards[shardOf(hash, count)];
+				std::lock_guard<std::mutex> guard(shard.mutex);
+				if (count == shardCount) return f(shard);
+			}
+		}
+
+	public:
+		void setKeySize(size_t size) {
+			std::unique_lock<std::mutex> locks[KVDB_CACHE_SHARDS];
+			for (uint32 i = 0; i < KVDB_CACHE_SHARDS; i++) locks[i] = std::unique_lock<std::mutex>(shards[i].mutex);
+			keySize = size;
+			for (TShard& shard : shards) {
+				shard.clear();
+				shard.index.setKeySize(size);
+			}
+		}
+
+		// zero disables cache. Each shard keeps at least KVDB_CACHE_SHARD_MIN_SIZE bytes,
+		// cached values are dropped when shard count changes.
+		void setCapacity(size_t bytes) {
+			std::unique_lock<std::mutex> locks[KVDB_CACHE_SHARDS];
+			for (uint32 i = 0; i < KVDB_CACHE_SHARDS; i++) locks[i] = std::unique_lock<std::mutex>(shards[i].mutex);
+			const uint32 count = (uint32)std::clamp<size_t>(bytes / KVDB_CACHE_SHARD_MIN_SIZE, 1, KVDB_CACHE_SHARDS);
+			if (count != shardCount) {
+				for (TShard& shard : shards) shard.clear();
+				shardCount = count;
+			}
+			capacity = bytes;
+			for (uint32 i = 0; i < count; i++) {
+				shards[i].capacity = bytes / count;
+				shards[i].balance();
+				shards[i].evict();
+			}
+		}
+
+		bool enabled() const {
+			return capacity > 0;
+		}
+
+		template <size_t N = 0>
+		TValueDataPtr get(const byte* key) {
+			return withShard(key, [key](TShard& shard) -> TValueDataPtr {
+				const TCacheSlot* slot = shard.index.template find<N>(key);
+				if (slot == nullptr) {
+					shard.misses++;
+					return nullptr;
+				}
+
+				const uint32 i = slot->index;
+				shard.unlink(i);
+				shard.pushFront(PROTECTED, i);
+				shard.balance();
+				shard.hits++;
+				return shard.entries[i].value;
+			});
+		}
+
+		void put(const byte* key, const TValueDataPtr& value) {
+			withShard(key, [key, &value](TShard& shard) {
+				const size_t cost = shard.costOf(value);
+				if (cost > shard.capacity) return;
+
+				if (const TCacheSlot* slot = shard.index.find(key)) shard.drop(slot->index);
+
+				uint32 i;
+				if (shard.freeList.empty()) {
+					i = (uint32)shard.entries.size();
+					shard.entries.emplace_back();
+				} else {
+					i = shard.freeList.back();
+					shard.freeList.pop_back();
+				}
+
+				TCacheEntry& e = shard.entries[i];
+				e.value = value;
+				e.key.assign(key, key + shard.index.keySize());
+				e.cost = cost;
+				shard.pushFront(PROBATION, i);
+				shard.index.insert(key, TCacheSlot{ i });
+				shard.evict();
+			});
+		}
+
+		void invalidate(const byte* key) {
+			withShard(key, [key](TShard& shard) {
+				if (const TCacheSlot* slot = shard.index.find(key)) shard.drop(slot->index);
+			});
+		}
+
+		TCacheStats stats() const {
+			TCacheStats s;
+			for (TShard& shard : shards) {
+				std::lock_guard<std::mutex> guard(shard.mutex);
+				s.hits += shard.hits;
+				s.misses += shard.misses;
+				s.evictions += shard.evictions;
+				s.bytes += shard.segments[PROBATION].bytes + shard.segments[PROTECTED].bytes;
+				s.entries += shard.index.size();
+			}
+			return s;
+		}
+
+		void resetStats() {
+			for (TShard& shard : shards) {
+				std::lock_guard<std::mutex> guard(shard.mutex);
+				shard.hits = shard.misses = shard.evictions = 0;
+			}
+		}
+	};
+
+	//============================================================================
+	// Asynchronous result
+	// producer calls set() once, consumer waits with get() or co_await. 
+	// Awaiting coroutine is resumed on the thread which completes the operation.
+	//============================================================================
+	template <typename T>
+	class TAsync {
+
+	private:
+		typedef struct TState {
+			std::mutex mutex;
+			std::condition_variable cv;
+			bool ready = false;
+			T value{};
+			std::coroutine_handle<> waiter;
+		} TState;
+
+		std::shared_ptr<TState> state = std::make_shared<TState>();
+
+	public:
+		void set(T value) const {
+			std::coroutine_handle<> waiter;
+			{
+				std::lock_guard<std::mutex> guard(state->mutex);
+				state->value = std::move(value);
+				state->ready = true;
+				waiter = state->waiter;
+			}
+			state->cv.notify_all();
+			if (waiter) waiter.resume();
+		}
+
+		bool ready() const {
+			std::lock_guard<std::mutex> guard(state->mutex);
+			return state->ready;
+		}
+
+		void wait() const {
+			std::unique_lock<std::mutex> lock(state->mutex);
+			state->cv.wait(lock, [&]() { return state->ready; });
+		}
+
+		T get() const {
+			wait();
+			return state->value;
+		}
+
+		bool await_ready() const {
+			return ready();
+		}
+
+		bool await_suspend(std::coroutine_handle<> h) const {
+			std::lock_guard<std::mutex> guard(state->mutex);
+			if (state->ready) return false;
+			state->waiter = h;
+			return true;
+		}
+
+		T await_resume() const {
+			return get();
+		}
+	};
+
+	//============================================================================
+	// Thread pool
+	// tasks run in queue order, queued tasks are finished before destruction
+	//============================================================================
+	class TThreadPool {
+
+	private:
+		std::mutex mutex;
+		std::condition_variable cv;
+		std::deque<std::function<void()>> tasks;
+		std::vector<std::thread> threads;
+		bool stop = false;
+
+	public:
+		explicit TThreadPool(size_t n) {
+			for (size_t i = 0; i < n; i++) {
+				threads.emplace_back([this]() {
+					for (;;) {
+						std::function<void()> task;
+						{
+							std::unique_lock<std::mutex> lock(mutex);
+							cv.wait(lock, [&]() { return stop || !tasks.empty(); });
+							if (tasks.empty()) return;
+							task = std::move(tasks.front());
+							tasks.pop_front();
+						}
+						task();
+					}
+				});
+			}
+		}
+
+		~TThreadPool() {
+			{
+				std::lock_guard<std::mutex> guard(mutex);
+				stop = true;
+			}
+			cv.notify_all();
+			for (auto& t : threads) t.join();
+		}
+
+		void post(std::function<void()> task) {
+			{
+				std::lock_guard<std::mutex> guard(mutex);
+				tasks.push_back(std::move(task));
+			}
+			cv.notify_one();
+		}
+	};
+
+#ifdef KVDB_IO_URING
+	//============================================================================
+	// io_uring reader
+	// reads are queued to kernel ring without blocking, one thread reaps completions
+	// and runs their callbacks. Raw system calls, no liburing needed.
+	//============================================================================
+	class TUring {
+
+	public:
+		typedef std::function<void(int)> TCompletion; // bytes read or -errno
+
+	private:
+		int ringFd = -1;
+		unsigned entries = 0;
+		unsigned inflight = 0;
+
+		void* sqRing = MAP_FAILED;
+		void* cqRing = MAP_FAILED;
+		size_t sqRingSize = 0;
+		size_t cqRingSize = 0;
+		io_uring_sqe* sqes = (io_uring_sqe*)MAP_FAILED;
+		size_t sqesSize = 0;
+
+		unsigned* sqHead = nullptr;
+		unsigned* sqTail = nullptr;
+		unsigned* sqMask = nullptr;
+		unsigned* sqArray = nullptr;
+		unsigned* cqHead = nullptr;
+		unsigned* cqTail = nullptr;
+		unsigned* cqMask = nullptr;
+		io_uring_cqe* cqes = nullptr;
+
+		std::mutex submitMutex;
+		std::condition_variable slotCv;
+		std::thread reaper;
+
+		int enter(unsigned toSubmit, unsigned minComplete, unsigned flags) {
+			return (int)syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete, flags, nullptr, 0);
+		}
+
+		// called under submitMutex, false if kernel did not take the entry
+		bool push(byte opcode, int fd, void* buf, unsigned len, ulong64 offset, ulong64 userData) {
+			const unsigned tail = *sqTail;
+			const unsigned index = tail & *sqMask;
+
+			io_uring_sqe* sqe = &sqes[index];
+			std::memset(sqe, 0, sizeof(io_uring_sqe));
+			sqe->opcode = opcode;
+			sqe->fd = fd;
+			sqe->addr = (ulong64)buf;
+			sqe->len = len;
+			sqe->off = offset;
+			sqe->user_data = userData;
+			sqArray[index] = index;
+			__atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+
+			for (;;) {
+				if (enter(1, 0, 0) == 1) return true;
+				if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+				if (__atomic_load_n(sqHead, __ATOMIC_ACQUIRE) != tail) return true; // taken anyway
+				__atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+				return false;
+			}
+		}
+
+		void reap() {
+			for (;;) {
+				const unsigned head = *cqHead;
+				if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+					enter(0, 1, IORING_ENTER_GETEVENTS);
+					continue;
+				}
+
+				const io_uring_cqe cqe = cqes[head & *cqMask];
+				__atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+				if (cqe.user_data == 0) return; // stop marker
+
+				// taken under submitMutex, so the submitting thread's writes are visible here
+				TCompletion done;
+				{
+					std::lock_guard<std::mutex> guard(submitMutex);
+					TCompletion* p = (TCompletion*)cqe.user_data;
+					done = std::move(*p);
+					delete p;
+					inflight--;
+				}
+				slotCv.notify_all();
+				done(cqe.res);
+			}
+		}
+
+		void unmap() {
+			if (sqes != MAP_FAILED) munmap(sqes, sqesSize);
+			if (cqRing != MAP_FAILED && cqRing != sqRing) munmap(cqRing, cqRingSize);
+			if (sqRing != MAP_FAILED) munmap(sqRing, sqRingSize);
+			sqes = (io_uring_sqe*)MAP_FAILED;
+			sqRing = cqRing = MAP_FAILED;
+		}
+
+	public:
+		~TUring() {
+			close();
+		}
+
+		// false if io_uring is not available
+		bool open(unsigned n) {
+			io_uring_params p;
+			std::memset(&p, 0, sizeof(p));
+			ringFd = (int)syscall(__NR_io_uring_setup, n, &p);
+			if (ringFd < 0) return false;
+
+			entries = p.sq_entries;
+			sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+			cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+			if (p.features & IORING_FEAT_SINGLE_MMAP) sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+
+			sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+			cqRing = (p.features & IORING_FEAT_SINGLE_MMAP) ? sqRing : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+			sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+			sqes = (io_uring_sqe*)mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+
+			if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == MAP_FAILED) {
+				unmap();
+				::close(ringFd);
+				ringFd = -1;
+				return false;
+			}
+
+			byte* sq = (byte*)sqRing;
+			sqHead = (unsigned*)(sq + p.sq_off.head);
+			sqTail = (unsigned*)(sq + p.sq_off.tail);
+			sqMask = (unsigned*)(sq + p.sq_off.ring_mask);
+			sqArray = (unsigned*)(sq + p.sq_off.array);
+
+			byte* cq = (byte*)cqRing;
+			cqHead = (unsigned*)(cq + p.cq_off.head);
+			cqTail = (unsigned*)(cq + p.cq_off.tail);
+			cqMask = (unsigned*)(cq + p.cq_off.ring_mask);
+			cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+
+			reaper = std::thread([this]() { reap(); });
+			return true;
+		}
+
+		// waits for a free slot if ring is full, false if read was not queued
+		bool read(int fd, byte* dst, unsigned length, ulong64 offset, TCompletion done) {
+			std::unique_lock<std::mutex> lock(submitMutex);
+			if (inflight >= entries && std::this_thread::get_id() == reaper.get_id()) return false; // called from callback
+			slotCv.wait(lock, [&]() { return inflight < entries; });
+
+			TCompletion* p = new TCompletion(std::move(done));
+			if (!push(IORING_OP_READ, fd, dst, length, offset, (ulong64)p)) {
+				delete p;
+				return false;
+			}
+
+			inflight++;
+			return true;
+		}
+
+		// waits for queued reads
+		void close() {
+			if (ringFd < 0) return;
+
+			{
+				std::unique_lock<std::mutex> lock(submitMutex);
+				slotCv.wait(lock, [&]() { return inflight == 0; });
+				while (!push(IORING_OP_NOP, -1, nullptr, 0, 0, 0)) { }
+			}
+
+			reaper.join();
+			unmap();
+			::close(ringFd);
+			ringFd = -1;
+		}
+	};
+#endif
+
+	//============================================================================
+	// Runtime statistics
+	//============================================================================
+
+	// bucket i counts operations which took [2^i, 2^(i+1)) ns
+	typedef struct TLatencyHistogram {
+		std::array<ulong64, KVDB_LATENCY_BUCKETS> buckets{};
+		ulong64 count = 0;
+		ulong64 totalNs = 0;
+
+		// upper bound of bucket with p-th fraction of operations, p in 0..1
+		ulong64 percentile(double p) const {
+			const ulong64 rank = (ulong64)std::ceil(p * count);
+			ulong64 seen = 0;
+			for (size_t i = 0; i < buckets.size(); i++) {
+				seen += buckets[i];
+				if (seen >= rank && seen > 0) return (ulong64)2 << i;
+			}
+			return 0;
+		}
+
+		double meanNs() const {
+			return count ? (double)totalNs / count : 0;
+		}
+	} TLatencyHistogram;
+
+	typedef struct TFileStats {
+		// data file I/O, index snapshot and log are not counted
+		ulong64 bytesRead = 0;
+		ulong64 bytesWritten = 0;
+		ulong64 reads = 0;
+		ulong64 writes = 0;
+		ulong64 seeks = 0; // stream repositioning, positional reads do not seek
+
+		ulong64 reuseHits = 0; // new value placed into freed extent
+		ulong64 reuseMisses = 0; // no freed extent fits, value appended
+		ulong64 relocations = 0; // changed value did not fit its extent
+		ulong64 partialUpdates = 0; // update() wrote only its bytes
+		ulong64 tablesCreated = 0;
+
+		// current state, not reset
+		ulong64 fileBytes = 0;
+		ulong64 freeBytes = 0;
+		ulong64 freeExtents = 0;
+		ulong64 largestFree = 0;
+		double deadRatio = 0; // free bytes / file bytes
+		double fragmentation = 0; // 1 - largest free extent / free bytes
+
+		TLatencyHistogram load;
+		TLatencyHistogram save;
+		TLatencyHistogram erase;
+		TLatencyHistogram batch;
+	} TFileStats;
+
+	// relaxed atomic counters, writers and readers update them without locks.
+	// Disabled counters and timers do nothing, so hot paths do not share their cache lines.
+	class TStatsCounters {
+
+	public:
+		class THistogram {
+
+		public:
+			void add(ulong64 ns) {
+				const size_t i = ns ? std::min<size_t>(std::bit_width(ns) - 1, KVDB_LATENCY_BUCKETS - 1) : 0;
+				buckets[i].fetch_add(1, std::memory_order_relaxed);
+				count.fetch_add(1, std::memory_order_relaxed);
+				totalNs.fetch_add(ns, std::memory_order_relaxed);
+			}
+
+			void copyTo(TLatencyHistogram& h) const {
+				for (size_t i = 0; i < KVDB_LATENCY_BUCKETS; i++) h.buckets[i] = buckets[i].load(std::memory_order_relaxed);
+				h.count = count.load(std::memory_order_relaxed);
+				h.totalNs = totalNs.load(std::memory_order_relaxed);
+			}
+
+			void reset() {
+				for (auto& b : buckets) b.store(0, std::memory_order_relaxed);
+				count.store(0, std::memory_order_relaxed);
+				totalNs.store(0, std::memory_order_relaxed);
+			}
+
+		private:
+			std::array<std::atomic<ulong64>, KVDB_LATENCY_BUCKETS> buckets{};
+			std::atomic<ulong64> count{0};
+			std::atomic<ulong64> totalNs{0};
+		};
+
+		// adds time from construction to destruction to histogram
+		class TTimer {
+
+		public:
+			TTimer(const TStatsCounters& counters, THistogram& h) : histogram(h), active(counters.isEnabled()) {
+				if (active) start = std::chrono::steady_clock::now();
+			}
+
+			~TTimer() {
+				if (!active) return;
+				histogram.add((ulong64)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+			}
+
+		private:
+			THistogram& histogram;
+			const bool active;
+			std::chrono::steady_clock::time_point start;
+		};
+
+		std::atomic<bool> enabled{false};
+
+		std::atomic<ulong64> bytesRead{0};
+		std::atomic<ulong64> bytesWritten{0};
+		std::atomic<ulong64> reads{0};
+		std::atomic<ulong64> writes{0};
+		std::atomic<ulong64> seeks{0};
+		std::atomic<ulong64> reuseHits{0};
+		std::atomic<ulong64> reuseMisses{0};
+		std::atomic<ulong64> relocations{0};
+		std::atomic<ulong64> partialUpdates{0};
+		std::atomic<ulong64> tablesCreated{0};
+
+		THistogram load;
+		THistogram save;
+		THistogram erase;
+		THistogram batch;
+
+		bool isEnabled() const {
+			return enabled.load(std::memory_order_relaxed);
+		}
+
+		void inc(std::atomic<ulong64>& c, ulong64 n = 1) {
+			if (isEnabled()) c.fetch_add(n, std::memory_order_relaxed);
+		}
+
+		void read(ulong64 bytes, bool seek) {
+			if (!isEnabled()) return;
+			inc(reads);
+			inc(bytesRead, bytes);
+			if (seek) inc(seeks);
+		}
+
+		void write(ulong64 bytes) {
+			if (!isEnabled()) return;
+			inc(writes);
+			inc(bytesWritten, bytes);
+			inc(seeks);
+		}
+
+		void copyTo(TFileStats& s) const {
+			s.bytesRead = bytesRead.load(std::memory_order_relaxed);
+			s.bytesWritten = bytesWritten.load(std::memory_order_relaxed);
+			s.reads = reads.load(std::memory_order_relaxed);
+			s.writes = writes.load(std::memory_order_relaxed);
+			s.seeks = seeks.load(std::memory_order_relaxed);
+			s.reuseHits = reuseHits.load(std::memory_order_relaxed);
+			s.reuseMisses = reuseMisses.load(std::memory_order_relaxed);
+			s.relocations = relocations.load(std::memory_order_relaxed);
+			s.partialUpdates = partialUpdates.load(std::memory_order_relaxed);
+			s.tablesCreated = tablesCreated.load(std::memory_order_relaxed);
+			load.copyTo(s.load);
+			save.copyTo(s.save);
+			erase.copyTo(s.erase);
+			batch.copyTo(s.batch);
+		}
+
+		void reset() {
+			for (auto* c : { &bytesRead, &bytesWritten, &reads, &writes, &seeks, &reuseHits, &reuseMisses, &relocations, &partialUpdates, &tablesCreated }) {
+				c->store(0, std::memory_order_relaxed);
+			}
+			load.reset();
+			save.reset();
+			erase.reset();
+			batch.reset();
+		}
+	};
+
+	//============================================================================
+	// Compaction result
+	//============================================================================
+	typedef struct TCompactResult {
+		size_t valuesMoved = 0;
+		ulong64 bytesMoved = 0;
+		ulong64 bytesReclaimed = 0; // file truncated by
+		bool done = false; // nothing left to compact
+	} TCompactResult;
+
+	//============================================================================
+	// Snapshot pins
+	// epochs of live snapshots, shared by file and its snapshots
+	//============================================================================
+	typedef struct TSnapshotPins {
+		std::mutex mutex;
+		std::multiset<ulong64> live;
+		ulong64 epoch = 0;
+
+		ulong64 pin() {
+			std::lock_guard<std::mutex> guard(mutex);
+			live.insert(++epoch);
+			return epoch;
+		}
+
+		void unpin(ulong64 e) {
+			std::lock_guard<std::mutex> guard(mutex);
+			live.erase(live.find(e));
+		}
+
+		bool any() {
+			std::lock_guard<std::mutex> guard(mutex);
+			return !live.empty();
+		}
+
+		// extent freed at epoch e is still seen by snapshots pinned at e or before
+		ulong64 oldest() {
+			std::lock_guard<std::mutex> guard(mutex);
+			return live.empty() ? ULLONG_MAX : *live.begin();
+		}
+
+		ulong64 current() {
+			std::lock_guard<std::mutex> guard(mutex);
+			return epoch;
+		}
+	} TSnapshotPins;
+
+	//============================================================================
+	// File db
+	//============================================================================
+
+	class KvRawFile {
+
+	protected:
+
+		TKeyMap<TKeyRecord> dataMap;
+		std::fstream* filePtr = nullptr;
+		std::deque<ulong64> reservedKeyList; // positions of reserved key slots
+		TFreeSpace freeSpace;
+		std::list<TTableHeaderInfo> tableList;
+		mutable std::shared_mutex fileSharedMutex; // shared for readers, exclusive for writers
+		mutable std::mutex streamReadMutex; // guards seek cursor for stream reads
+		mutable std::mutex mappingMutex;
+
+		bool mmapRead = false;
+		int readFd = -1;
+		ulong64 valueAlignment = 0; // values of this size or larger start at multiple of it
+		bool directIo = false;
+		int directFd = -1; // O_DIRECT descriptor for aligned values
+#ifdef KVDB_POSIX_IO
+		mutable std::shared_ptr<TFileMapping> mapping;
+		mutable std::vector<std::weak_ptr<TFileMapping>> retiredMappings;
+#endif
+
+		std::string filePath;
+		bool indexSnapshot = false;
+		bool snapshotOnClose = false;
+		bool indexLoaded = false;
+		ulong64 indexStamp = 0; // file header stamp, zero after first modification
+
+		// write-ahead log, writers queue up and the first one commits for the whole group
+		typedef struct TWalWriter {
+			const TWriteBatch* batch = nullptr;
+			bool done = false;
+			bool ok = true;
+			std::condition_variable cv;
+		} TWalWriter;
+
+		bool walEnabled = false;
+		uint32 durability = KVDB_DURABILITY_NONE;
+		uint32 syncIntervalMs = 100;
+		TWalFile wal;
+		std::mutex walMutex;
+		std::deque<TWalWriter*> walWriters;
+		std::atomic<ulong64> walSyncs{0};
+		std::atomic<bool> walUnsynced{false};
+		std::thread walSyncThread;
+		std::condition_variable walSyncCv;
+		bool walStop = false;
+		std::vector<std::pair<ulong64, TKeyData>> compactQueue; // live values, next one at back
+		TKeyOrderFunc keyOrder = nullptr; // null keeps write order
+		bool orderedIndexEnabled = false;
+		TOrderedIndex orderedIndex; // keys in key order, kept if enabled
+		std::mutex compactMutex;
+
+		std::unique_ptr<TWriteBuffer> writeBuffer; // not null while batch is written
+		TTablePages tablePages; // dirty key table pages, used if tableBufferSize is not zero
+		size_t tableBufferSize = 0;
+		uint32 tableBufferMs = KVDB_TABLE_BUFFER_MS;
+		mutable TValueCache valueCache; // filled by readers
+
+		// snapshots: values are not rewritten in place while pinned, freed extents wait here
+		typedef struct TDeferredFree {
+			ulong64 epoch;
+			TFreeExtent extent;
+		} TDeferredFree;
+
+		std::shared_ptr<TSnapshotPins> snapshotPins = std::make_shared<TSnapshotPins>();
+		std::atomic<ulong64> session{ 0 }; // changed by close(), ends snapshots of that session
+		std::vector<TDeferredFree> deferredFrees;
+		// extents freed while key table on disk may still point at them: table pages are dirty,
+		// or with log file is not synced since checkpoint
+		std::vector<TDeferredFree> heldFrees;
+		ulong64 heldFreeBytes = 0;
+		bool compression = false;
+		double appendGrowth = KVDB_APPEND_GROWTH;
+
+		// asynchronous operations, started by first loadAsync() or saveAsync()
+		std::mutex asyncMutex;
+		uint32 asyncThreads = 0;
+		bool asyncUring = true;
+		std::unique_ptr<TThreadPool> asyncPool; // loads without io_uring
+		std::unique_ptr<TThreadPool> asyncWriter; // one thread, saves keep their order
+#ifdef KVDB_IO_URING
+		std::unique_ptr<TUring> uring;
+#endif
+		std::atomic<ulong64> writeGeneration{0}; // changed before every file write
+
+		mutable TStatsCounters counters;
+
+		ulong64 reservedKeys = KVDB_RESERVED_TABLE_SIZE; // entries of first table added by saves
+		double tableGrowth = KVDB_TABLE_GROWTH;
+		ulong64 maxTableSize = KVDB_MAX_TABLE_SIZE;
+		ulong64 directoryPos = 0;
+		ulong64 directoryCapacity = 0; // zero if directory is missing or stale, next table rewrites it
+		bool directoryLoaded = false;
+
+	protected:
+		const volatile uint32 expandDataTo = 0; 
+		uint32 keySize = 0;
+
+	protected:
+
+		// invalidate index snapshot before the first write. Cleared stamp is synced once per
+		// session, otherwise after power loss old stamp could match a file with newer changes.
+		void markModified() {
+			writeGeneration++;
+			if (indexStamp == 0) return;
+			indexStamp = 0;
+			filePtr->seekp(offsetof(TFileHeader, timestamp));
+			write(filePtr, indexStamp);
+			syncData();
+			counters.write(sizeof(indexStamp));
+		}
+
+		void writeAt(ulong64 pos, const byte* src, size_t size) {
+			markModified();
+			if (writeBuffer) {
+				writeBuffer->patch(pos, src, size);
+			} else {
+				filePtr->seekp(pos);
+				filePtr->write((char*)src, size);
+				counters.write(size);
+			}
+		}
+
+		ulong64 appendAtEnd(const byte* src, size_t size) {
+			markModified();
+			if (writeBuffer) return writeBuffer->append(src, size);
+
+			filePtr->seekp(0, std::ios::end); // to end-of-file
+			ulong64 pos = (ulong64)(filePtr->tellp());
+			filePtr->write((char*)src, size);
+			counters.write(size);
+			return pos;
+		}
+
+		// header at end of file and size - header zero bytes after it, which are left as a hole
+		// so big tables cost no writes. Pending batch writes go to file first.
+		ulong64 appendSparse(const byte* src, size_t headerSize, ulong64 size) {
+			const bool buffered = (bool)writeBuffer;
+			if (buffered) flushWriteBuffer();
+			markModified();
+
+			filePtr->seekp(0, std::ios::end);
+			const ulong64 pos = (ulong64)(filePtr->tellp());
+			filePtr->write((const char*)src, headerSize);
+			if (size > headerSize) {
+				filePtr->seekp(pos + size - 1);
+				filePtr->put(0);
+			}
+			counters.write(headerSize);
+
+			if (buffered) beginWriteBuffer();
+			return pos;
+		}
+
+		static TKeyEntryHeader headerOf(const TKeyRecord& r) {
+			TKeyEntryHeader h;
+			h.dataPos = r.dataPos;
+			h.dataLength = r.dataLength;
+			h.initialDataLength = r.capacity;
+			h.flags = r.flags;
+			h.entryFlags = r.entryFlags;
+			return h;
+		}
+
+		static TKeyRecord recordOf(const TKeyEntryHeader& h, ulong64 slotPos) {
+			return TKeyRecord{ h.dataPos, slotPos, h.dataLength, h.initialDataLength, h.flags, h.entryFlags };
+		}
+
+		// key entry as stored in table, null key is written as zeros
+		static void serializeKey(const TKeyRecord& r, const byte* key, uint32 size, byte* dst) {
+			const TKeyEntryHeader h = headerOf(r);
+			std::memcpy(dst, &h, sizeof(TKeyEntryHeader));
+			if (key) {
+				std::memcpy(dst + sizeof(TKeyEntryHeader), key, size);
+			} else {
+				std::memset(dst + sizeof(TKeyEntryHeader), 0, size);
+			}
+		}
+
+		void writeKeyEntry(const TKeyRecord& r, const byte* key) {
+			TKeyData buffer(sizeof(TKeyEntryHeader) + keySize);
+			serializeKey(r, key, keySize, buffer.data());
+			if (tableBufferSize > 0 && bufferKeyEntry(r.slotPos, buffer.data(), buffer.size())) return;
+			writeAt(r.slotPos, buffer.data(), buffer.size());
+		}
+
+		// key entry goes to table pages, false if page can't be read
+		bool bufferKeyEntry(ulong64 slotPos, const byte* src, size_t size) {
+			const ulong64 keyEntrySize = sizeof(TKeyEntryHeader) + keySize;
+			for (const auto& t : tableList) {
+				const ulong64 first = t.pos + sizeof(TTableHeader);
+				const ulong64 last = first + t().recordCount * keyEntrySize;
+				if (slotPos < first || slotPos >= last) continue;
+
+				markModified();
+				return tablePages.patch(slotPos, src, size, first, last, [this](ulong64 pos, byte* dst, size_t n) { return readTablePage(pos, dst, n); });
+			}
+			return false;
+		}
+
+		// page as it is in file, or in appended part of current batch
+		bool readTablePage(ulong64 pos, byte* dst, size_t size) {
+			if (writeBuffer && pos >= writeBuffer->appendPos) {
+				std::memcpy(dst, writeBuffer->appendData.data() + (pos - writeBuffer->appendPos), size);
+				return true;
+			}
+
+			filePtr->flush(); // new table may still be in stream buffer
+			return readAt(pos, dst, size);
+		}
+
+		// called under exclusive lock, never while batch is written
+		void flushTablePages() {
+			if (!tablePages.empty()) {
+				tablePages.flush([this](ulong64 pos, const byte* src, size_t size) {
+					filePtr->seekp(pos);
+					filePtr->write((const char*)src, size);
+					counters.write(size);
+				});
+				filePtr->flush();
+			}
+			if (!walEnabled) releaseHeldFrees(); // with log they wait for checkpoint
+		}
+
+		void flushTablePagesIfDue() {
+			if (tablePages.due(tableBufferSize, tableBufferMs) || heldFreeBytes > KVDB_HELD_FREE_SIZE) flushTablePages();
+		}
+
+		void beginWriteBuffer() {
+			filePtr->seekp(0, std::ios::end);
+			writeBuffer.reset(new TWriteBuffer((ulong64)filePtr->tellp()));
+		}
+
+		void flushWriteBuffer() {
+			std::unique_ptr<TWriteBuffer> wb = std::move(writeBuffer);
+
+			if (wb->appendData.size() > 0) {
+				filePtr->seekp(wb->appendPos);
+				filePtr->write((char*)wb->appendData.data(), wb->appendData.size());
+				counters.write(wb->appendData.size());
+			}
+
+			for (const auto& p : wb->patches) {
+				filePtr->seekp(p.first);
+				filePtr->write((char*)p.second.data(), p.second.size());
+				counters.write(p.second.size());
+			}
+		}
+
+		bool alignedValue(ulong64 size) const {
+			return valueAlignment > 0 && size >= valueAlignment;
+		}
+
+		ulong64 alignUp(ulong64 v) const {
+			return (v + valueAlignment - 1) / valueAlignment * valueAlignment;
+		}
+
+		// whole blocks past page cache, buffered write if it fails
+		bool writeDirect(ulong64 pos, const byte* src, size_t size) {
+#ifdef KVDB_POSIX_IO
+			const size_t length = (size_t)alignUp(size);
+			TAlignedBlock block = alignedBlock((size_t)valueAlignment, length);
+			if (!block) return false;
+			std::memcpy(block.get(), src, size);
+			std::memset(block.get() + size, 0, length - size);
+			if (!pwriteFull(directFd, block.get(), length, pos)) return false;
+			counters.write(length);
+			return true;
+#else
+			return false;
+#endif
+		}
+
+		// reserved capacity past a direct write, sparse zeros
+		bool extendFile(ulong64 size) {
+#ifdef KVDB_POSIX_IO
+			struct stat st;
+			if (fstat(directFd, &st) != 0) return false;
+			if ((ulong64)st.st_size >= size) return true;
+			return ftruncate(directFd, (off_t)size) == 0;
+#else
+			return false;
+#endif
+		}
+
+		bool directWritable(const TKeyRecord& r, ulong64 size) const {
+			return directFd >= 0 && !writeBuffer && alignedValue(size) && r.dataPos % valueAlignment == 0 && r.capacity >= alignUp(size);
+		}
+
+		// value into its extent
+		void writeValue(const TKeyRecord& r, const TValueData& valueData) {
+			if (directWritable(r, valueData.size())) {
+				markModified();
+				if (writeDirect(r.dataPos, valueData.data(), valueData.size())) return;
+			}
+			writeAt(r.dataPos, valueData.data(), valueData.size());
+		}
+
+		// value padded with zeros to capacity at end of file, aligned value starts at block boundary
+		ulong64 appendValue(const TValueData& valueData, ulong64 capacity) {
+			ulong64 end;
+			if (writeBuffer) {
+				end = writeBuffer->appendPos + writeBuffer->appendData.size();
+			} else {
+				filePtr->seekp(0, std::ios::end);
+				end = (ulong64)filePtr->tellp();
+			}
+			const ulong64 pad = alignedValue(valueData.size()) ? alignUp(end) - end : 0;
+
+			TKeyRecord r;
+			r.dataPos = end + pad;
+			r.capacity = capacity;
+			if (directWritable(r, valueData.size())) {
+				markModified();
+				filePtr->flush(); // end of file is moved past stream
+				if (writeDirect(r.dataPos, valueData.data(), valueData.size()) && extendFile(r.dataPos + capacity)) return r.dataPos;
+			}
+
+			std::vector<byte> block(pad + capacity, 0);
+			std::memcpy(block.data() + pad, valueData.data(), valueData.size());
+			return appendAtEnd(block.data(), block.size()) + pad;
+		}
+
+		void rewritePair(TKeyRecord& r, const byte* key, const TValueData& valueData, const ulong64 k_flags, const uint16 entryFlags) {
+			// rewrite value data
+			writeValue(r, valueData);
+			// rewrite key data
+			r.dataLength = valueData.size(); // new length
+			r.flags = k_flags;
+			r.entryFlags = entryFlags;
+			writeKeyEntry(r, key);
+		}
+
+		void writeFreeSlot(const TFreeExtent& e) {
+			TKeyRecord r;
+			r.dataPos = e.dataPos;
+			r.slotPos = e.slotPos;
+			r.capacity = e.length;
+			writeKeyEntry(r, nullptr);
+		}
+
+		// clear key slot and return it to reserved list
+		void releaseSlot(ulong64 slotPos) {
+			TKeyRecord r;
+			r.slotPos = slotPos;
+			writeKeyEntry(r, nullptr);
+			reservedKeyList.push_back(slotPos);
+		}
+
+		// return value extent to free space, merged with physically adjacent free extents
+		void releaseExtent(ulong64 slotPos, ulong64 dataPos, ulong64 length) {
+			if (length == 0) {
+				releaseSlot(slotPos); // zero length value has no extent
+				return;
+			}
+
+			TFreeExtent e{ dataPos, length, slotPos };
+
+			// table on disk may still point at it: free on disk, reused after table is written
+			if (walEnabled || tableBufferSize > 0) {
+				writeFreeSlot(e);
+				heldFrees.push_back(TDeferredFree{ snapshotPins->current(), e });
+				heldFreeBytes += length;
+				return;
+			}
+
+			// snapshot may still read it: free on disk, reused after snapshot is released
+			if (snapshotPins->any()) {
+				writeFreeSlot(e);
+				deferredFrees.push_back(TDeferredFree{ snapshotPins->current(), e });
+				return;
+			}
+
+			freeExtent(e);
+		}
+
+		void freeExtent(TFreeExtent e) {
+			if (const TFreeExtent* prev = freeSpace.before(e.dataPos)) {
+				TFreeExtent p = *prev;
+				freeSpace.remove(p.dataPos);
+				releaseSlot(e.slotPos);
+				e = TFreeExtent{ p.dataPos, p.length + e.length, p.slotPos };
+			}
+
+			if (const TFreeExtent* next = freeSpace.at(e.dataPos + e.length)) {
+				TFreeExtent n = *next;
+				freeSpace.remove(n.dataPos);
+				releaseSlot(n.slotPos);
+				e.length += n.length;
+			}
+
+			freeSpace.insert(e);
+			writeFreeSlot(e);
+		}
+
+		// called under exclusive lock after table on disk points at new places of values
+		void releaseHeldFrees() {
+			if (heldFrees.empty()) return;
+			deferredFrees.insert(deferredFrees.end(), heldFrees.begin(), heldFrees.end());
+			heldFrees.clear();
+			heldFreeBytes = 0;
+			applyDeferredFrees();
+		}
+
+		// called under exclusive lock, all = true when file is closed
+		void applyDeferredFrees(bool all = false) {
+			if (deferredFrees.empty()) return;
+
+			const ulong64 oldest = all ? ULLONG_MAX : snapshotPins->oldest();
+			std::vector<TDeferredFree> pending;
+			pending.swap(deferredFrees);
+			for (const auto& d : pending) {
+				if (d.epoch < oldest) {
+					freeExtent(d.extent);
+				} else {
+					deferredFrees.push_back(d);
+				}
+			}
+		}
+
+		ulong64 orderOf(const byte* key) const {
+			return keyOrder ? keyOrder(key, keySize) : 0;
+		}
+
+		void buildOrderedIndex() {
+			orderedIndex.setKeySize(keySize);
+			if (!orderedIndexEnabled) return;
+
+			std::vector<std::pair<ulong64, const byte*>> entries;
+			entries.reserve(dataMap.size());
+			dataMap.forEach([&](const byte* key, const TKeyRecord&) { entries.push_back({ orderOf(key), key }); });
+			orderedIndex.build(entries);
+		}
+
+		// keys from (from) to hi in key order, at most max of them, called under shared lock.
+		// Without ordered index all keys are visited.
+		void rangeKeys(const byte* from, bool exclusive, const byte* hi, size_t max, std::vector<byte>& out) const {
+			const ulong64 fromCode = orderOf(from);
+			const ulong64 hiCode = orderOf(hi);
+
+			if (orderedIndexEnabled) {
+				orderedIndex.scan(fromCode, from, exclusive, hiCode, hi, max, out);
+				return;
+			}
+
+			auto less = [&](ulong64 codeA, const byte* keyA, ulong64 codeB, const byte* keyB) {
+				return (codeA != codeB) ? codeA < codeB : std::memcmp(keyA, keyB, keySize) < 0;
+			};
+
+			std::vector<std::pair<ulong64, const byte*>> found;
+			dataMap.forEach([&](const byte* key, const TKeyRecord&) {
+				const ulong64 code = orderOf(key);
+				if (less(code, key, fromCode, from) || less(hiCode, hi, code, key)) return;
+				if (exclusive && !less(fromCode, from, code, key)) return;
+				found.push_back({ code, key });
+			});
+
+			const size_t n = std::min(max, found.size());
+			std::partial_sort(found.begin(), found.begin() + n, found.end(), [&](const auto& a, const auto& b) { return less(a.first, a.second, b.first, b.second); });
+			for (size_t i = 0; i < n; i++) out.insert(out.end(), found[i].second, found[i].second + keySize);
+		}
+
+		void startAsync() {
+			std::lock_guard<std::mutex> guard(asyncMutex);
+			if (asyncPool) return;
+
+			const uint32 threads = asyncThreads ? asyncThreads : std::max(2u, std::thread::hardware_concurrency());
+			asyncPool.reset(new TThreadPool(threads));
+			asyncWriter.reset(new TThreadPool(1));
+
+#ifdef KVDB_IO_URING
+			if (asyncUring && readFd >= 0) {
+				uring.reset(new TUring());
+				if (!uring->open(KVDB_URING_ENTRIES)) uring = nullptr;
+			}
+#endif
+		}
+
+		// queued operations are finished first. Threads are joined after lock is released,
+		// so a callback can start asynchronous operation without deadlock.
+		void stopAsync() {
+			std::unique_ptr<TThreadPool> writer;
+			std::unique_ptr<TThreadPool> pool;
+#ifdef KVDB_IO_URING
+			std::unique_ptr<TUring> ring;
+#endif
+			{
+				std::lock_guard<std::mutex> guard(asyncMutex);
+				writer = std::move(asyncWriter);
+#ifdef KVDB_IO_URING
+				ring = std::move(uring);
+#endif
+				pool = std::move(asyncPool);
+			}
+
+			writer = nullptr;
+#ifdef KVDB_IO_URING
+			ring = nullptr;
+#endif
+			pool = nullptr;
+		}
+
+		// done() gets value or nullptr, it is called on io thread or by caller if result is known at once
+		template <size_t N = 0>
+		void loadWith(const byte* key, std::function<void(TValueDataPtr)> done) {
+			if (!isOpen()) {
+				done(nullptr);
+				return;
+			}
+
+			startAsync();
+			const TKeyData keyData(key, key + keySize);
+
+#ifdef KVDB_IO_URING
+			if (uring) {
+				TKeyRecord r;
+				ulong64 generation;
+				{
+					std::shared_lock<std::shared_mutex> lock(fileSharedMutex);
+					TValueDataPtr cached = valueCache.enabled() ? valueCache.template get<N>(key) : nullptr;
+					const TKeyRecord* found = cached ? nullptr : dataMap.template find<N>(key);
+					if (cached || found == nullptr || found->dataLength == 0) {
+						lock.unlock();
+						done(cached ? cached : (found ? TValueDataPtr(new TValueData) : nullptr));
+						return;
+					}
+					r = *found;
+					generation = writeGeneration;
+				}
+
+				// value is read without lock, if any write started meanwhile it is read again
+				auto buffer = std::make_shared<TValueData>(r.dataLength);
+				counters.read(r.dataLength, false);
+				auto completion = [this, r, generation, buffer, keyData, done](int res) {
+					if (res != (int)r.dataLength || writeGeneration != generation) {
+						done(loadKey(keyData.data()));
+					} else if (r.entryFlags & KVDB_ENTRY_COMPRESSED) {
+						TValueDataPtr value(new TValueData);
+						done(unpackValue(*buffer, *value) ? value : nullptr);
+					} else {
+						done(buffer);
+					}
+				};
+
+				if (r.dataLength <= INT_MAX && uring->read(readFd, buffer->data(), (unsigned)r.dataLength, r.dataPos, completion)) return;
+			}
+#endif
+
+			asyncPool->post([this, keyData, done]() { done(loadKey(keyData.data())); });
+		}
+
+		void saveWith(const byte* key, const TValueData& valueData, const ulong64 k_flags, std::function<void()> done) {
+			if (!isOpen()) {
+				done();
+				return;
+			}
+
+			startAsync();
+			const TKeyData keyData(key, key + keySize);
+			asyncWriter->post([this, keyData, valueData, k_flags, done]() {
+				saveKey(keyData.data(), valueData, k_flags);
+				done();
+			});
+		}
+
+		void fetchRange(const byte* from, bool exclusive, const byte* hi, size_t max, std::vector<byte>& out) const {
+			if (!isOpen()) return;
+			std::shared_lock<std::shared_mutex> lock(fileSharedMutex);
+			rangeKeys(from, exclusive, hi, max, out);
+		}
+
+		void earsePair(const byte* key) {
+			valueCache.invalidate(key);
+			const TKeyRecord* found = dataMap.find(key);
+			if (found == nullptr) return;
+			const TKeyRecord r = *found;
+			if (orderedIndexEnabled) orderedIndex.erase(orderOf(key), key);
+			dataMap.erase(key);
+			releaseExtent(r.slotPos, r.dataPos, r.capacity);
+		}
+
+		ulong64 expandedSize(ulong64 size) const {
+			ulong64 expanded = size;
+			if (expandDataTo > 0 && size > 0) {
+				uint32 n = (uint32)std::round((float)size / (float)expandDataTo) + 1;
+				expanded = (ulong64)n * (ulong64)expandDataTo;
+			}
+			return alignedValue(size) ? alignUp(expanded) : expanded;
+		}
+
+		void newPairFromReserved(const byte* key, const TValueData& valueData, const ulong64 k_flags, const uint16 entryFlags, ulong64 reserve) {
+			// has reserved key slots
+			TKeyRecord r;
+			r.slotPos = reservedKeyList.front();
+
+			const ulong64 capacity = expandedSize(std::max<ulong64>(valueData.size(), reserve));
+			const ulong64 endFile = (valueData.size() > 0) ? appendValue(valueData, capacity) : 0;
+
+			// fill key data
+			r.dataLength = valueData.size(); // length
+			r.capacity = capacity; // length
+			r.dataPos = (valueData.size() > 0) ? endFile : 1; // allow zero length value
+			r.flags = k_flags;
+			r.entryFlags = entryFlags;
+			writeKeyEntry(r, key);
+
+			// add new pair to table 
+			dataMap.insert(key, r);
+			if (orderedIndexEnabled) orderedIndex.insert(orderOf(key), key);
+			reservedKeyList.pop_front();
+		}
+
+		// positional read of any part of file, called by writer or on open
+		bool readAt(ulong64 pos, byte* dst, size_t size) const {
+#ifdef KVDB_POSIX_IO
+			if (readFd >= 0) {
+				counters.read(size, false);
+				return preadFull(readFd, dst, size, pos);
+			}
+#endif
+			counters.read(size, true);
+			std::lock_guard<std::mutex> guard(streamReadMutex);
+			filePtr->seekg(pos);
+			return (bool)filePtr->read((char*)dst, size);
+		}
+
+		// part of key table read by one call, first part starts with table header
+		typedef struct TTablePiece {
+			ulong64 tablePos;
+			ulong64 first; // entry index
+			ulong64 count;
+		} TTablePiece;
+
+		void splitTable(ulong64 tablePos, ulong64 recordCount, std::vector<TTablePiece>& pieces) const {
+			const ulong64 keyEntrySize = sizeof(TKeyEntryHeader) + keySize;
+			const ulong64 perPiece = std::max<ulong64>(1, KVDB_TABLE_READ_SIZE / keyEntrySize);
+			ulong64 i = 0;
+			do {
+				pieces.push_back(TTablePiece{ tablePos, i, std::min(perPiece, recordCount - i) });
+				i += perPiece;
+			} while (i < recordCount);
+		}
+
+		void parseEntry(const byte* entry, ulong64 pos) {
+			TKeyEntryHeader header;
+			std::memcpy(&header, entry, sizeof(TKeyEntryHeader));
+			const byte* key = entry + sizeof(TKeyEntryHeader);
+
+			if (header.dataLength > 0) { 
+				dataMap.insert(key, recordOf(header, pos));
+			} else {
+				if (header.initialDataLength == 0) { 
+					if(header.dataPos == 1){ 
+						dataMap.insert(key, recordOf(header, pos)); // key with zero length data
+					} else {
+						reservedKeyList.push_back(pos); // reserved key slot
+					}
+				} else {
+					freeSpace.insert(TFreeExtent{ header.dataPos, header.initialDataLength, pos }); // marked as deleted pair
+				}
+			}
+		}
+
+		// Pieces are read in windows, parts of one window by parallel threads, and parsed
+		// in order. False if read fails or table header does not match the piece.
+		bool readTablePieces(const std::vector<TTablePiece>& pieces) {
+			const ulong64 keyEntrySize = sizeof(TKeyEntryHeader) + keySize;
+			auto offsetOf = [&](const TTablePiece& p) { return p.first == 0 ? 0 : sizeof(TTableHeader) + p.first * keyEntrySize; };
+			auto sizeOf = [&](const TTablePiece& p) { return (p.first == 0 ? sizeof(TTableHeader) : 0) + p.count * keyEntrySize; };
+
+			const size_t threads = std::max<size_t>(1, std::thread::hardware_concurrency());
+
+			for (size_t begin = 0; begin < pieces.size(); ) {
+				size_t end = begin;
+				ulong64 bytes = 0;
+				while (end < pieces.size() && (end == begin || bytes + sizeOf(pieces[end]) <= KVDB_TABLE_READ_WINDOW)) bytes += sizeOf(pieces[end++]);
+
+				std::vector<std::vector<byte>> data(end - begin);
+				std::atomic<size_t> next{begin};
+				std::atomic<bool> ok{true};
+				auto worker = [&]() {
+					for (size_t i = next++; i < end; i = next++) {
+						const TTablePiece& p = pieces[i];
+						std::vector<byte>& d = data[i - begin];
+						d.resize(sizeOf(p));
+						if (!readAt(p.tablePos + offsetOf(p), d.data(), d.size())) ok = false;
+					}
+				};
+
+				std::vector<std::thread> workers;
+#ifdef KVDB_POSIX_IO
+				for (size_t t = 1; t < std::min(threads, end - begin) && readFd >= 0; t++) workers.emplace_back(worker);
+#endif
+				worker();
+				for (auto& w : workers) w.join();
+				if (!ok) return false;
+
+				for (size_t i = begin; i < end; i++) {
+					const TTablePiece& p = pieces[i];
+					const byte* d = data[i - begin].data();
+					if (p.first == 0) {
+						TTableHeader h;
+						std::memcpy(&h, d, sizeof(TTableHeader));
+						if (h.recordCount < p.count) return false;
+						tableList.push_back(TTableHeaderInfo(h, p.tablePos));
+						d += sizeof(TTableHeader);
+					}
+
+					const ulong64 pos = p.tablePos + sizeof(TTableHeader) + p.first * keyEntrySize;
+					for (ulong64 n = 0; n < p.count; n++) parseEntry(d + n * keyEntrySize, pos + n * keyEntrySize);
+				}
+
+				begin = end;
+			}
+			return true;
+		}
+
+		// follow table links, one table at a time
+		bool scanTables(ulong64 tablePos) {
+			while (tablePos > 0) {
+				TTableHeader h;
+				if (!readAt(tablePos, (byte*)&h, sizeof(TTableHeader))) return false;
+
+				std::vector<TTablePiece> pieces;
+				splitTable(tablePos, h.recordCount, pieces);
+				if (!readTablePieces(pieces)) return false;
+				tablePos = h.nextTable;
+			}
+			return true;
+		}
+
+		// all tables listed by directory at once, false if directory is missing or damaged
+		bool readTableDirectory(ulong64 pos) {
+			const ulong64 end = fileEnd();
+			if (pos == 0 || pos + sizeof(TTableDirectoryHeader) > end) return false;
+
+			TTableDirectoryHeader h;
+			if (!readAt(pos, (byte*)&h, sizeof(h)) || h.count == 0 || h.count > h.capacity || h.count > (end - pos) / sizeof(TTableDirectoryEntry)) return false;
+
+			std::vector<TTableDirectoryEntry> entries(h.count);
+			if (!readAt(pos + sizeof(h), (byte*)entries.data(), entries.size() * sizeof(TTableDirectoryEntry))) return false;
+			if (checksum((const byte*)entries.data(), entries.size() * sizeof(TTableDirectoryEntry)) != h.checksum) return false;
+
+			std::vector<TTablePiece> pieces;
+			for (const auto& e : entries) splitTable(e.pos, e.recordCount, pieces);
+			if (!readTablePieces(pieces)) return false;
+
+			// tables added after last directory write are reached by links
+			return scanTables(tableList.back()().nextTable);
+		}
+
+		// directory is extended in place only if it lists all tables
+		void checkTableDirectory() {
+			directoryCapacity = 0;
+			TTableDirectoryHeader h;
+			if (directoryPos != 0 && readAt(directoryPos, (byte*)&h, sizeof(h)) && h.count == tableList.size() && h.count <= h.capacity) {
+				directoryCapacity = h.capacity;
+			}
+		}
+
+		// directory gets new entry in place, or is rewritten with double capacity at end of file.
+		// Replaced directory is left as dead space, it is small next to tables it lists.
+		void writeTableDirectory() {
+			std::vector<TTableDirectoryEntry> entries;
+			entries.reserve(tableList.size());
+			for (const auto& t : tableList) entries.push_back(TTableDirectoryEntry{ t.pos, t().recordCount });
+
+			TTableDirectoryHeader h;
+			h.count = entries.size();
+			h.checksum = checksum((const byte*)entries.data(), entries.size() * sizeof(TTableDirectoryEntry));
+
+			if (directoryCapacity >= h.count) {
+				h.capacity = directoryCapacity;
+				writeAt(directoryPos + sizeof(h) + (h.count - 1) * sizeof(TTableDirectoryEntry), (const byte*)&entries.back(), sizeof(TTableDirectoryEntry));
+				writeAt(directoryPos, (const byte*)&h, sizeof(h));
+				return;
+			}
+
+			h.capacity = std::max<ulong64>(KVDB_TABLE_DIRECTORY_MIN, h.count * 2);
+			std::vector<byte> data(sizeof(h) + h.capacity * sizeof(TTableDirectoryEntry), 0);
+			std::memcpy(data.data(), &h, sizeof(h));
+			std::memcpy(data.data() + sizeof(h), entries.data(), entries.size() * sizeof(TTableDirectoryEntry));
+			directoryPos = appendAtEnd(data.data(), data.size());
+			directoryCapacity = h.capacity;
+
+			const ulong64 pos = directoryPos;
+			writeAt(offsetof(TFileHeader, tableDirectory), (const byte*)&pos, sizeof(pos));
+		}
+
+		// tables grow geometrically from reservedKeys up to maxTableSize entries
+		ulong64 nextTableSize() const {
+			const ulong64 last = tableList.empty() ? 0 : tableList.back()().recordCount;
+			return std::max<ulong64>(1, std::min<ulong64>(maxTableSize, std::max<ulong64>(reservedKeys, (ulong64)(last * tableGrowth))));
+		}
+
+		void createNewTable() {
+			const ulong64 keyEntrySize = sizeof(TKeyEntryHeader) + keySize;
+
+			// new table with zeroed reserved keys, only its header is written
+			const ulong64 records = nextTableSize();
+			TTableHeader newTable{records, 0};
+			ulong64 newTablePos = appendSparse((const byte*)&newTable, sizeof(TTableHeader), sizeof(TTableHeader) + keyEntrySize * records);
+			counters.inc(counters.tablesCreated);
+
+			for (ulong64 i = 0; i < records; i++) {
+				reservedKeyList.push_back(newTablePos + sizeof(TTableHeader) + keyEntrySize * i);
+			}
+
+			// read previous last table 
+			TTableHeaderInfo& lastTable = tableList.back();
+
+			// add link to new table
+			lastTable().nextTable = newTablePos;
+
+			// rewrite previous last table
+			writeAt(lastTable.pos, (const byte*)&lastTable(), sizeof(TTableHeader));
+
+			// add new table to internal list
+			tableList.push_back(TTableHeaderInfo(newTable, newTablePos));
+			writeTableDirectory();
+		}
+
+		bool hasReserved() const {
+			return reservedKeyList.size() > 0;
+		}
+
+		// remove extent from free space, oversized extent is split and its tail stays free
+		ulong64 takeExtent(const TFreeExtent& e, ulong64 need) {
+			freeSpace.remove(e.dataPos);
+
+			if (e.length >= need + KVDB_MIN_DATA_SIZE && hasReserved()) {
+				TFreeExtent tail{ e.dataPos + need, e.length - need, reservedKeyList.front() };
+				reservedKeyList.pop_front();
+				freeSpace.insert(tail);
+				writeFreeSlot(tail);
+				return need;
+			}
+
+			return e.length;
+		}
+
+		bool tryWriteToSuitableDeletedPair(const byte* key, const TValueData& valueData, const ulong64 k_flags, const uint16 entryFlags, ulong64 reserve) {
+			if (valueData.size() == 0) return false;
+
+			applyDeferredFrees();
+
+			const ulong64 size = std::max<ulong64>(valueData.size(), reserve);
+			const TFreeExtent* fit = alignedValue(valueData.size()) ? freeSpace.bestFitAligned(expandedSize(size), valueAlignment) : freeSpace.bestFit(size);
+			counters.inc(fit ? counters.reuseHits : counters.reuseMisses);
+			if (fit == nullptr) return false;
+
+			const TFreeExtent e = *fit;
+			const ulong64 capacity = takeExtent(e, expandedSize(size));
+
+			TKeyRecord r;
+			r.dataPos = e.dataPos;
+			r.slotPos = e.slotPos;
+			r.capacity = capacity;
+
+			rewritePair(r, key, valueData, k_flags, entryFlags);
+			dataMap.insert(key, r);
+			if (orderedIndexEnabled) orderedIndex.insert(orderOf(key), key);
+			return true;
+		}
+
+		// reserve is capacity wanted for value to grow into
+		void addNew(const byte* key, const TValueData& valueData, const ulong64 k_flags, const uint16 entryFlags, ulong64 reserve = 0) {
+			if (!tryWriteToSuitableDeletedPair(key, valueData, k_flags, entryFlags, reserve)) {
+				if (hasReserved()) {
+					newPairFromReserved(key, valueData, k_flags, entryFlags, reserve);
+				} else {
+					createNewTable();
+					newPairFromReserved(key, valueData, k_flags, entryFlags, reserve);
+				}
+			}
+		}
+
+		// positional read, called under shared lock
+		bool readValue(const TKeyRecord& h, byte* dst) const {
+#ifdef KVDB_POSIX_IO
+			if (directFd >= 0 && alignedValue(h.dataLength) && h.dataPos % valueAlignment == 0) {
+				const size_t length = (size_t)alignUp(h.dataLength);
+				TAlignedBlock block = alignedBlock((size_t)valueAlignment, length);
+				if (block && preadAtLeast(directFd, block.get(), length, h.dataLength, h.dataPos)) {
+					counters.read(length, false);
+					std::memcpy(dst, block.get(), h.dataLength);
+					return true;
+				}
+			}
+			if (readFd >= 0) {
+				counters.read(h.dataLength, false);
+				return preadFull(readFd, dst, h.dataLength, h.dataPos);
+			}
+#endif
+			counters.read(h.dataLength, true);
+			std::lock_guard<std::mutex> guard(streamReadMutex);
+			filePtr->seekg(h.dataPos);
+			return (bool)filePtr->read((char*)dst, h.dataLength);
+		}
+
+		// stored value, decompressed if needed
+		bool readValueData(const TKeyRecord& r, TValueData& dst) const {
+			if ((r.entryFlags & KVDB_ENTRY_COMPRESSED) == 0) {
+				dst.resize(r.dataLength);
+				return readValue(r, dst.data());
+			}
+
+			TValueData packed(r.dataLength);
+			return readValue(r, packed.data()) && unpackValue(packed, dst);
+		}
+
+		static bool unpackValue(const TValueData& packed, TValueData& dst) {
+			dst.resize(TLzCodec::rawSize(packed.data(), packed.size()));
+			return TLzCodec::decompress(packed.data(), packed.size(), dst.data(), dst.size());
+		}
+
+		// value of multi-get waiting for read
+		typedef struct TPendingRead {
+			TKeyRecord r;
+			size_t index; // in request
+			byte* dst;
+			TValueDataPtr data; // owns dst unless value goes to caller buffer
+			bool ok;
+		} TPendingRead;
+
+		// reads sorted by position from first to last, gaps between them are read into scratch
+		bool readExtents(TPendingRead* first, TPendingRead* last, byte* scratch) const {
+#ifdef KVDB_POSIX_IO
+			if (readFd >= 0) {
+				std::vector<struct iovec> iov;
+				ulong64 end = first->r.dataPos;
+				for (TPendingRead* p = first; p != last; p++) {
+					if (p->r.dataPos > end) iov.push_back({ scratch, (size_t)(p->r.dataPos - end) });
+					iov.push_back({ p->dst, (size_t)p->r.dataLength });
+					end = p->r.dataPos + p->r.dataLength;
+				}
+				counters.read(end - first->r.dataPos, false);
+				return preadvFull(readFd, iov.data(), (int)iov.size(), first->r.dataPos);
+			}
+#endif
+			counters.read((last - 1)->r.dataPos + (last - 1)->r.dataLength - first->r.dataPos, true);
+			std::lock_guard<std::mutex> guard(streamReadMutex);
+			filePtr->seekg(first->r.dataPos);
+			for (TPendingRead* p = first; p != last; p++) {
+				const ulong64 gap = p->r.dataPos - (ulong64)filePtr->tellg();
+				if (gap > 0 && !filePtr->read((char*)scratch, gap)) return false;
+				if (!filePtr->read((char*)p->dst, p->r.dataLength)) return false;
+			}
+			return true;
+		}
+
+		// Multi-get: keys are looked up under one shared lock, values are read in file order and
+		// near ones are merged into one vectored read. Value i goes to values[i] or, if fixed is set,
+		// to fixed + i * fixedSize and found[i]. Null keys are skipped.
+		template <size_t N = 0>
+		void loadKeys(const std::vector<const byte*>& keys, std::vector<TValueDataPtr>& values, byte* fixed = nullptr, size_t fixedSize = 0, std::vector<bool>* found = nullptr) const {
+			values.assign(fixed ? 0 : keys.size(), nullptr);
+			if (found) found->assign(keys.size(), false);
+			if (!isOpen()) return;
+
+			auto deliver = [&](size_t i, const TValueDataPtr& dataPtr) {
+				if (fixed) {
+					byte* dst = fixed + i * fixedSize;
+					const size_t n = std::min(fixedSize, dataPtr->size());
+					std::memcpy(dst, dataPtr->data(), n);
+					std::memset(dst + n, 0, fixedSize - n);
+					(*found)[i] = true;
+				} else {
+					values[i] = dataPtr;
+				}
+			};
+
+			std::vector<TPendingRead> pending;
+			pending.reserve(keys.size());
+
+			std::shared_lock<std::shared_mutex> lock(fileSharedMutex);
+
+			const bool cached = valueCache.enabled();
+			for (size_t i = 0; i < keys.size(); i++) {
+				if (keys[i] == nullptr) continue;
+
+				if (cached) {
+					if (TValueDataPtr dataPtr = valueCache.template get<N>(keys[i])) {
+						deliver(i, dataPtr);
+						continue;
+					}
+				}
+
+				const TKeyRecord* r = dataMap.template find<N>(keys[i]);
+				if (r == nullptr) continue;
+				if (r->dataLength == 0) {
+					deliver(i, TValueDataPtr(new TValueData));
+					continue;
+				}
+
+				TPendingRead p = { *r, i, nullptr, nullptr, false };
+				if (fixed && (r->entryFlags & KVDB_ENTRY_COMPRESSED) == 0 && r->dataLength == fixedSize) {
+					p.dst = fixed + i * fixedSize;
+				} else {
+					p.data = TValueDataPtr(new TValueData(r->dataLength));
+					p.dst = p.data->data();
+				}
+				pending.push_back(p);
+			}
+
+			std::stable_sort(pending.begin(), pending.end(), [](const TPendingRead& a, const TPendingRead& b) { return a.r.dataPos < b.r.dataPos; });
+
+			// same key asked twice is read once
+			std::vector<byte> scratch(KVDB_MULTI_GET_GAP);
+			for (size_t first = 0; first < pending.size(); ) {
+				size_t last = first + 1;
+				size_t buffers = 1;
+				ulong64 end = pending[first].r.dataPos + pending[first].r.dataLength;
+				while (last < pending.size() && pending[last].r.dataPos >= end && pending[last].r.dataPos - end <= KVDB_MULTI_GET_GAP && buffers + 2 <= KVDB_READV_MAX) {
+					buffers += (pending[last].r.dataPos > end) ? 2 : 1;
+					end = pending[last].r.dataPos + pending[last].r.dataLength;
+					last++;
+				}
+
+				const bool ok = readExtents(&pending[first], &pending[0] + last, scratch.data());
+				for (size_t i = first; i < last; i++) pending[i].ok = ok;
+
+				for (; last < pending.size() && pending[last].r.dataPos == pending[last - 1].r.dataPos; last++) {
+					TPendingRead& p = pending[last];
+					p.ok = pending[last - 1].ok;
+					if (p.ok) std::memcpy(p.dst, pending[last - 1].dst, p.r.dataLength);
+				}
+				first = last;
+			}
+
+			for (TPendingRead& p : pending) {
+				if (!p.ok) continue;
+
+				if (p.data == nullptr) {
+					(*found)[p.index] = true;
+					continue;
+				}
+
+				TValueDataPtr dataPtr = p.data;
+				if (p.r.entryFlags & KVDB_ENTRY_COMPRESSED) {
+					dataPtr = TValueDataPtr(new TValueData);
+					if (!unpackValue(*p.data, *dataPtr)) continue;
+				}
+
+				if (cached) valueCache.put(keys[p.index], dataPtr);
+				deliver(p.index, dataPtr);
+			}
+		}
+
+#ifdef KVDB_POSIX_IO
+		// file is mapped with headroom, so appends rarely force a remap; 
+		// the replaced mapping stays alive while views still hold it
+		std::shared_ptr<TFileMapping> mappingFor(ulong64 end) const {
+			std::lock_guard<std::mutex> guard(mappingMutex);
+			if (mapping && mapping->size() >= end) return mapping;
+
+			struct stat st;
+			if (fstat(readFd, &st) != 0 || (ulong64)st.st_size < end) return nullptr;
+
+			auto m = TFileMapping::map(readFd, std::max<size_t>(KVDB_MMAP_MIN_SIZE, (size_t)st.st_size * 2));
+			if (m) {
+				if (mapping) retiredMappings.push_back(mapping);
+				mapping = m;
+			}
+			return m;
+		}
+#endif
+
+		// no view can point into file tail
+		bool canTruncate() const {
+#ifdef KVDB_POSIX_IO
+			std::lock_guard<std::mutex> guard(mappingMutex);
+			if (mapping && mapping.use_count() > 1) return false;
+			retiredMappings.erase(std::remove_if(retiredMappings.begin(), retiredMappings.end(), [](const auto& w) { return w.expired(); }), retiredMappings.end());
+			return retiredMappings.empty();
+#else
+			return true;
+#endif
+		}
+
+		// cut free extents at end of file
+		ulong64 truncateTail() {
+			filePtr->flush();
+			filePtr->seekp(0, std::ios::end);
+			const ulong64 fileEnd = (ulong64)filePtr->tellp();
+
+			ulong64 newEnd = fileEnd;
+			while (const TFreeExtent* last = freeSpace.last()) {
+				if (last->dataPos + last->length != newEnd) break;
+				newEnd = last->dataPos;
+				const ulong64 slotPos = last->slotPos;
+				freeSpace.remove(last->dataPos);
+				releaseSlot(slotPos);
+			}
+
+			if (newEnd == fileEnd) return 0;
+
+			markModified();
+			flushTablePages();
+			filePtr->flush();
+			std::error_code ec;
+			std::filesystem::resize_file(filePath, newEnd, ec);
+			return ec ? 0 : fileEnd - newEnd;
+		}
+
+		// move one live value into a free extent below it, false if it does not fit anywhere
+		bool relocateValue(const byte* key, TKeyRecord& r, ulong64& bytesMoved) {
+			const TKeyRecord old = r;
+			// in key order values go to lowest hole, so neighbours end up next to each other
+			const TFreeExtent* fit = keyOrder ? freeSpace.firstFitBelow(old.dataLength, old.dataPos) : freeSpace.bestFitBelow(old.dataLength, old.dataPos);
+			if (fit == nullptr) return false;
+			if (alignedValue(old.dataLength) && fit->dataPos % valueAlignment != 0) return false;
+
+			TValueData valueData(old.dataLength);
+			if (!readValue(old, valueData.data())) return false;
+
+			const TFreeExtent e = *fit;
+			const ulong64 capacity = takeExtent(e, expandedSize(old.dataLength));
+
+			// new copy first, then release the old extent
+			r.dataPos = e.dataPos;
+			r.slotPos = e.slotPos;
+			r.capacity = capacity;
+			writeValue(r, valueData);
+			if (walEnabled) syncData(); // moves are not logged, copy is on disk before key entry points at it
+			writeKeyEntry(r, key);
+
+			releaseExtent(old.slotPos, old.dataPos, old.capacity);
+
+			bytesMoved += old.dataLength;
+			return true;
+		}
+
+		std::string indexFilePath() const {
+			return filePath + KVDB_INDEX_FILE_EXT;
+		}
+
+		ulong64 fileEnd() {
+			filePtr->flush();
+			filePtr->seekp(0, std::ios::end);
+			return (ulong64)filePtr->tellp();
+		}
+
+		// dump tables, live keys, free extents and reserved slots, stamp file header to match
+		void writeIndexSnapshot() {
+			const ulong64 keyEntrySize = sizeof(TKeyEntryHeader) + keySize;
+
+			TIndexHeader ih;
+			ih.keySize = keySize;
+			ih.stamp = (ulong64)std::chrono::system_clock::now().time_since_epoch().count() | 1;
+			ih.fileSize = fileEnd();
+			ih.tableCount = tableList.size();
+			ih.liveCount = dataMap.size();
+			ih.freeCount = freeSpace.size();
+			ih.reservedCount = reservedKeyList.size();
+
+			std::vector<byte> body;
+			body.reserve(ih.tableCount * (8 + sizeof(TTableHeader)) + ih.liveCount * (8 + keyEntrySize) + ih.freeCount * sizeof(TFreeExtent) + ih.reservedCount * 8);
+
+			auto put = [&](const void* src, size_t size) { body.insert(body.end(), (const byte*)src, (const byte*)src + size); };
+
+			for (const auto& t : tableList) {
+				put(&t.pos, 8);
+				put(&t(), sizeof(TTableHeader));
+			}
+
+			std::vector<byte> entry(keyEntrySize);
+			dataMap.forEach([&](const byte* key, const TKeyRecord& r) {
+				serializeKey(r, key, keySize, entry.data());
+				put(&r.slotPos, 8);
+				put(entry.data(), entry.size());
+			});
+
+			for (const auto& e : freeSpace.extents()) {
+				put(&e.second, sizeof(TFreeExtent));
+			}
+
+			for (const ulong64& r : reservedKeyList) {
+				put(&r, 8);
+			}
+
+			ih.checksum = checksum(body.data(), body.size());
+
+			const std::string tmpPath = indexFilePath() + ".tmp";
+			{
+				std::ofstream out(tmpPath, std::ios::out | std::ios::binary | std::ios::trunc);
+				if (!out) return;
+				std::ofstream* outPtr = &out;
+				write(outPtr, ih);
+				out.write((char*)body.data(), body.size());
+				if (!out) return;
+			}
+
+			std::error_code ec;
+			std::filesystem::rename(tmpPath, indexFilePath(), ec);
+			if (ec) return;
+
+			const ulong64 stamp = ih.stamp; // packed field
+			filePtr->seekp(offsetof(TFileHeader, timestamp));
+			write(filePtr, stamp);
+			filePtr->flush();
+			indexStamp = ih.stamp;
+		}
+
+		// bulk load of index snapshot, false if missing or stale
+		bool readIndexSnapshot(ulong64 stamp) {
+			if (stamp == 0) return false;
+
+			std::ifstream in(indexFilePath(), std::ios::in | std::ios::binary);
+			if (!in) return false;
+
+			TIndexHeader ih;
+			std::ifstream* inPtr = &in;
+			read(inPtr, ih);
+			if (!in || std::memcmp(ih.h, TIndexHeader().h, 4) != 0 || ih.version != KVDB_INDEX_VERSION) return false;
+			if (ih.keySize != keySize || ih.stamp != stamp || ih.fileSize != fileEnd()) return false;
+
+			// counts are not checked by checksum yet, body must fit in the file before it is allocated
+			std::error_code ec;
+			const ulong64 indexSize = (ulong64)std::filesystem::file_size(indexFilePath(), ec);
+			if (ec || indexSize < sizeof(TIndexHeader)) return false;
+			const ulong64 available = indexSize - sizeof(TIndexHeader);
+
+			const ulong64 keyEntrySize = sizeof(TKeyEntryHeader) + keySize;
+			if (ih.tableCount > available / (8 + sizeof(TTableHeader)) || ih.liveCount > available / (8 + keyEntrySize)) return false;
+			if (ih.freeCount > available / sizeof(TFreeExtent) || ih.reservedCount > available / 8) return false;
+			const ulong64 bodySize = ih.tableCount * (8 + sizeof(TTableHeader)) + ih.liveCount * (8 + keyEntrySize) + ih.freeCount * sizeof(TFreeExtent) + ih.reservedCount * 8;
+			if (bodySize != available) return false;
+
+			std::vector<byte> body(bodySize);
+			in.read((char*)body.data(), body.size());
+			if (!in || checksum(body.data(), body.size()) != ih.checksum) return false;
+
+			const byte* p = body.data();
+			auto get = [&](void* dst, size_t size) { std::memcpy(dst, p, size); p += size; };
+
+			for (ulong64 i = 0; i < ih.tableCount; i++) {
+				TTableHeaderInfo t;
+				get(&t.pos, 8);
+				get(&t(), sizeof(TTableHeader));
+				tableList.push_back(t);
+			}
+
+			dataMap.reserve(ih.liveCount);
+			for (ulong64 i = 0; i < ih.liveCount; i++) {
+				TKeyEntryHeader header;
+				ulong64 pos;
+				get(&pos, 8);
+				get(&header, sizeof(TKeyEntryHeader));
+				dataMap.insert(p, recordOf(header, pos));
+				p += keySize;
+			}
+
+			for (ulong64 i = 0; i < ih.freeCount; i++) {
+				TFreeExtent e;
+				get(&e, sizeof(TFreeExtent));
+				freeSpace.insert(e);
+			}
+
+			for (ulong64 i = 0; i < ih.reservedCount; i++) {
+				ulong64 pos;
+				get(&pos, 8);
+				reservedKeyList.push_back(pos);
+			}
+
+			return true;
+		}
+
+		// called under exclusive lock
+		void applyBatch(const TWriteBatch& batch) {
+			// last put or erase of key and updates after it
+			std::vector<const TWriteBatch::TBatchOp*> ops;
+			std::unordered_set<TKeyData> seen;
+			ops.reserve(batch.size());
+			for (auto itr = batch.ops().rbegin(); itr != batch.ops().rend(); ++itr) {
+				if (seen.count(itr->key)) continue;
+				ops.push_back(&(*itr));
+				if (!itr->patch) seen.insert(itr->key);
+			}
+			std::reverse(ops.begin(), ops.end());
+
+			// new values are appended in key order
+			if (keyOrder) {
+				std::stable_sort(ops.begin(), ops.end(), [&](const auto* a, const auto* b) {
+					return keyOrder(a->key.data(), a->key.size()) < keyOrder(b->key.data(), b->key.size());
+				});
+			}
+
+			beginWriteBuffer();
+			for (const auto* op : ops) {
+				if (op->key.size() != keySize) continue;
+				if (op->erase) {
+					earsePair(op->key.data());
+				} else if (op->patch) {
+					updatePair(op->key.data(), op->offset, op->value, op->append);
+				} else {
+					savePair(op->key.data(), op->value, op->flags);
+				}
+			}
+			flushWriteBuffer();
+		}
+
+		std::string walFilePath() const {
+			return filePath + KVDB_WAL_FILE_EXT;
+		}
+
+		void syncData() {
+			filePtr->flush();
+#ifdef KVDB_POSIX_IO
+			if (readFd >= 0) fdatasync(readFd);
+#endif
+		}
+
+		// table on disk is durable and points at new places of values, held extents can be reused.
+		// Called under exclusive lock.
+		void syncTable() {
+			flushTablePages();
+			syncData();
+			releaseHeldFrees();
+		}
+
+		// data file is durable, log can be dropped. Called under exclusive lock.
+		void checkpoint() {
+			syncTable();
+			wal.truncate();
+		}
+
+		// length of stored value before compression, compressed value is not read whole
+		bool rawLength(const TKeyRecord& r, ulong64& length) const {
+			if ((r.entryFlags & KVDB_ENTRY_COMPRESSED) == 0) {
+				length = r.dataLength;
+				return true;
+			}
+
+			TKeyRecord header = r;
+			const ulong64 dataLength = r.dataLength; // record is packed
+			header.dataLength = std::min<ulong64>(dataLength, TLzCodec::HEADER_SIZE);
+			byte dst[TLzCodec::HEADER_SIZE];
+			if (!readValue(header, dst)) return false;
+			length = TLzCodec::rawSize(dst, (size_t)header.dataLength);
+			return true;
+		}
+
+		// key as earlier batches of group leave it: missing, stored value with in-place patches
+		// not yet applied, or whole value once it is logged as put
+		typedef struct TPatchTarget {
+			bool missing = true;
+			bool whole = false;
+			TKeyRecord record{};
+			ulong64 length = 0; // raw length
+			ulong64 flags = 0;
+			TValueData value;
+			std::vector<std::pair<ulong64, TValueData>> pending;
+		} TPatchTarget;
+
+		// Updates applied in place are logged as patches at absolute offsets, append goes to
+		// offset of value end. Replay then gives the same value whether or not the patch already
+		// reached the file. Update which updatePair() moves to new extent is logged as put of
+		// whole value: the new extent is not synced before the key entry pointing at it, so
+		// replay must not depend on its bytes. Decisions match updatePair() for pinned, which is
+		// snapshot state when they are applied. targets holds keys left by earlier batches of
+		// group. Called by front writer under shared or exclusive lock, so stored values do not
+		// change before group is applied. False if a stored value can't be read.
+		bool resolvePatches(const TWriteBatch& batch, bool pinned, std::unordered_map<TKeyData, TPatchTarget>& targets, TWriteBatch& resolved) const {
+			std::unordered_map<TKeyData, TPatchTarget> changed;
+
+			for (const auto& op : batch.ops()) {
+				if (op.key.size() != keySize) continue;
+
+				auto itr = changed.find(op.key);
+				if (itr == changed.end()) {
+					TPatchTarget t;
+					auto prev = targets.find(op.key);
+					if (prev != targets.end()) {
+						t = prev->second;
+					} else if (const TKeyRecord* r = dataMap.find(op.key.data())) {
+						t.missing = false;
+						t.record = *r;
+						t.flags = r->flags;
+						if (!rawLength(*r, t.length)) return false;
+					}
+					itr = changed.emplace(op.key, std::move(t)).first;
+				}
+				TPatchTarget& t = itr->second;
+
+				if (op.erase) {
+					resolved.erase(op.key);
+					t = TPatchTarget();
+					continue;
+				}
+
+				if (!op.patch) {
+					resolved.put(op.key, op.value, op.flags);
+					if (op.value.empty() && !t.missing) {
+						// empty value erases existing key
+						t = TPatchTarget();
+					} else {
+						t = TPatchTarget();
+						t.missing = false;
+						t.whole = true;
+						t.value = op.value;
+						t.length = op.value.size();
+						t.flags = op.flags;
+					}
+					continue;
+				}
+
+				if (op.value.empty()) continue;
+
+				if (t.missing) {
+					if (!op.append) continue;
+					resolved.put(op.key, op.value);
+					t.missing = false;
+					t.whole = true;
+					t.value = op.value;
+					t.length = op.value.size();
+					t.flags = 0;
+					continue;
+				}
+
+				const ulong64 offset = op.append ? t.length : op.offset;
+				if (offset > t.length) continue;
+				const ulong64 end = offset + op.value.size();
+
+				if (!t.whole) {
+					const TKeyRecord& r = t.record;
+					const ulong64 dataPos = r.dataPos;
+					const bool compressed = (r.entryFlags & KVDB_ENTRY_COMPRESSED) != 0;
+					const bool misaligned = alignedValue(end) && dataPos % valueAlignment != 0;
+					if (!compressed && end <= r.capacity && !pinned && !misaligned) {
+						resolved.update(op.key, offset, op.value);
+						t.pending.emplace_back(offset, op.value);
+						t.length = std::max<ulong64>(t.length, end);
+						continue;
+					}
+
+					// value moves, stored bytes and patches of group become whole value
+					if (!readValueData(r, t.value)) return false;
+					for (const auto& p : t.pending) {
+						t.value.resize(std::max<ulong64>(t.value.size(), p.first + p.second.size()));
+						std::memcpy(t.value.data() + p.first, p.second.data(), p.second.size());
+					}
+					t.pending.clear();
+					t.whole = true;
+				}
+
+				t.value.resize(std::max<ulong64>(t.value.size(), end));
+				std::memcpy(t.value.data() + offset, op.value.data(), op.value.size());
+				t.length = t.value.size();
+				resolved.put(op.key, t.value, t.flags);
+			}
+
+			for (auto& c : changed) targets[c.first] = std::move(c.second);
+			return true;
+		}
+
+		// whole group is resolved again, called under exclusive or shared lock
+		void resolveGroup(const std::vector<TWalWriter*>& group, bool pinned, std::vector<byte>& log) const {
+			std::unordered_map<TKeyData, TPatchTarget> targets;
+			for (auto* g : group) {
+				TWriteBatch resolved;
+				g->ok = resolvePatches(*g->batch, pinned, targets, resolved);
+				if (g->ok) TWalFile::encode(resolved, log);
+			}
+		}
+
+		// group commit: queued writers are logged with one write and one sync by the front writer,
+		// then applied in queue order. False if batch was not logged and not applied.
+		bool commitBatch(const TWriteBatch& batch) {
+			TWalWriter w;
+			w.batch = &batch;
+
+			std::unique_lock<std::mutex> lock(walMutex);
+			walWriters.push_back(&w);
+			while (!w.done && &w != walWriters.front()) w.cv.wait(lock);
+			if (w.done) return w.ok;
+
+			std::vector<TWalWriter*> group(walWriters.begin(), walWriters.end());
+			lock.unlock();
+
+			const bool patches = std::any_of(group.begin(), group.end(), [](const TWalWriter* g) {
+				return std::any_of(g->batch->ops().begin(), g->batch->ops().end(), [](const auto& op) { return op.patch; });
+			});
+
+			std::vector<byte> log;
+			ulong64 generation = 0;
+			bool pinned = false;
+			if (patches) {
+				std::shared_lock<std::shared_mutex> shared(fileSharedMutex);
+				generation = writeGeneration;
+				pinned = snapshotPins->any();
+				resolveGroup(group, pinned, log);
+			} else {
+				for (auto* g : group) TWalFile::encode(*g->batch, log);
+			}
+			wal.append(log);
+
+			if (durability == KVDB_DURABILITY_COMMIT) {
+				wal.sync();
+				walSyncs++;
+			} else {
+				walUnsynced = true;
+			}
+
+			{
+				std::lock_guard<std::shared_mutex> guard(fileSharedMutex);
+				if (patches && (writeGeneration != generation || (snapshotPins->any() && !pinned))) {
+					// compaction or new snapshot moved values since patches were resolved,
+					// log is extended with records matching what is applied now
+					std::vector<byte> again;
+					resolveGroup(group, snapshotPins->any(), again);
+					wal.append(again);
+					if (durability == KVDB_DURABILITY_COMMIT) wal.sync();
+				}
+				for (auto* g : group) {
+					if (g->ok) applyBatch(*g->batch);
+				}
+				filePtr->flush();
+				flushTablePagesIfDue();
+				if (wal.size() > KVDB_WAL_CHECKPOINT_SIZE || heldFreeBytes > KVDB_HELD_FREE_SIZE) checkpoint();
+			}
+
+			lock.lock();
+			for (auto* g : group) {
+				walWriters.pop_front();
+				g->done = true;
+				if (g != &w) g->cv.notify_one();
+			}
+			if (!walWriters.empty()) walWriters.front()->cv.notify_one();
+			return w.ok;
+		}
+
+		// patches are logged only where they were applied in place, so they land on values of
+		// last checkpoint or on later ones with same bytes either way. Moved values are logged whole.
+		void replayWal() {
+			const std::vector<TWriteBatch> batches = TWalFile::decode(walFilePath());
+			for (const auto& batch : batches) applyBatch(batch);
+			if (batches.size() > 0) {
+				flushTablePages();
+				syncData();
+			}
+			releaseHeldFrees();
+		}
+
+		void startWal() {
+			replayWal();
+			wal.open(walFilePath());
+			wal.truncate();
+
+			if (durability == KVDB_DURABILITY_PERIODIC) {
+				walStop = false;
+				walSyncThread = std::thread([this]() {
+					std::unique_lock<std::mutex> lock(walMutex);
+					while (!walStop) {
+						walSyncCv.wait_for(lock, std::chrono::milliseconds(syncIntervalMs));
+						if (walUnsynced.exchange(false)) {
+							lock.unlock();
+							wal.sync();
+							walSyncs++;
+							lock.lock();
+						}
+					}
+				});
+			}
+		}
+
+		void stopWal() {
+			if (walSyncThread.joinable()) {
+				{
+					std::lock_guard<std::mutex> guard(walMutex);
+					walStop = true;
+				}
+				walSyncCv.notify_all();
+				walSyncThread.join();
+			}
+
+			std::lock_guard<std::shared_mutex> guard(fileSharedMutex);
+			checkpoint();
+			wal.close();
+		}
+
+		// lookups by key bytes, N is key size if known at compile time
+
+		template <size_t N = 0>
+		bool isExistKey(const byte* key) const {
+			if (!isOpen()) return false;
+			std::shared_lock<std::shared_mutex> lock(fileSharedMutex);
+			return dataMap.template find<N>(key) != nullptr;
+		}
+
+		template <size_t N = 0>
+		ulong64 flagsOf(const byte* key) const {
+			if (!isOpen()) return 0;
+			std::shared_lock<std::shared_mutex> lock(fileSharedMutex);
+			const TKeyRecord* r = dataMap.template find<N>(key);
+			return r ? r->flags : 0;
+		}
+
+		template <size_t N = 0>
+		TValueDataPtr loadKey(const byte* key) const {
+			if (!isOpen()) return nullptr;
+			TStatsCounters::TTimer timer(counters, counters.load);
+
+			std::shared_lock<std::shared_mutex> lock(fileSharedMutex);
+
+			const bool cached = valueCache.enabled();
+			if (cached) {
+				if (TValueDataPtr dataPtr = valueCache.template get<N>(key)) return dataPtr;
+			}
+
+			const TKeyRecord* r = dataMap.template find<N>(key);
+			if (r == nullptr) return nullptr;
+
+			TValueDataPtr dataPtr = TValueDataPtr(new TValueData);
+
+			if (readValueData(*r, *dataPtr)) {
+				if (cached) valueCache.put(key, dataPtr); // writers wait for shared lock, value is current
+				return dataPtr;
+			}
+
+			return nullptr;
+		}
+
+#ifdef KVDB_POSIX_IO
+		// mapping under a view and pin of file extents, like snapshot: while it lives values are
+		// not rewritten in place and freed extents are not reused
+		typedef struct TViewGuard {
+			std::shared_ptr<TFileMapping> mapping;
+			std::shared_ptr<TSnapshotPins> pins;
+			ulong64 epoch = 0;
+
+			~TViewGuard() {
+				pins->unpin(epoch);
+			}
+		} TViewGuard;
+#endif
+
+		// zero-copy read: view points straight into the mapped file if mmap is enabled,
+		// otherwise into a private copy. Mapped view pins extents of file until it is destroyed.
+		template <size_t N = 0>
+		TValueView viewKey(const byte* key) const {
+			if (!isOpen()) return TValueView();
+
+#ifdef KVDB_POSIX_IO
+			if (mmapRead) {
+				std::shared_lock<std::shared_mutex> lock(fileSharedMutex);
+
+				const TKeyRecord* r = dataMap.template find<N>(key);
+				if (r == nullptr) return TValueView();
+
+				// compressed value is decompressed into private copy below
+				const TKeyRecord& h = *r;
+				if ((h.entryFlags & KVDB_ENTRY_COMPRESSED) == 0) {
+					if (auto m = mappingFor(h.dataPos + h.dataLength)) {
+						auto guard = std::make_shared<TViewGuard>();
+						guard->mapping = m;
+						guard->pins = snapshotPins;
+						guard->epoch = snapshotPins->pin();
+						return TValueView(m->data() + h.dataPos, h.dataLength, guard);
+					}
+				}
+			}
+#endif
+
+			TValueDataPtr dataPtr = loadKey<N>(key);
+			if (dataPtr == nullptr) return TValueView();
+			return TValueView(dataPtr->data(), dataPtr->size(), dataPtr);
+		}
+
+		void change(const byte* key, TKeyRecord& r, const TValueData& valueData, const ulong64 k_flags, const uint16 entryFlags) {
+			if (valueData.size() > 0) {
+				const bool misaligned = alignedValue(valueData.size()) && r.dataPos % valueAlignment != 0;
+				if (r.capacity >= valueData.size() && !snapshotPins->any() && !misaligned) {
+					rewritePair(r, key, valueData, k_flags, entryFlags);
+				} else {
+					//remove old and create new, old value stays for snapshots. r is stale after erase
+					counters.inc(counters.relocations);
+					earsePair(key);
+					addNew(key, valueData, k_flags, entryFlags);
+				}
+			} else {
+				// erase
+				earsePair(key);
+			}
+		}
+
+		// called under exclusive lock
+		void savePair(const byte* key, const TValueData& valueData, const ulong64 k_flags) {
+			valueCache.invalidate(key);
+
+			// values that do not compress are stored raw
+			TValueData packed;
+			const bool pack = compression && valueData.size() >= KVDB_COMPRESS_MIN_SIZE && TLzCodec::compress(valueData.data(), valueData.size(), packed);
+			const TValueData& stored = pack ? packed : valueData;
+			const uint16 entryFlags = pack ? KVDB_ENTRY_COMPRESSED : 0;
+
+			if (TKeyRecord* r = dataMap.find(key)) {
+				// pair found 
+				change(key, *r, stored, k_flags, entryFlags);
+			} else {
+				// pair not found  
+				addNew(key, stored, k_flags, entryFlags);
+			}
+		}
+
+		// stored value of key being changed, pending writes of batch go to file first
+		bool readCurrentValue(const TKeyRecord& r, TValueData& dst) {
+			if (writeBuffer && (writeBuffer->appendData.size() > 0 || writeBuffer->patches.size() > 0)) {
+				flushWriteBuffer();
+				filePtr->flush();
+				beginWriteBuffer();
+			}
+			return readValueData(r, dst);
+		}
+
+		// called under exclusive lock. Bytes within capacity of raw value are written in place,
+		// key entry is written only if value grows. Otherwise value is read, patched and saved.
+		// Append goes to end of value, creates missing key and moves outgrown value to extent
+		// with room to grow.
+		bool updatePair(const byte* key, ulong64 offset, const TValueData& bytes, bool append = false) {
+			TKeyRecord* r = dataMap.find(key);
+			if (r == nullptr) {
+				if (!append) return false;
+				if (bytes.size() > 0) savePair(key, bytes, 0);
+				return true;
+			}
+
+			// copy, r is not used after calls that can erase from key map
+			const TKeyRecord current = *r;
+			const ulong64 dataPos = current.dataPos;
+			const ulong64 dataLength = current.dataLength;
+			const bool compressed = (current.entryFlags & KVDB_ENTRY_COMPRESSED) != 0;
+			if (append && !compressed) offset = dataLength;
+			const ulong64 end = offset + bytes.size();
+			if (!compressed && offset > dataLength) return false;
+			if (bytes.size() == 0) return true;
+
+			valueCache.invalidate(key);
+
+			const bool misaligned = alignedValue(end) && dataPos % valueAlignment != 0;
+			if (!compressed && end <= current.capacity && !snapshotPins->any() && !misaligned) {
+				writeAt(dataPos + offset, bytes.data(), bytes.size());
+				counters.inc(counters.partialUpdates);
+				if (end > dataLength) {
+					r->dataLength = end;
+					writeKeyEntry(*r, key);
+				}
+				return true;
+			}
+
+			TValueData valueData;
+			if (!readCurrentValue(current, valueData)) return false;
+			if (append) offset = valueData.size();
+			if (offset > valueData.size()) return false;
+			valueData.resize(std::max<ulong64>(valueData.size(), offset + bytes.size()));
+			std::memcpy(valueData.data() + offset, bytes.data(), bytes.size());
+
+			const ulong64 flags = current.flags;
+			if (append && !compression) {
+				// raw value, so it can grow in place next time
+				counters.inc(counters.relocations);
+				earsePair(key);
+				addNew(key, valueData, flags, 0, (ulong64)(valueData.size() * appendGrowth));
+			} else {
+				savePair(key, valueData, flags);
+			}
+			return true;
+		}
+
+		bool updateKey(const byte* key, ulong64 offset, const TValueData& bytes, bool append = false) {
+			if (!isOpen()) return false;
+			TStatsCounters::TTimer timer(counters, counters.save);
+
+			if (walEnabled) {
+				if (!append) {
+					std::shared_lock<std::shared_mutex> lock(fileSharedMutex);
+					if (dataMap.find(key) == nullptr) return false;
+				}
+				TWriteBatch batch;
+				if (append) {
+					batch.append(TKeyData(key, key + keySize), bytes);
+				} else {
+					batch.update(TKeyData(key, key + keySize), offset, bytes);
+				}
+				return commitBatch(batch);
+			}
+
+			std::lock_guard<std::shared_mutex> guard(fileSharedMutex);
+			const bool ok = updatePair(key, offset, bytes, append);
+			filePtr->flush();
+			flushTablePagesIfDue();
+			return ok;
+		}
+
+		void eraseKey(const byte* key) {
+			if (!isOpen()) return;
+			TStatsCounters::TTimer timer(counters, counters.erase);
+
+			if (walEnabled) {
+				TWriteBatch batch;
+				batch.erase(TKeyData(key, key + keySize));
+				commitBatch(batch);
+				return;
+			}
+
+			std::lock_guard<std::shared_mutex> guard(fileSharedMutex);
+
+			if (dataMap.find(key)) {
+				earsePair(key);
+				filePtr->flush();
+				flushTablePagesIfDue();
+			}
+		}
+
+		void saveKey(const byte* key, const TValueData& valueData, const ulong64 k_flags) {
+			if (!isOpen()) return;
+			TStatsCounters::TTimer timer(counters, counters.save);
+
+			if (walEnabled) {
+				TWriteBatch batch;
+				batch.put(TKeyData(key, key + keySize), valueData, k_flags);
+				commitBatch(batch);
+				return;
+			}
+
+			std::lock_guard<std::shared_mutex> guard(fileSharedMutex);
+			savePair(key, valueData, k_flags);
+			filePtr->flush(); // make written data visible to mapped readers
+			flushTablePagesIfDue();
+		}
+
+	public:
+
+		KvRawFile() { }
+
+		explicit KvRawFile(uint32 s) : expandDataTo(s) { }
+
+		~KvRawFile() {
+			close();
+		}
+
+		void close() {
+			if (!isOpen()) return;
+			{
+				std::lock_guard<std::shared_mutex> guard(fileSharedMutex);
+				session++;
+			}
+			stopAsync();
+			if (walEnabled && wal.isOpen()) stopWal();
+			releaseHeldFrees();
+			applyDeferredFrees(true);
+			snapshotPins = std::make_shared<TSnapshotPins>(); // live snapshots do not hold next session
+			flushTablePages();
+			if (snapshotOnClose && (!indexLoaded || indexStamp == 0)) writeIndexSnapshot();
+			snapshotOnClose = false;
+			indexLoaded = false;
+			indexStamp = 0;
+			filePtr->close();
+#ifdef KVDB_POSIX_IO
+			mapping = nullptr;
+			if (readFd >= 0) ::close(readFd);
+			if (directFd >= 0) ::close(directFd);
+#endif
+			readFd = -1;
+			directFd = -1;
+			dataMap.clear();
+			orderedIndex.clear();
+			valueCache.setKeySize(keySize);
+			reservedKeyList.clear();
+			freeSpace.clear();
+			compactQueue.clear();
+			tableList.clear();
+		}
+
+		bool isOpen() const {
+			return filePtr && filePtr->is_open();
+		}
+
+		int open(const std::string& file) {
+			filePtr = new std::fstream(file, std::ios::in | std::ios::out | std::ios::binary);
+
+			if (!isOpen()) return KVDB_ERROR_OPEN_FILE;
+
+			filePath = file;
+
+#ifdef KVDB_POSIX_IO
+			readFd = ::open(file.c_str(), O_RDONLY);
+#ifdef O_DIRECT
+			if (directIo) directFd = ::open(file.c_str(), O_RDWR | O_DIRECT);
+#endif
+#endif
+
+			TFileHeader fileHeader;
+			filePtr >> fileHeader;
+
+			if(fileHeader.version != KVDB_FILE_VERSION){
+				close();
+				return KVDB_ERROR_INCORRECT_FILE_VERSION;
+			}
+
+			if (keySize == 0) keySize = fileHeader.keySize;
+			dataMap.setKeySize(keySize);
+			valueCache.setKeySize(keySize);
+
+			indexStamp = fileHeader.timestamp;
+			indexLoaded = indexSnapshot && readIndexSnapshot(indexStamp);
+
+			directoryPos = fileHeader.tableDirectory;
+			directoryLoaded = false;
+
+			if (!indexLoaded) {
+				// stale snapshot, read tables listed by directory, or follow table links
+				auto reset = [this]() {
+					tableList.clear();
+					dataMap.clear();
+					freeSpace.clear();
+					reservedKeyList.clear();
+				};
+
+				reset();
+				directoryLoaded = readTableDirectory(directoryPos);
+				if (!directoryLoaded) {
+					reset();
+					if (!scanTables(sizeof(TFileHeader))) {
+						close();
+						return KVDB_ERROR_OPEN_FILE;
+					}
+				}
+			}
+			checkTableDirectory();
+			counters.reset(); // reads of key tables are not counted
+
+			buildOrderedIndex();
+			if (walEnabled) startWal();
+
+			snapshotOnClose = indexSnapshot;
+			return KVDB_OK;
+		}
+
+		size_t size() const {
+			if (!isOpen()) {
+				return 0;
+			} else {
+				return dataMap.size();
+			}
+		}
+
+		bool isExist(const TKeyData& kd) const {
+			return (kd.size() == keySize) && isExistKey(kd.data());
+		}
+
+		ulong64 k_flags(const TKeyData& kd) const {
+			return (kd.size() == keySize) ? flagsOf(kd.data()) : 0;
+		}
+
+		TValueDataPtr loadData(const TKeyData& kd) const {
+			return (kd.size() == keySize) ? loadKey(kd.data()) : nullptr;
+		}
+
+		// Point-in-time view of keys and values. Reads do not block writers: while any snapshot
+		// is alive values are not rewritten in place and freed extents are not reused.
+		// Snapshot ends with close(): its loads return nullptr, also after file is opened again.
+		// Loads must not run concurrently with close() itself.
+		class TSnapshot {
+
+		public:
+			TSnapshot(const KvRawFile* f) : file(f), pins(f->snapshotPins) {
+				std::shared_lock<std::shared_mutex> lock(file->fileSharedMutex);
+				dataMap.copyFrom(file->dataMap);
+				epoch = pins->pin();
+				session = file->session;
+			}
+
+			~TSnapshot() {
+				pins->unpin(epoch);
+			}
+
+			TSnapshot(const TSnapshot&) = delete;
+			TSnapshot& operator=(const TSnapshot&) = delete;
+
+			size_t size() const {
+				return dataMap.size();
+			}
+
+			template <size_t N = 0>
+			bool isExistKey(const byte* key) const {
+				return dataMap.template find<N>(key) != nullptr;
+			}
+
+			template <size_t N = 0>
+			TValueDataPtr loadKey(const byte* key) const {
+				const TKeyRecord* r = dataMap.template find<N>(key);
+				if (r == nullptr || !isCurrent()) return nullptr;
+
+				TValueDataPtr dataPtr = TValueDataPtr(new TValueData);
+				if (file->readFd >= 0) {
+					return file->readValueData(*r, *dataPtr) ? dataPtr : nullptr;
+				}
+
+				// stream is shared with writers
+				std::shared_lock<std::shared_mutex> lock(file->fileSharedMutex);
+				if (!isCurrent()) return nullptr;
+				return file->readValueData(*r, *dataPtr) ? dataPtr : nullptr;
+			}
+
+			TValueDataPtr loadData(const TKeyData& kd) const {
+				return (kd.size() == dataMap.keySize()) ? loadKey(kd.data()) : nullptr;
+			}
+
+			// func(const byte* key)
+			template <typename F>
+			void forEachKey(F func) const {
+				dataMap.forEach([&](const byte* key, const TKeyRecord&) { func(key); });
+			}
+
+		private:
+			// positions are valid only in session snapshot was taken in
+			bool isCurrent() const {
+				return file->session == session && file->isOpen();
+			}
+
+			const KvRawFile* file;
+			std::shared_ptr<TSnapshotPins> pins;
+			TKeyMap<TKeyRecord> dataMap;
+			ulong64 epoch;
+			ulong64 session;
+		};
+
+		// empty if file is not open
+		std::shared_ptr<TSnapshot> snapshot() const {
+			return std::make_shared<TSnapshot>(this);
+		}
+
+		// values in request order, nullptr for missing keys; faster than load() in a loop
+		std::vector<TValueDataPtr> loadMany(const std::vector<TKeyData>& keys) const {
+			std::vector<const byte*> keyPtrs(keys.size());
+			for (size_t i = 0; i < keys.size(); i++) {
+				keyPtrs[i] = (keys[i].size() == keySize) ? keys[i].data() : nullptr;
+			}
+
+			std::vector<TValueDataPtr> values;
+			loadKeys(keyPtrs, values);
+			return values;
+		}
+
+		// enable memory mapped reads for loadView()
+		void enableMmap(bool enable = true) {
+			mmapRead = enable;
+		}
+
+		// Zero-copy read: view points straight into the mapped file if mmap is enabled,
+		// otherwise into a private copy. While a mapped view lives its value is not changed:
+		// writes and compact() move values like with a snapshot, and freed extents wait.
+		// View shows the value as it was when loaded, up to close().
+		TValueView loadView(const TKeyData& kd) const {
+			return (kd.size() == keySize) ? viewKey(kd.data()) : TValueView();
+		}
+
+		void erase(const TKeyData& kd) {
+			if (kd.size() == keySize) eraseKey(kd.data());
 		}
 
 		void save(const TKeyData& kd, const TValueData& valueData, const ulong64 k_flags = 0x0) {
+			if (kd.size() == keySize) saveKey(kd.data(), valueData, k_flags);
+		}
+
+		// Writes bytes at offset of existing value, offset up to value length, value grows if
+		// bytes pass its end. Only bytes are written while they fit in capacity of value, larger
+		// or compressed value and value held by snapshot are rewritten whole. With log on, log
+		// gets only the bytes if they are written in place, otherwise the whole value. False if
+		// key is not found or offset is past end of value, or if log is on and stored value
+		// can't be read.
+		bool update(const TKeyData& kd, ulong64 offset, const TValueData& bytes) {
+			return (kd.size() == keySize) && updateKey(kd.data(), offset, bytes);
+		}
+
+		// Writes bytes after end of value, missing key is created. Value that outgrows its
+		// capacity moves to extent of setAppendGrowth() times its new length, so appends write
+		// about their own bytes on average. Compressed values are rewritten whole. With log on,
+		// log gets only the bytes with offset of value end, so replay does not append twice.
+		// Append that moves the value is logged as whole value, its new extent is not synced.
+		bool append(const TKeyData& kd, const TValueData& bytes) {
+			return (kd.size() == keySize) && updateKey(kd.data(), 0, bytes, true);
+		}
+
+		// capacity of value moved by append() to its length, 1.0 leaves no room
+		void setAppendGrowth(double factor = KVDB_APPEND_GROWTH) {
+			appendGrowth = std::max(1.0, factor);
+		}
+
+		// apply all puts and erases of batch under one lock, the last operation on a key wins. 
+		// New values are appended in one sequential write and key table updates are merged.
+		// With log on, batch whose update can't read length of stored value is dropped whole.
+		void saveBatch(const TWriteBatch& batch) {
+			if (!isOpen() || batch.size() == 0) return;
+			TStatsCounters::TTimer timer(counters, counters.batch);
+
+			if (walEnabled) {
+				commitBatch(batch);
+				return;
+			}
+
+			std::lock_guard<std::shared_mutex> guard(fileSharedMutex);
+			applyBatch(batch);
+			filePtr->flush();
+			flushTablePagesIfDue();
+		}
+
+		// log durability: KVDB_DURABILITY_NONE, KVDB_DURABILITY_PERIODIC or KVDB_DURABILITY_COMMIT.
+		// Call before open(), log is replayed by open() and emptied by close().
+		void enableWal(uint32 mode = KVDB_DURABILITY_COMMIT, uint32 intervalMs = 100) {
+			walEnabled = true;
+			durability = mode;
+			syncIntervalMs = intervalMs;
+		}
+
+		// Key table entries changed by saves are kept in dirty pages in memory and written back
+		// in file order when pages reach maxBytes, when the oldest change is intervalMs old 
+		// (checked by writes) and on close(). Extents freed meanwhile are not reused before
+		// pages are written, with log before next checkpoint, so an entry left on disk by a
+		// crash never points at data of another key. With log a crash loses no more than the
+		// log replays, without log keys can come back with old values. Zero maxBytes writes
+		// entries at once.
+		void enableTableBuffer(size_t maxBytes = KVDB_TABLE_BUFFER_SIZE, uint32 intervalMs = KVDB_TABLE_BUFFER_MS) {
+			std::lock_guard<std::shared_mutex> guard(fileSharedMutex);
+			if (isOpen() && maxBytes == 0) flushTablePages();
+			tableBufferSize = maxBytes;
+			tableBufferMs = intervalMs;
+		}
+
+		// log sync calls so far
+		ulong64 walSyncCount() const {
+			return walSyncs;
+		}
+
+		// Incremental compaction: moves live values from the end of file into free extents 
+		// below them and truncates free space at the end of file. Moves at most maxBytes 
+		// per call, writer lock is taken per value so loads run in between. Moves are not
+		// logged: with log on, each moved value is synced before its key entry points at it.
+		TCompactResult compact(ulong64 maxBytes = ULLONG_MAX) {
+			TCompactResult result;
+			if (!isOpen()) return result;
+
+			std::lock_guard<std::mutex> compactGuard(compactMutex);
+
+			{
+				// extents released by snapshots and views since last write
+				std::lock_guard<std::shared_mutex> guard(fileSharedMutex);
+				applyDeferredFrees();
+			}
+
+			if (compactQueue.empty()) {
+				std::shared_lock<std::shared_mutex> lock(fileSharedMutex);
+				const TFreeExtent* first = freeSpace.first();
+				const ulong64 lowest = first ? first->dataPos : ULLONG_MAX;
+				dataMap.forEach([&](const byte* key, const TKeyRecord& h) {
+					if (h.dataLength > 0 && h.dataPos > lowest) compactQueue.push_back({ (ulong64)h.dataPos, TKeyData(key, key + keySize) });
+				});
+				if (keyOrder) {
+					// values are rewritten in key order, first key at back
+					std::sort(compactQueue.begin(), compactQueue.end(), [&](const auto& a, const auto& b) { 
+						return keyOrder(a.second.data(), keySize) > keyOrder(b.second.data(), keySize); 
+					});
+				} else {
+					// tail first
+					std::sort(compactQueue.begin(), compactQueue.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+				}
+			}
+
+			while (!compactQueue.empty() && result.bytesMoved < maxBytes) {
+				const auto candidate = std::move(compactQueue.back());
+				compactQueue.pop_back();
+
+				std::lock_guard<std::shared_mutex> guard(fileSharedMutex);
+
+				TKeyRecord* found = dataMap.find(candidate.second);
+				if (found == nullptr || found->dataPos != candidate.first) continue; // changed since
+
+				const TFreeExtent* first = freeSpace.first();
+				if (first == nullptr) {
+					compactQueue.clear(); // no holes
+					break;
+				}
+
+				if (first->dataPos > candidate.first) {
+					if (keyOrder) continue;
+					compactQueue.clear(); // no holes below
+					break;
+				}
+
+				if (relocateValue(candidate.second.data(), *found, result.bytesMoved)) {
+					result.valuesMoved++;
+				}
+
+				if (canTruncate()) result.bytesReclaimed += truncateTail();
+				flushTablePages(); // moves are not logged, old extent may be reused right after
+				filePtr->flush();
+			}
+
+			{
+				std::lock_guard<std::shared_mutex> guard(fileSharedMutex);
+				if (walEnabled) syncTable(); // with log old extents are held until table is synced
+				if (canTruncate()) result.bytesReclaimed += truncateTail();
+				filePtr->flush();
+			}
+
+			result.done = compactQueue.empty();
+			return result;
+		}
+
+		// Count I/O, allocator events and operation latency, off by default.
+		// Counters are cleared by open() and resetStats().
+		void enableStats(bool enable = true) {
+			counters.enabled = enable;
+		}
+
+		// I/O and allocator counters and latency histograms since open() or resetStats(),
+		// zero unless enableStats() is on. Counters are read without locks, free space totals take shared lock.
+		TFileStats stats() const {
+			TFileStats s;
+			counters.copyTo(s);
+			if (!isOpen()) return s;
+
+			std::shared_lock<std::shared_mutex> lock(fileSharedMutex);
+			std::error_code ec;
+			s.fileBytes = std::filesystem::file_size(filePath, ec);
+			s.freeBytes = freeSpace.bytes();
+			s.freeExtents = freeSpace.size();
+			s.largestFree = freeSpace.largest();
+			for (const auto& d : deferredFrees) {
+				s.freeBytes += d.extent.length;
+				s.freeExtents++;
+				s.largestFree = std::max(s.largestFree, d.extent.length);
+			}
+			s.deadRatio = s.fileBytes ? (double)s.freeBytes / s.fileBytes : 0;
+			s.fragmentation = s.freeBytes ? 1.0 - (double)s.largestFree / s.freeBytes : 0;
+			return s;
+		}
+
+		void resetStats() {
+			counters.reset();
+		}
+
+		// Worker threads for loadAsync() when io_uring is not used, zero for hardware concurrency.
+		// Call before first asynchronous operation.
+		void enableAsync(uint32 threads = 0, bool useUring = true) {
+			std::lock_guard<std::mutex> guard(asyncMutex);
+			asyncThreads = threads;
+			asyncUring = useUring;
+		}
+
+		// loads are queued to io_uring
+		bool isUringActive() {
+			std::lock_guard<std::mutex> guard(asyncMutex);
+#ifdef KVDB_IO_URING
+			return uring != nullptr;
+#else
+			return false;
+#endif
+		}
+
+		// value or nullptr, wait with get() or co_await. Coroutine resumes on io thread.
+		TAsync<TValueDataPtr> loadAsync(const TKeyData& kd) {
+			TAsync<TValueDataPtr> result;
+			if (kd.size() != keySize) {
+				result.set(nullptr);
+			} else {
+				loadWith(kd.data(), [result](TValueDataPtr value) { result.set(value); });
+			}
+			return result;
+		}
+
+		// saves are applied in call order by one background writer, result is KVDB_OK when done
+		TAsync<int> saveAsync(const TKeyData& kd, const TValueData& valueData, const ulong64 k_flags = 0x0) {
+			TAsync<int> result;
+			if (kd.size() != keySize) {
+				result.set(KVDB_OK);
+			} else {
+				saveWith(kd.data(), valueData, k_flags, [result]() { result.set(KVDB_OK); });
+			}
+			return result;
+		}
+
+		// placement order of values written by batches and compaction, for example mortonKeyOrder.
+		// Null (default) keeps write order and compaction moves values from end of file first.
+		void setKeyOrder(TKeyOrderFunc order) {
+			std::lock_guard<std::mutex> compactGuard(compactMutex);
+			std::lock_guard<std::shared_mutex> guard(fileSharedMutex);
+			keyOrder = order;
+			compactQueue.clear();
+			if (isOpen()) buildOrderedIndex();
+		}
+
+		// keep keys sorted in key order for range scans, see setKeyOrder()
+		void enableOrderedIndex(bool enable = true) {
+			std::lock_guard<std::shared_mutex> guard(fileSharedMutex);
+			orderedIndexEnabled = enable;
+			if (isOpen()) buildOrderedIndex();
+		}
+
+		// keep up to maxBytes of recently read values in memory, zero disables cache.
+		// Loaded buffers are shared with the cache and must not be modified by caller.
+		void enableCache(size_t maxBytes) {
+			valueCache.setCapacity(maxBytes);
+		}
+
+		TCacheStats cacheStats() const {
+			return valueCache.stats();
+		}
+
+		void resetCacheStats() {
+			valueCache.resetStats();
+		}
+
+		// compress values written from now on, values written before are read either way
+		void enableCompression(bool enable = true) {
+			std::lock_guard<std::shared_mutex> guard(fileSharedMutex);
+			compression = enable;
+		}
+
+		// write index snapshot on close and load it on open, off by default
+		void enableIndexSnapshot(bool enable = true) {
+			indexSnapshot = enable;
+		}
+
+		// open used index snapshot instead of table scan
+		bool isIndexLoaded() const {
+			return indexLoaded;
+		}
+
+		// Values of blockSize bytes or larger start at a multiple of blockSize and take whole
+		// blocks, so reading one touches no page of other data. Padding before aligned values 
+		// is not reused. Zero turns alignment off. Call before open().
+		void setValueAlignment(ulong64 blockSize = KVDB_VALUE_ALIGNMENT) {
+			valueAlignment = blockSize;
+		}
+
+		// Aligned values are read and written with O_DIRECT past the kernel page cache, so value
+		// cache decides which of them stay in memory. Batches, async loads, multi-get and views
+		// still use buffered I/O. Turns on value alignment if it is off, block size must suit
+		// the device, power of two from 4096 does. Call before open().
+		void enableDirectIo(bool enable = true) {
+			directIo = enable;
+			if (enable && valueAlignment == 0) valueAlignment = KVDB_VALUE_ALIGNMENT;
+		}
+
+		// false if direct I/O is off or file system refused it
+		bool isDirectIoActive() const {
+			return directFd >= 0;
+		}
+
+		// true if last open() found key tables by table directory
+		bool isTableDirectoryLoaded() const {
+			return directoryLoaded;
+		}
+
+		// Entries of first key table added by saves, each next one is factor times larger
+		// up to maxSize entries. Call before open().
+		void setTableGrowth(ulong64 firstSize = KVDB_RESERVED_TABLE_SIZE, double factor = KVDB_TABLE_GROWTH, ulong64 maxSize = KVDB_MAX_TABLE_SIZE) {
+			reservedKeys = std::max<ulong64>(1, firstSize);
+			tableGrowth = std::max(1.0, factor);
+			maxTableSize = std::max<ulong64>(1, maxSize);
+		}
+
+		size_t tableCount() const {
+			std::shared_lock<std::shared_mutex> lock(fileSharedMutex);
+			return tableList.size();
+		}
+
+		// approximate heap bytes held by in-memory index: key map, ordered index, free space and slot lists
+		size_t memoryUsage() const {
+			std::shared_lock<std::shared_mutex> lock(fileSharedMutex);
+			const size_t treeNode = 4 * sizeof(void*); // color, parent and children
+			return dataMap.memoryUsage() + orderedIndex.memoryUsage()
+				+ freeSpace.size() * (2 * treeNode + sizeof(ulong64) + sizeof(TFreeExtent) + 2 * sizeof(ulong64))
+				+ reservedKeyList.size() * sizeof(ulong64)
+				+ tableList.size() * (2 * sizeof(void*) + sizeof(TTableHeaderInfo))
+				+ tablePages.bytes();
+		}
+
+		// bytes held by free extents
+		ulong64 deadBytes() const {
+			std::shared_lock<std::shared_mutex> lock(fileSharedMutex);
+			return freeSpace.bytes();
+		}
+
+		// ====================================================================================
+		
+		size_t reserved() const {
+			return reservedKeyList.size();
+		}		
+		
+		size_t deleted() const {
+			return freeSpace.size();
+		}	
+	};
+
+
+	template <typename K, typename V>
+	class KvFile : public KvRawFile{
+
+	private:
+
+		std::shared_ptr<V> valueFromData(TValueDataPtr dataPtr) const {
+			if (dataPtr == nullptr) return nullptr;
+
+			if constexpr (std::is_same<V, TValueData>::value) { //constexpr
+				return std::static_pointer_cast<TValueData>(dataPtr);
+			} else {
+				V* temp = new V();
+				std::memcpy(temp, dataPtr->data(), sizeof(V));
+				return std::shared_ptr<V>(temp);
+			}
+		}
+
+		static TKeyData toKeyData(K key) {
+			TKeyData kd(sizeof(K));
+			std::fill(kd.begin(), kd.end(), 0);
+			std::memcpy(kd.data(), &key, sizeof(K));
+			return kd;
+		}
+
+		static K keyFromKeyData(const TKeyData& kd) {
+			return keyFromBytes(kd.data());
+		}
+
+		static K keyFromBytes(const byte* data) {
+			K key;
+			std::memcpy((void*)&key, data, sizeof(K));
+			return key;
+		}
+
+		static const byte* keyBytes(const K& k) {
+			return reinterpret_cast<const byte*>(&k);
+		}
+
+		static void toValueData(V value, TValueData& valueData) {
+			if (valueData.size() < sizeof(value)) valueData.resize(sizeof(value));
+			std::memcpy(valueData.data(), &value, sizeof(value));
+		}
+
+		static TValueData valueToData(const V& v) {
+			TValueData valueData;
+
+			if constexpr(std::is_same<V, TValueData>::value) {
+				valueData = static_cast<TValueData>(v);
+			} else {
+				toValueData(v, valueData);
+			}
+
+			return valueData;
+		}
+
+	public:
+
+		KvFile() : KvRawFile () {
+			keySize = sizeof(K);
+		}
+
+		explicit KvFile(uint32 s) : KvRawFile(s) {
+			keySize = sizeof(K);
+		}
+
+		bool isExist(const K& k) const {
+			return isExistKey<sizeof(K)>(keyBytes(k));
+		}
+		
+		void forEachKey(std::function<void(K key)> func) const {
+			if (!isOpen()) return;
+			std::shared_lock<std::shared_mutex> lock(fileSharedMutex);
+			dataMap.forEach([&](const byte* key, const TKeyRecord&) { func(keyFromBytes(key)); });
+		}
+
+		ulong64 k_flags(const K& k) const {
+			return flagsOf<sizeof(K)>(keyBytes(k));
+		}
+
+		// keys from lo to hi inclusive, fetched in batches of KVDB_RANGE_BATCH under shared lock
+		class TKeyRange {
+
+		public:
+			class iterator {
+
+			public:
+				typedef std::input_iterator_tag iterator_category;
+				typedef K value_type;
+				typedef std::ptrdiff_t difference_type;
+				typedef const K* pointer;
+				typedef const K& reference;
+
+				iterator() { }
+
+				iterator(const KvFile* f, const K& lo, const K& h) : file(f), hi(h) {
+					fetch(keyBytes(lo), false);
+				}
+
+				reference operator*() const { return current; }
+				pointer operator->() const { return &current; }
+
+				iterator& operator++() {
+					if (++pos * sizeof(K) < keys.size()) {
+						current = keyFromBytes(keys.data() + pos * sizeof(K));
+					} else {
+						const K last = current;
+						fetch(keyBytes(last), true);
+					}
+					return *this;
+				}
+
+				bool operator==(const iterator& other) const {
+					return file == other.file && (file == nullptr || std::memcmp(&current, &other.current, sizeof(K)) == 0);
+				}
+
+				bool operator!=(const iterator& other) const {
+					return !(*this == other);
+				}
+
+			private:
+				const KvFile* file = nullptr; // null at end
+				K hi;
+				K current;
+				std::vector<byte> keys;
+				size_t pos = 0;
+
+				void fetch(const byte* from, bool exclusive) {
+					keys.clear();
+					pos = 0;
+					file->fetchRange(from, exclusive, keyBytes(hi), KVDB_RANGE_BATCH, keys);
+					if (keys.empty()) {
+						file = nullptr;
+					} else {
+						current = keyFromBytes(keys.data());
+					}
+				}
+			};
+
+			TKeyRange(const KvFile* f, const K& l, const K& h) : file(f), lo(l), hi(h) { }
+
+			iterator begin() const { return iterator(file, lo, hi); }
+			iterator end() const { return iterator(); }
+
+		private:
+			const KvFile* file;
+			K lo;
+			K hi;
+		};
+
+		// Keys from lo to hi in key order (see setKeyOrder), with mortonKeyOrder aligned cubes
+		// of 3D keys are continuous ranges. Writer lock is not held between batches, so keys written during 
+		// scan may or may not be seen. Fast with enableOrderedIndex(), otherwise every batch visits all keys.
+		TKeyRange range(const K& lo, const K& hi) const {
+			return TKeyRange(this, lo, hi);
+		}
+
+		TValueDataPtr loadData(const K& k) const {
+			return loadKey<sizeof(K)>(keyBytes(k));
+		}
+
+		std::shared_ptr<V> load(const K& k) const {
+			return valueFromData(loadData(k));
+		}
+
+		TValueView loadView(const K& k) const {
+			return viewKey<sizeof(K)>(keyBytes(k));
+		}
+
+		// typed point-in-time view, see KvRawFile::TSnapshot
+		class TSnapshot {
+
+		public:
+			TSnapshot(const KvFile* f, std::shared_ptr<KvRawFile::TSnapshot> s) : file(f), raw(s) { }
+
+			size_t size() const {
+				return raw->size();
+			}
+
+			bool isExist(const K& k) const {
+				return raw->template isExistKey<sizeof(K)>(keyBytes(k));
+			}
+
+			TValueDataPtr loadData(const K& k) const {
+				return raw->template loadKey<sizeof(K)>(keyBytes(k));
+			}
+
+			std::shared_ptr<V> load(const K& k) const {
+				return file->valueFromData(loadData(k));
+			}
+
+			void forEachKey(std::function<void(K key)> func) const {
+				raw->forEachKey([&](const byte* key) { func(keyFromBytes(key)); });
+			}
+
+		private:
+			const KvFile* file;
+			std::shared_ptr<KvRawFile::TSnapshot> raw;
+		};
+
+		// reads and scans of snapshot run concurrently with writers
+		TSnapshot snapshot() const {
+			return TSnapshot(this, KvRawFile::snapshot());
+		}
+
+		// values in request order, nullptr for missing keys; faster than load() in a loop
+		std::vector<std::shared_ptr<V>> loadMany(const std::vector<K>& keys) const {
+			std::vector<const byte*> keyPtrs(keys.size());
+			for (size_t i = 0; i < keys.size(); i++) keyPtrs[i] = keyBytes(keys[i]);
+
+			std::vector<TValueDataPtr> values;
+			loadKeys<sizeof(K)>(keyPtrs, values);
+
+			std::vector<std::shared_ptr<V>> result(values.size());
+			for (size_t i = 0; i < values.size(); i++) result[i] = valueFromData(values[i]);
+			return result;
+		}
+
+		// values read straight into out[0..keys.size()), result tells which keys were found
+		std::vector<bool> loadMany(const std::vector<K>& keys, V* out) const {
+			static_assert(std::is_trivially_copyable<V>::value, "value type must be trivially copyable");
+
+			std::vector<const byte*> keyPtrs(keys.size());
+			for (size_t i = 0; i < keys.size(); i++) keyPtrs[i] = keyBytes(keys[i]);
+
+			std::vector<TValueDataPtr> values;
+			std::vector<bool> found;
+			loadKeys<sizeof(K)>(keyPtrs, values, (byte*)out, sizeof(V), &found);
+			return found;
+		}
+
+		// value or nullptr, wait with get() or co_await. Coroutine resumes on io thread.
+		TAsync<std::shared_ptr<V>> loadAsync(const K& k) {
+			TAsync<std::shared_ptr<V>> result;
+			loadWith<sizeof(K)>(keyBytes(k), [this, result](TValueDataPtr value) { result.set(valueFromData(value)); });
+			return result;
+		}
+
+		// saves are applied in call order by one background writer, result is KVDB_OK when done
+		TAsync<int> saveAsync(const K& k, const V& v, const ulong64 k_flags = 0x0) {
+			TAsync<int> result;
+			saveWith(keyBytes(k), valueToData(v), k_flags, [result]() { result.set(KVDB_OK); });
+			return result;
+		}
+
+		// const V& view of the stored value, without copy when mapped and aligned
+		TValueRef<V> loadRef(const K& k) const {
+			return TValueRef<V>(loadView(k));
+		}
+
+		std::shared_ptr<V> operator[] (const K& k) {
+			return valueFromData(loadData(k));
+		}
+
+		void erase(const K& k) {
+			eraseKey(keyBytes(k));
+		}
+
+		void save(const K& k, const V& v, const ulong64 k_flags = 0x0) {
+			if (!isOpen()) return;
+			saveKey(keyBytes(k), valueToData(v), k_flags);
+		}
+
+		// bytes at offset of stored value, see KvRawFile::update()
+		bool update(const K& k, ulong64 offset, const TValueData& bytes) {
+			return updateKey(keyBytes(k), offset, bytes);
+		}
+
+		// bytes after end of stored value, see KvRawFile::append()
+		bool append(const K& k, const TValueData& bytes) {
+			return updateKey(keyBytes(k), 0, bytes, true);
+		}
+
+		// typed batch for saveBatch()
+		class TBatch : public TWriteBatch {
+
+		public:
+			void put(const K& k, const V& v, const ulong64 k_flags = 0x0) {
+				TWriteBatch::put(toKeyData(k), valueToData(v), k_flags);
+			}
+
+			void update(const K& k, ulong64 offset, const TValueData& bytes) {
+				TWriteBatch::update(toKeyData(k), offset, bytes);
+			}
+
+			void append(const K& k, const TValueData& bytes) {
+				TWriteBatch::append(toKeyData(k), bytes);
+			}
+
+			void erase(const K& k) {
+				TWriteBatch::erase(toKeyData(k));
+			}
+		};
+
+		// values are laid out in order of keys if order is given, see setKeyOrder()
+		static bool create(const std::string& file, const std::unordered_map<K, V>& test, ulong64 max_key_records = KVDB_RESERVED_TABLE_SIZE, TKeyOrderFunc order = nullptr) {
+			std::ofstream outFile(file, std::ios::out | std::ios::binary);
+			if (!outFile) return false;
+			std::ofstream* outFilePtr = &outFile;
+
+			const ulong64 keyRecords = (test.size() > max_key_records) ? test.size() : max_key_records;
+
+			// save file header
+			TFileHeader fileHeader{ .keySize = sizeof(K) };
+			outFilePtr << fileHeader;
+
+			TTableHeader tableHeader{keyRecords, 0};
+			outFilePtr << tableHeader;
+
+			ulong64 bodyDataOffset = (ulong64)(outFile.tellp()) + (sizeof(TKeyEntryHeader) + sizeof(K)) * keyRecords;
+			std::vector<const std::pair<const K, V>*> pairs;
+			pairs.reserve(test.size());
+			for (auto& e : test) pairs.push_back(&e);
+
+			if (order) {
+				std::stable_sort(pairs.begin(), pairs.end(), [&](const auto* a, const auto* b) { 
+					return order(keyBytes(a->first), sizeof(K)) < order(keyBytes(b->first), sizeof(K)); 
+				});
+			}
+
+			std::vector<byte> dataBody;
+			for (const auto* p : pairs) {
+				const auto& e = *p;
+				TKeyEntry entry{ .header = TKeyEntryHeader{ .dataPos = dataBody.size() + bodyDataOffset }, .freeKeyData = toKeyData(e.first) };
+				TValueData valueData;
+				if constexpr (std::is_same<V, TValueData>::value) {
+					valueData = static_cast<TValueData>(e.second);
+				} else {
+					toValueData(e.second, valueData);
+				}
+
+				entry.header.dataLength = valueData.size();
+				entry.header.initialDataLength = valueData.size();
+				dataBody.insert(std::end(dataBody), std::begin(valueData), std::end(valueData));
+				outFilePtr << entry;
+			}
+
+			if (test.size() < max_key_records) {
+				// add empty records, zeroed entries in one write
+				const ulong64 emptyRecords = max_key_records - test.size();
+				const std::vector<byte> empty((sizeof(TKeyEntryHeader) + sizeof(K)) * emptyRecords, 0);
+				outFilePtr->write((char*)empty.data(), empty.size());
+			}
+
+			outFilePtr->write((char*)dataBody.data(), dataBody.size());
+			outFile.close();
+			return true;
+		}
+
+		static bool create_empty(const std::string& file, ulong64 max_key_records = KVDB_RESERVED_TABLE_SIZE) {
+			std::ofstream outFile(file, std::ios::out | std::ios::binary);
+			if (!outFile) return false;
+			std::ofstream* outFilePtr = &outFile;
+
+			// save file header
+			TFileHeader fileHeader{ .keySize = sizeof(K) };
+			outFilePtr << fileHeader;
+
+			TTableHeader tableHeader{0, 0};
+			outFilePtr << tableHeader;
+
+			// add empty records
+			const std::vector<byte> empty((sizeof(TKeyEntryHeader) + sizeof(K)) * max_key_records, 0);
+			outFilePtr->write((char*)empty.data(), empty.size());
+
+			outFile.close();
+			return true;
+		}
+
+		// ====================================================================================
+		
+		void info(std::vector<TKeyEntry>& active, std::vector<TKeyEntry>& reserve, std::vector<TKeyEntry>& deleted) {
 			if (!isOpen()) return;
-			std::lock_guard<std::mutex> guard(fileSharedMutex);
+			std::shared_lock<std::shared_mutex> lock(fileSharedMutex);
+			
+			active.clear();
+			active.reserve(dataMap.size());
+			dataMap.forEach([&](const byte* key, const TKeyRecord& r){ active.push_back(TKeyEntry{ headerOf(r), TKeyData(key, key + keySize) }); });
+
+			reserve.clear();
+			reserve.resize(reservedKeyList.size(), TKeyEntry{ TKeyEntryHeader(), TKeyData(keySize, 0) });
+            
+			deleted.clear();
+			deleted.reserve(freeSpace.size());
+			std::for_each(freeSpace.extents().cbegin(), freeSpace.extents().cend(), [&](const auto& p){
+				TKeyEntry e;
+				e.header.dataPos = p.second.dataPos;
+				e.header.initialDataLength = p.second.length;
+				deleted.push_back(e);
+			});
+		}
+		// ====================================================================================
+
+	};
+	//-----------------------------------------------------------------------------
+
+	//============================================================================
+	// Sharded file
+	// keys are spread over N independent files, each with own lock, key tables and append point
+	//============================================================================
+	typedef uint32 (*TShardFunc)(const byte* key, size_t size, uint32 shards);
+
+	// remixed hash, so keys of a shard still spread over slot and tag bits of its key maps
+	inline uint32 hashShard(const byte* key, size_t size, uint32 shards) {
+		ulong64 h = hashKey(key, size);
+		h = (h ^ (h >> 33)) * 0xff51afd7ed558ccdULL;
+		h ^= h >> 33;
+		return (uint32)(((h >> 32) * shards) >> 32);
+	}
+
+	#pragma pack(push,1)
+	typedef struct TShardHeader {
+		char h[4] = {'K', 'V', 'D', 'S'};
+		uint32 version = KVDB_SHARD_VERSION;
+		uint32 keySize = 0;
+		uint32 shardCount = 0;
+	} TShardHeader;
+	#pragma pack(pop)
+
+	// blocks of 8x8x8 keys stay in one shard, so range scans and multi-gets touch few shards
+	inline uint32 mortonShard(const byte* key, size_t size, uint32 shards) {
+		if (size != 3 * sizeof(int32_t)) return hashShard(key, size, shards);
+		const ulong64 block = mortonKeyOrder(key, size) >> 9;
+		return hashShard((const byte*)&block, sizeof(block), shards);
+	}
+
+	template <typename K, typename V>
+	class KvShardedFile {
+
+	public:
+		typedef KvFile<K, V> TShard;
+		typedef typename TShard::TBatch TBatch;
+
+	private:
+		std::vector<std::unique_ptr<TShard>> shards;
+		TShardFunc shardFunc;
+		std::once_flag poolOnce;
+		std::unique_ptr<TThreadPool> pool; // applies batch parts, started by first saveBatch()
+
+		static const byte* keyBytes(const K& k) {
+			return reinterpret_cast<const byte*>(&k);
+		}
+
+		uint32 indexOf(const byte* key) const {
+			return shardFunc(key, sizeof(K), (uint32)shards.size());
+		}
+
+		TShard& shardOf(const K& k) const {
+			return *shards[indexOf(keyBytes(k))];
+		}
+
+	public:
+		// shard function must stay the same for life of the files
+		explicit KvShardedFile(uint32 shardCount, TShardFunc f = hashShard) : shardFunc(f) {
+			for (uint32 i = 0; i < std::max(1u, shardCount); i++) shards.emplace_back(new TShard());
+		}
+
+		static std::string shardPath(const std::string& file, uint32 index) {
+			return file + "." + std::to_string(index);
+		}
+
+		// shard count written by create(), zero if file is missing or not valid
+		static uint32 storedShardCount(const std::string& file) {
+			std::ifstream in(file + KVDB_SHARD_FILE_EXT, std::ios::in | std::ios::binary);
+			TShardHeader h;
+			in.read((char*)&h, sizeof(h));
+			if (!in || std::memcmp(h.h, TShardHeader().h, 4) != 0 || h.version != KVDB_SHARD_VERSION || h.keySize != sizeof(K)) return 0;
+			return h.shardCount;
+		}
+
+		// files file.0 ... file.N-1 and file.shards with their count, key tables of
+		// max_key_records are split between them
+		static bool create(const std::string& file, uint32 shardCount, const std::unordered_map<K, V>& data, ulong64 max_key_records = KVDB_RESERVED_TABLE_SIZE, TShardFunc f = hashShard) {
+			shardCount = std::max(1u, shardCount);
+			std::vector<std::unordered_map<K, V>> parts(shardCount);
+			for (const auto& e : data) {
+				parts[f(keyBytes(e.first), sizeof(K), shardCount)].insert(e);
+			}
+
+			for (uint32 i = 0; i < shardCount; i++) {
+				if (!TShard::create(shardPath(file, i), parts[i], (max_key_records + shardCount - 1) / shardCount)) return false;
+			}
+
+			std::ofstream out(file + KVDB_SHARD_FILE_EXT, std::ios::out | std::ios::binary | std::ios::trunc);
+			TShardHeader h;
+			h.keySize = sizeof(K);
+			h.shardCount = shardCount;
+			out.write((const char*)&h, sizeof(h));
+			return (bool)out;
+		}
+
+		// configure shards before open: enableWal(), enableCache() etc.
+		TShard& shard(uint32 index) {
+			return *shards[index];
+		}
+
+		uint32 shardCount() const {
+			return (uint32)shards.size();
+		}
+
+		// fails with KVDB_ERROR_SHARD_COUNT if files were created with other shard count
+		int open(const std::string& file) {
+			const uint32 stored = storedShardCount(file);
+			if (stored == 0) return KVDB_ERROR_OPEN_FILE;
+			if (stored != shards.size()) return KVDB_ERROR_SHARD_COUNT;
+
+			for (uint32 i = 0; i < shards.size(); i++) {
+				const int res = shards[i]->open(shardPath(file, i));
+				if (res != KVDB_OK) {
+					close();
+					return res;
+				}
+			}
+			return KVDB_OK;
+		}
+
+		void close() {
+			for (auto& s : shards) s->close();
+		}
+
+		bool isOpen() const {
+			return shards[0]->isOpen();
+		}
+
+		size_t size() const {
+			size_t n = 0;
+			for (const auto& s : shards) n += s->size();
+			return n;
+		}
+
+		bool isExist(const K& k) const {
+			return shardOf(k).isExist(k);
+		}
+
+		ulong64 k_flags(const K& k) const {
+			return shardOf(k).k_flags(k);
+		}
+
+		TValueDataPtr loadData(const K& k) const {
+			return shardOf(k).loadData(k);
+		}
+
+		std::shared_ptr<V> load(const K& k) const {
+			return shardOf(k).load(k);
+		}
+
+		// one multi-get per shard, values in request order
+		std::vector<std::shared_ptr<V>> loadMany(const std::vector<K>& keys) const {
+			std::vector<std::vector<K>> parts(shards.size());
+			std::vector<std::vector<size_t>> positions(shards.size());
+			for (size_t i = 0; i < keys.size(); i++) {
+				const uint32 s = indexOf(keyBytes(keys[i]));
+				parts[s].push_back(keys[i]);
+				positions[s].push_back(i);
+			}
+
+			std::vector<std::shared_ptr<V>> result(keys.size());
+			for (size_t s = 0; s < shards.size(); s++) {
+				if (parts[s].empty()) continue;
+				auto values = shards[s]->loadMany(parts[s]);
+				for (size_t i = 0; i < values.size(); i++) result[positions[s][i]] = std::move(values[i]);
+			}
+			return result;
+		}
+
+		void save(const K& k, const V& v, const ulong64 k_flags = 0x0) {
+			shardOf(k).save(k, v, k_flags);
+		}
+
+		bool update(const K& k, ulong64 offset, const TValueData& bytes) {
+			return shardOf(k).update(k, offset, bytes);
+		}
+
+		bool append(const K& k, const TValueData& bytes) {
+			return shardOf(k).append(k, bytes);
+		}
+
+		void erase(const K& k) {
+			shardOf(k).erase(k);
+		}
+
+		void forEachKey(std::function<void(K key)> func) const {
+			for (const auto& s : shards) s->forEachKey(func);
+		}
+
+		// Batch is split by shard and parts are applied in parallel. Every part is atomic
+		// within its shard, but other threads may see some shards updated before others.
+		void saveBatch(const TWriteBatch& batch) {
+			if (!isOpen() || batch.size() == 0) return;
+
+			std::vector<TWriteBatch> parts(shards.size());
+			for (const auto& op : batch.ops()) {
+				if (op.key.size() != sizeof(K)) continue;
+				TWriteBatch& part = parts[indexOf(op.key.data())];
+				if (op.erase) {
+					part.erase(op.key);
+				} else if (op.append) {
+					part.append(op.key, op.value);
+				} else if (op.patch) {
+					part.update(op.key, op.offset, op.value);
+				} else {
+					part.put(op.key, op.value, op.flags);
+				}
+			}
+
+			std::vector<TAsync<bool>> done;
+			size_t local = shards.size();
+			for (size_t s = 0; s < shards.size(); s++) {
+				if (parts[s].size() == 0) continue;
+				if (local == shards.size()) {
+					local = s; // done by calling thread
+				} else {
+					std::call_once(poolOnce, [this]() { pool.reset(new TThreadPool(shards.size() - 1)); });
+					TAsync<bool> d;
+					pool->post([this, &parts, s, d]() {
+						shards[s]->saveBatch(parts[s]);
+						d.set(true);
+					});
+					done.push_back(d);
+				}
+			}
+
+			if (local < shards.size()) shards[local]->saveBatch(parts[local]);
+			for (const auto& d : done) d.wait();
+		}
+	};
+
+	//============================================================================
+	// Log-structured file
+	// Every put and erase is appended to the active segment and the index points to
+	// the latest record of each key. Full segments are sealed with a hint file listing
+	// their records, so open() does not read values. merge() rewrites live values of
+	// sealed segments into one segment and deletes the old ones.
+	//============================================================================
+	#pragma pack(push,1)
+	typedef struct TLogSegmentHeader {
+		uint32 version = KVDB_LOG_VERSION;
+		uint32 keySize = 0;
+	} TLogSegmentHeader;
+
+	// followed by key and value
+	typedef struct TLogRecordHeader {
+		ulong64 checksum = 0; // of fields below, key and value
+		uint32 type = 0;
+		uint32 valueSize = 0;
+		ulong64 flags = 0;
+	} TLogRecordHeader;
+
+	typedef struct TLogHintHeader {
+		uint32 version = KVDB_LOG_VERSION;
+		uint32 keySize = 0;
+		ulong64 segmentSize = 0; // hint is valid for segment of this size
+		ulong64 checksum = 0; // of entries
+	} TLogHintHeader;
+
+	// followed by key
+	typedef struct TLogHintEntry {
+		uint32 type = 0;
+		uint32 valueSize = 0;
+		ulong64 valuePos = 0;
+		ulong64 flags = 0;
+	} TLogHintEntry;
+
+	// index entry: where latest value of key is
+	typedef struct TLogRecord {
+		ulong64 segment;
+		ulong64 valuePos;
+		uint32 valueSize;
+		ulong64 flags;
+	} TLogRecord;
+	#pragma pack(pop)
+
+	class TLogSegment {
+
+	private:
+		std::string path;
+#ifdef KVDB_POSIX_IO
+		int fd = -1;
+#else
+		mutable std::mutex streamMutex;
+		mutable std::fstream* stream = nullptr;
+#endif
+		ulong64 length = 0;
+
+	public:
+		~TLogSegment() {
+			close();
+		}
+
+		bool open(const std::string& file) {
+			path = file;
+			std::error_code ec;
+			length = std::filesystem::exists(path, ec) ? (ulong64)std::filesystem::file_size(path, ec) : 0;
+#ifdef KVDB_POSIX_IO
+			fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+			return fd >= 0;
+#else
+			{ std::ofstream touch(path, std::ios::out | std::ios::binary | std::ios::app); }
+			stream = new std::fstream(path, std::ios::in | std::ios::out | std::ios::binary);
+			return stream->is_open();
+#endif
+		}
+
+		void close() {
+#ifdef KVDB_POSIX_IO
+			if (fd >= 0) ::close(fd);
+			fd = -1;
+#else
+			delete stream;
+			stream = nullptr;
+#endif
+		}
+
+		// data goes to end of segment, pos gets its offset
+		bool append(const byte* data, size_t size, ulong64& pos) {
+			pos = length;
+#ifdef KVDB_POSIX_IO
+			for (size_t done = 0; done < size; ) {
+				ssize_t n = ::pwrite(fd, data + done, size - done, (off_t)(pos + done));
+				if (n <= 0) return false;
+				done += n;
+			}
+#else
+			std::lock_guard<std::mutex> guard(streamMutex);
+			stream->seekp(pos);
+			stream->write((char*)data, size);
+			stream->flush();
+			if (!*stream) return false;
+#endif
+			length += size;
+			return true;
+		}
+
+		bool read(ulong64 pos, byte* dst, size_t size) const {
+#ifdef KVDB_POSIX_IO
+			return preadFull(fd, dst, size, pos);
+#else
+			std::lock_guard<std::mutex> guard(streamMutex);
+			stream->seekg(pos);
+			return (bool)stream->read((char*)dst, size);
+#endif
+		}
+
+		// no real sync without posix io
+		void sync() {
+#ifdef KVDB_POSIX_IO
+			if (fd >= 0) fdatasync(fd);
+#endif
+		}
+
+		// cut torn tail found by recovery
+		bool truncate(ulong64 size) {
+			std::error_code ec;
+			std::filesystem::resize_file(path, size, ec);
+			length = size;
+			return !ec;
+		}
+
+		ulong64 size() const { return length; }
+	};
+
+	class KvLogRawFile {
+
+	protected:
+		std::string dirPath;
+		uint32 keySize = 0;
+		bool opened = false;
+		TKeyMap<TLogRecord> index;
+		std::map<ulong64, std::unique_ptr<TLogSegment>> segments; // id is number << 8 | merge generation
+		std::map<ulong64, ulong64> liveBytes; // of records still in index, per segment
+		ulong64 activeId = 0;
+		std::vector<byte> activeHint; // hint entries of active segment
+		mutable std::shared_mutex fileSharedMutex; // shared for readers, exclusive for writers
+
+		ulong64 segmentLimit = KVDB_LOG_SEGMENT_SIZE;
+		bool syncOnCommit = false;
+
+		// background merge
+		std::mutex mergeMutex; // one merge at a time
+		double mergeRatio = 0.5;
+		uint32 mergeIntervalMs = 0;
+		std::thread mergeThread;
+		std::mutex mergeWaitMutex;
+		std::condition_variable mergeCv;
+		bool mergeStop = false;
+
+		static std::string segmentName(ulong64 id, const char* ext) {
+			char name[32];
+			snprintf(name, sizeof(name), "%016llx", id);
+			return std::string(name) + ext;
+		}
+
+		// inverse of segmentName, false for names it does not produce
+		static bool parseSegmentName(const std::string& stem, ulong64& id) {
+			if (stem.size() != 16) return false;
+			for (char c : stem) {
+				if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'))) return false;
+			}
+			return std::from_chars(stem.data(), stem.data() + stem.size(), id, 16).ec == std::errc();
+		}
 
-			if (dataMap.find(kd) == dataMap.end()) {
-				// pair not found  
-				addNew(kd, valueData, k_flags);
+		std::string pathOf(ulong64 id, const char* ext) const {
+			return (std::filesystem::path(dirPath) / segmentName(id, ext)).string();
+		}
+
+		ulong64 recordSize(uint32 valueSize) const {
+			return sizeof(TLogRecordHeader) + keySize + valueSize;
+		}
+
+		void apply(ulong64 id, uint32 type, const byte* key, ulong64 valuePos, uint32 valueSize, ulong64 flags) {
+			const TLogRecord* old = index.find(key);
+			if (old) {
+				const ulong64 segment = old->segment; // record is packed, no reference to its fields
+				liveBytes[segment] -= recordSize(old->valueSize);
+			}
+
+			if ((type & 0xff) == KVDB_LOG_ERASE) {
+				if (old) index.erase(key);
 			} else {
-				// pair found 
-				change(kd, valueData, k_flags);
+				index.insert(key, TLogRecord{ id, valuePos, valueSize, flags });
+				liveBytes[id] += recordSize(valueSize);
 			}
 		}
 
-		// ====================================================================================
-		
-		size_t reserved() const {
-			return reservedKeyList.size();
-		}		
-		
-		size_t deleted() const {
-			return deletedKeyList.size();
-		}	
-	};
+		static void putHintEntry(std::vector<byte>& hint, uint32 type, const byte* key, uint32 size, ulong64 valuePos, uint32 valueSize, ulong64 flags) {
+			TLogHintEntry e{ type & 0xff, valueSize, valuePos, flags };
+			hint.insert(hint.end(), (const byte*)&e, (const byte*)&e + sizeof(e));
+			hint.insert(hint.end(), key, key + size);
+		}
 
+		// written next to segment and renamed, so it is complete or missing
+		bool writeHint(ulong64 id, const std::vector<byte>& entries, ulong64 segmentSize) {
+			TLogHintHeader h;
+			h.keySize = keySize;
+			h.segmentSize = segmentSize;
+			h.checksum = checksum(entries.data(), entries.size());
+
+			const std::string path = pathOf(id, KVDB_LOG_HINT_EXT);
+			{
+				std::ofstream out(path + ".tmp", std::ios::out | std::ios::binary | std::ios::trunc);
+				out.write((const char*)&h, sizeof(h));
+				out.write((const char*)entries.data(), entries.size());
+				if (!out) return false;
+			}
 
-	template <typename K, typename V>
-	class KvFile : public KvRawFile{
+			std::error_code ec;
+			std::filesystem::rename(path + ".tmp", path, ec);
+			return !ec;
+		}
 
-	private:
+		// false if hint is missing, damaged or does not cover whole segment
+		bool loadHint(ulong64 id, ulong64 segmentSize, std::vector<byte>* keep) {
+			std::ifstream in(pathOf(id, KVDB_LOG_HINT_EXT), std::ios::in | std::ios::binary);
+			if (!in) return false;
+			std::vector<byte> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+			TLogHintHeader h;
+			if (data.size() < sizeof(h)) return false;
+			std::memcpy(&h, data.data(), sizeof(h));
+			const byte* entries = data.data() + sizeof(h);
+			const size_t size = data.size() - sizeof(h);
+			const size_t entrySize = sizeof(TLogHintEntry) + keySize;
+			if (h.version != KVDB_LOG_VERSION || h.keySize != keySize || h.segmentSize != segmentSize || size % entrySize != 0) return false;
+			if (checksum(entries, size) != h.checksum) return false;
+
+			for (size_t pos = 0; pos < size; pos += entrySize) {
+				TLogHintEntry e;
+				std::memcpy(&e, entries + pos, sizeof(e));
+				apply(id, e.type, entries + pos + sizeof(e), e.valuePos, e.valueSize, e.flags);
+			}
 
-		std::shared_ptr<V> valueFromData(TValueDataPtr dataPtr) const {
-			if (dataPtr == nullptr) return nullptr;
+			if (keep) keep->assign(entries, entries + size);
+			return true;
+		}
 
-			if constexpr (std::is_same<V, TValueData>::value) { //constexpr
-				return std::static_pointer_cast<TValueData>(dataPtr);
-			} else {
-				V* temp = new V();
-				std::memcpy(temp, dataPtr->data(), sizeof(V));
-				return std::shared_ptr<V>(temp);
+		// Applies complete batches of records, hint entries are collected into hint. Torn tail
+		// of last segment is cut, sealed segment was synced whole so bad record there is damage.
+		int scanSegment(ulong64 id, TLogSegment& segment, std::vector<byte>& hint, bool last) {
+			std::vector<byte> data(segment.size());
+			if (!segment.read(0, data.data(), data.size())) return KVDB_ERROR_OPEN_FILE;
+
+			typedef struct TPendingOp {
+				uint32 type;
+				size_t keyPos;
+				ulong64 valuePos;
+				uint32 valueSize;
+				ulong64 flags;
+			} TPendingOp;
+
+			std::vector<TPendingOp> pending;
+			size_t pos = sizeof(TLogSegmentHeader);
+			size_t batchStart = pos;
+			while (pos + sizeof(TLogRecordHeader) <= data.size()) {
+				TLogRecordHeader h;
+				std::memcpy(&h, data.data() + pos, sizeof(h));
+
+				const ulong64 end = pos + recordSize(h.valueSize);
+				if (end > data.size()) break;
+
+				const size_t offset = sizeof(h.checksum);
+				if (checksum(data.data() + pos + offset, end - pos - offset) != h.checksum) break;
+
+				const size_t keyPos = pos + sizeof(TLogRecordHeader);
+				pending.push_back(TPendingOp{ h.type, keyPos, keyPos + keySize, h.valueSize, h.flags });
+				pos = end;
+
+				if ((h.type & KVDB_LOG_CONTINUED) == 0) {
+					for (const auto& op : pending) {
+						apply(id, op.type, data.data() + op.keyPos, op.valuePos, op.valueSize, op.flags);
+						putHintEntry(hint, op.type, data.data() + op.keyPos, keySize, op.valuePos, op.valueSize, op.flags);
+					}
+					pending.clear();
+					batchStart = pos;
+				}
 			}
+
+			if (batchStart == data.size()) return KVDB_OK;
+			if (!last) return KVDB_ERROR_DAMAGED_FILE;
+			return segment.truncate(batchStart) ? KVDB_OK : KVDB_ERROR_OPEN_FILE;
 		}
 
-		static TKeyData toKeyData(K key) {
-			TKeyData kd(sizeof(K));
-			std::fill(kd.begin(), kd.end(), 0);
-			std::memcpy(kd.data(), &key, sizeof(K));
-			return kd;
+		bool openSegment(ulong64 id) {
+			std::unique_ptr<TLogSegment> segment(new TLogSegment());
+			if (!segment->open(pathOf(id, KVDB_LOG_SEGMENT_EXT))) return false;
+
+			if (segment->size() == 0) {
+				TLogSegmentHeader h;
+				h.keySize = keySize;
+				ulong64 pos;
+				if (!segment->append((const byte*)&h, sizeof(h), pos)) return false;
+			}
+
+			segments[id] = std::move(segment);
+			return true;
 		}
 
-		static K keyFromKeyData(const TKeyData& kd) {
-			K key;
-			std::memcpy(&key, kd.data(), sizeof(K));
-			return key;
+		// seal active segment with its hint, next number starts new segment
+		bool rollOver() {
+			TLogSegment& active = *segments[activeId];
+			active.sync();
+			writeHint(activeId, activeHint, active.size());
+			activeHint.clear();
+			activeId = ((activeId >> 8) + 1) << 8;
+			return openSegment(activeId);
 		}
 
-		static void toValueData(V value, TValueData& valueData) {
-			if (valueData.size() < sizeof(value)) valueData.resize(sizeof(value));
-			std::memcpy(valueData.data(), &value, sizeof(value));
+		// Records hold whole values: updates and appends are applied to stored value or to earlier
+		// put of batch and logged as puts. False if stored value can't be read.
+		bool resolvePatches(const TWriteBatch& batch, TWriteBatch& resolved) const {
+			std::unordered_map<TKeyData, TWriteBatch::TBatchOp> latest;
+			for (const auto& op : batch.ops()) {
+				if (op.key.size() != keySize) continue;
+
+				if (!op.patch) {
+					latest[op.key] = op;
+					if (op.erase) {
+						resolved.erase(op.key);
+					} else {
+						resolved.put(op.key, op.value, op.flags);
+					}
+					continue;
+				}
+
+				auto itr = latest.find(op.key);
+				if (itr == latest.end()) {
+					TWriteBatch::TBatchOp stored{ op.key, TValueData(), 0, true };
+					if (const TLogRecord* r = index.find(op.key.data())) {
+						const TLogRecord record = *r; // packed, no reference to its fields
+						stored.erase = false;
+						stored.flags = record.flags;
+						stored.value.resize(record.valueSize);
+						if (!segments.at(record.segment)->read(record.valuePos, stored.value.data(), record.valueSize)) return false;
+					}
+					itr = latest.emplace(op.key, std::move(stored)).first;
+				}
+
+				TWriteBatch::TBatchOp& current = itr->second;
+				if (op.value.empty() || (current.erase && !op.append)) continue;
+				if (current.erase) current = TWriteBatch::TBatchOp{ op.key }; // append creates key
+
+				const ulong64 offset = op.append ? current.value.size() : op.offset;
+				if (offset > current.value.size()) continue;
+				if (offset + op.value.size() > current.value.size()) current.value.resize(offset + op.value.size());
+				std::memcpy(current.value.data() + offset, op.value.data(), op.value.size());
+				resolved.put(op.key, current.value, current.flags);
+			}
+			return true;
 		}
 
-	public:
+		// called under exclusive lock
+		bool appendBatch(const TWriteBatch& batch) {
+			const auto& ops = batch.ops();
+			if (std::any_of(ops.begin(), ops.end(), [](const auto& op) { return op.patch; })) {
+				TWriteBatch resolved;
+				return resolvePatches(batch, resolved) && appendBatch(resolved);
+			}
 
-		KvFile() : KvRawFile () {
-			keySize = sizeof(K);
+			std::vector<byte> out;
+			std::vector<size_t> starts;
+			for (size_t i = 0; i < ops.size(); i++) {
+				const auto& op = ops[i];
+				if (op.key.size() != keySize || op.value.size() > UINT32_MAX) continue;
+
+				TLogRecordHeader h;
+				h.type = op.erase ? KVDB_LOG_ERASE : KVDB_LOG_PUT;
+				h.valueSize = op.erase ? 0 : (uint32)op.value.size();
+				h.flags = op.flags;
+
+				starts.push_back(out.size());
+				out.resize(out.size() + sizeof(TLogRecordHeader));
+				out.insert(out.end(), op.key.begin(), op.key.end());
+				if (!op.erase) out.insert(out.end(), op.value.begin(), op.value.end());
+				std::memcpy(out.data() + starts.back(), &h, sizeof(h));
+			}
+			if (starts.empty()) return true;
+
+			// last record closes batch, then checksums
+			for (size_t i = 0; i < starts.size(); i++) {
+				const size_t start = starts[i];
+				const size_t end = (i + 1 < starts.size()) ? starts[i + 1] : out.size();
+				TLogRecordHeader h;
+				std::memcpy(&h, out.data() + start, sizeof(h));
+				if (i + 1 < starts.size()) h.type |= KVDB_LOG_CONTINUED;
+				std::memcpy(out.data() + start, &h, sizeof(h));
+				const size_t offset = sizeof(h.checksum);
+				h.checksum = checksum(out.data() + start + offset, end - start - offset);
+				std::memcpy(out.data() + start, &h.checksum, sizeof(h.checksum));
+			}
+
+			if (segments[activeId]->size() + out.size() > segmentLimit && segments[activeId]->size() > sizeof(TLogSegmentHeader)) {
+				if (!rollOver()) return false;
+			}
+
+			TLogSegment& active = *segments[activeId];
+			ulong64 base;
+			if (!active.append(out.data(), out.size(), base)) return false;
+			if (syncOnCommit) active.sync();
+
+			for (size_t i = 0; i < starts.size(); i++) {
+				TLogRecordHeader h;
+				std::memcpy(&h, out.data() + starts[i], sizeof(h));
+				const byte* key = out.data() + starts[i] + sizeof(TLogRecordHeader);
+				const ulong64 valuePos = base + starts[i] + sizeof(TLogRecordHeader) + keySize;
+				apply(activeId, h.type, key, valuePos, h.valueSize, h.flags);
+				putHintEntry(activeHint, h.type, key, keySize, valuePos, h.valueSize, h.flags);
+			}
+			return true;
 		}
 
-		explicit KvFile(uint32 s) : KvRawFile(s) {
-			keySize = sizeof(K);
+		void startMerge() {
+			if (mergeIntervalMs == 0) return;
+			mergeStop = false;
+			mergeThread = std::thread([this]() {
+				std::unique_lock<std::mutex> lock(mergeWaitMutex);
+				while (!mergeCv.wait_for(lock, std::chrono::milliseconds(mergeIntervalMs), [this]() { return mergeStop; })) {
+					lock.unlock();
+					if (deadRatio() >= mergeRatio) merge();
+					lock.lock();
+				}
+			});
 		}
 
-		bool isExist(const K& k) {
-			TKeyData keyData = toKeyData(k);
-			if (!isOpen()) return false;
-			std::lock_guard<std::mutex> guard(fileSharedMutex);
-			return !(dataMap.find(keyData) == dataMap.end());
+		void stopMerge() {
+			if (!mergeThread.joinable()) return;
+			{
+				std::lock_guard<std::mutex> guard(mergeWaitMutex);
+				mergeStop = true;
+			}
+			mergeCv.notify_all();
+			mergeThread.join();
 		}
-		
-		void forEachKey(std::function<void(K key)> func) const {
-			if (!isOpen()) return;
-			std::lock_guard<std::mutex> guard(fileSharedMutex);
-			for (const auto& kv : dataMap) { func(keyFromKeyData(kv.first)); }
+
+		template <size_t N = 0>
+		TValueDataPtr loadKey(const byte* key) const {
+			if (!isOpen()) return nullptr;
+			std::shared_lock<std::shared_mutex> lock(fileSharedMutex);
+
+			const TLogRecord* r = index.template find<N>(key);
+			if (r == nullptr) return nullptr;
+
+			TValueDataPtr dataPtr = TValueDataPtr(new TValueData(r->valueSize));
+			const ulong64 segment = r->segment;
+			return segments.at(segment)->read(r->valuePos, dataPtr->data(), r->valueSize) ? dataPtr : nullptr;
 		}
 
-		ulong64 k_flags(const K& k) const {
+		template <size_t N = 0>
+		bool isExistKey(const byte* key) const {
+			if (!isOpen()) return false;
+			std::shared_lock<std::shared_mutex> lock(fileSharedMutex);
+			return index.template find<N>(key) != nullptr;
+		}
+
+		template <size_t N = 0>
+		ulong64 flagsOf(const byte* key) const {
 			if (!isOpen()) return 0;
+			std::shared_lock<std::shared_mutex> lock(fileSharedMutex);
+			const TLogRecord* r = index.template find<N>(key);
+			return r ? r->flags : 0;
+		}
+
+	public:
+		KvLogRawFile() { }
+
+		~KvLogRawFile() {
+			close();
+		}
 
-			const TKeyData keyData = toKeyData(k);
-			std::lock_guard<std::mutex> guard(fileSharedMutex);
+		// new empty store in directory, old segments of directory are removed
+		static bool create(const std::string& dir, uint32 keySize) {
+			std::error_code ec;
+			std::filesystem::create_directories(dir, ec);
+			if (ec) return false;
 
-			if (auto a = dataMap.find(keyData); a != dataMap.end()) {
-				const auto ki = a->second;
-				return ki().header.flags;
+			for (const auto& entry : std::filesystem::directory_iterator(dir, ec)) {
+				const std::string ext = entry.path().extension().string();
+				if (ext == KVDB_LOG_SEGMENT_EXT || ext == KVDB_LOG_HINT_EXT || ext == ".tmp") std::filesystem::remove(entry.path(), ec);
 			}
-			
-			return 0;
+
+			std::ofstream out((std::filesystem::path(dir) / segmentName((ulong64)1 << 8, KVDB_LOG_SEGMENT_EXT)).string(), std::ios::out | std::ios::binary | std::ios::trunc);
+			TLogSegmentHeader h;
+			h.keySize = keySize;
+			out.write((const char*)&h, sizeof(h));
+			return (bool)out;
 		}
 
-		TValueDataPtr loadData(const K& k) const {
-			if (!isOpen()) return nullptr;
-			return KvRawFile::loadData(toKeyData(k));
+		// Sealed segments are loaded from hint files if they are current, others are scanned.
+		// Torn batch at end of the last segment is cut. Bad record in a sealed segment fails
+		// with KVDB_ERROR_DAMAGED_FILE and leaves files as they are. Files not named like segments are skipped.
+		int open(const std::string& dir) {
+			if (isOpen()) close();
+
+			std::vector<ulong64> ids;
+			std::error_code ec;
+			for (const auto& entry : std::filesystem::directory_iterator(dir, ec)) {
+				ulong64 id;
+				if (entry.path().extension() != KVDB_LOG_SEGMENT_EXT || !parseSegmentName(entry.path().stem().string(), id)) continue;
+				ids.push_back(id);
+			}
+			if (ec || ids.empty()) return KVDB_ERROR_OPEN_FILE;
+			std::sort(ids.begin(), ids.end());
+
+			dirPath = dir;
+
+			TLogSegmentHeader h;
+			std::ifstream first(pathOf(ids[0], KVDB_LOG_SEGMENT_EXT), std::ios::in | std::ios::binary);
+			first.read((char*)&h, sizeof(h));
+			if (!first || h.version != KVDB_LOG_VERSION || (keySize != 0 && keySize != h.keySize)) return KVDB_ERROR_INCORRECT_FILE_VERSION;
+			keySize = h.keySize;
+			index.setKeySize(keySize);
+
+			for (ulong64 id : ids) {
+				if (!openSegment(id)) {
+					close();
+					return KVDB_ERROR_OPEN_FILE;
+				}
+
+				TLogSegment& segment = *segments[id];
+				const bool last = (id == ids.back());
+				if (loadHint(id, segment.size(), last ? &activeHint : nullptr)) continue;
+
+				std::vector<byte> hint;
+				const int res = scanSegment(id, segment, hint, last);
+				if (res != KVDB_OK) {
+					close();
+					return res;
+				}
+
+				if (last) {
+					activeHint.swap(hint);
+				} else {
+					writeHint(id, hint, segment.size());
+				}
+			}
+
+			activeId = ids.back();
+			opened = true;
+			startMerge();
+			return KVDB_OK;
 		}
 
-		std::shared_ptr<V> load(const K& k) const {
-			return valueFromData(loadData(k));
+		// hint of active segment is written, so next open reads no values
+		// also drops segments of failed open()
+		void close() {
+			if (isOpen()) stopMerge();
+
+			std::lock_guard<std::shared_mutex> guard(fileSharedMutex);
+			if (isOpen()) {
+				TLogSegment& active = *segments[activeId];
+				active.sync();
+				writeHint(activeId, activeHint, active.size());
+			}
+
+			opened = false;
+			segments.clear();
+			liveBytes.clear();
+			activeHint.clear();
+			index.clear();
 		}
 
-		std::shared_ptr<V> operator[] (const K& k) {
-			return valueFromData(loadData(k));
+		bool isOpen() const {
+			return opened;
 		}
 
-		void erase(const K& k) {
-			if (!isOpen()) return;
-			KvRawFile::erase(toKeyData(k));
+		size_t size() const {
+			if (!isOpen()) return 0;
+			std::shared_lock<std::shared_mutex> lock(fileSharedMutex);
+			return index.size();
 		}
 
-		void save(const K& k, const V& v, const ulong64 k_flags = 0x0) {
-			if (!isOpen()) return;
-			TValueData valueData;
+		size_t segmentCount() const {
+			std::shared_lock<std::shared_mutex> lock(fileSharedMutex);
+			return segments.size();
+		}
 
-			if constexpr(std::is_same<V, TValueData>::value) {
-				valueData = static_cast<TValueData>(v);
-			} else {
-				toValueData(v, valueData);
-			}
+		// Segment size limit, call before open. Merged segment may be larger.
+		void setSegmentSize(ulong64 bytes) {
+			segmentLimit = std::max<ulong64>(bytes, 4096);
+		}
 
-			KvRawFile::save(toKeyData(k), valueData, k_flags);
+		// fdatasync after every save, erase and batch
+		void enableSync(bool enable = true) {
+			syncOnCommit = enable;
 		}
 
-		static bool create(const std::string& file, const std::unordered_map<K, V>& test, ulong64 max_key_records = KVDB_RESERVED_TABLE_SIZE) {
-			std::ofstream outFile(file, std::ios::out | std::ios::binary);
-			if (!outFile) return false;
-			std::ofstream* outFilePtr = &outFile;
+		// background merge when dead part of sealed segments reaches ratio, call before open
+		void enableMerge(double ratio = 0.5, uint32 intervalMs = 1000) {
+			mergeRatio = ratio;
+			mergeIntervalMs = intervalMs;
+		}
 
-			const ulong64 keyRecords = (test.size() > max_key_records) ? test.size() : max_key_records;
+		// overwritten, erased and tombstone records of sealed segments per their size
+		double deadRatio() const {
+			if (!isOpen()) return 0;
+			std::shared_lock<std::shared_mutex> lock(fileSharedMutex);
+
+			ulong64 total = 0, live = 0;
+			for (const auto& s : segments) {
+				if (s.first == activeId) continue;
+				total += s.second->size() - sizeof(TLogSegmentHeader);
+				auto itr = liveBytes.find(s.first);
+				if (itr != liveBytes.end()) live += itr->second;
+			}
+			return total ? 1.0 - (double)live / total : 0;
+		}
 
-			// save file header
-			TFileHeader fileHeader{ .keySize = sizeof(K) };
-			outFilePtr << fileHeader;
+		// Live values of sealed segments are copied into one new segment without holding
+		// the lock, then index is switched to it and old segments are deleted oldest first.
+		// Tombstones are dropped, no older segment is left for them to hide. False if nothing to merge.
+		bool merge() {
+			if (!isOpen()) return false;
+			std::lock_guard<std::mutex> mergeGuard(mergeMutex);
+
+			typedef struct TMove {
+				size_t keyPos; // in keys
+				TLogRecord from;
+				TLogRecord to;
+			} TMove;
+
+			std::vector<TMove> moves;
+			std::vector<byte> keys;
+			std::map<ulong64, const TLogSegment*> sealed;
+			{
+				std::shared_lock<std::shared_mutex> lock(fileSharedMutex);
+				for (const auto& s : segments) {
+					if (s.first != activeId) sealed[s.first] = s.second.get();
+				}
+				if (sealed.empty()) return false;
 
-			TTableHeader tableHeader{keyRecords, 0};
-			outFilePtr << tableHeader;
+				index.forEach([&](const byte* key, const TLogRecord& r) {
+					if (r.segment == activeId) return;
+					moves.push_back(TMove{ keys.size(), r, r });
+					keys.insert(keys.end(), key, key + keySize);
+				});
+			}
 
-			ulong64 bodyDataOffset = (ulong64)(outFile.tellp()) + (sizeof(TKeyEntryHeader) + sizeof(K)) * keyRecords;
-			std::vector<byte> dataBody;
-			for (auto& e : test) {
-				TKeyEntry entry{ .header = TKeyEntryHeader{ .dataPos = dataBody.size() + bodyDataOffset }, .freeKeyData = toKeyData(e.first) };
-				TValueData valueData;
-				if constexpr (std::is_same<V, TValueData>::value) {
-					valueData = static_cast<TValueData>(e.second);
-				} else {
-					toValueData(e.second, valueData);
+			const ulong64 mergedId = sealed.rbegin()->first + 1; // replayed after merged segments, before newer ones
+			if ((mergedId & 0xff) == 0) return false; // out of merge generations
+
+			// read in file order
+			std::sort(moves.begin(), moves.end(), [](const TMove& a, const TMove& b) { 
+				return a.from.segment != b.from.segment ? a.from.segment < b.from.segment : a.from.valuePos < b.from.valuePos; 
+			});
+
+			const std::string mergedPath = pathOf(mergedId, KVDB_LOG_SEGMENT_EXT);
+			std::unique_ptr<TLogSegment> merged(new TLogSegment());
+			if (!merged->open(mergedPath + ".tmp")) return false;
+			merged->truncate(0);
+
+			TLogSegmentHeader sh;
+			sh.keySize = keySize;
+			std::vector<byte> out((const byte*)&sh, (const byte*)&sh + sizeof(sh));
+			std::vector<byte> hint;
+			ulong64 written = 0;
+			bool ok = true;
+
+			for (auto& m : moves) {
+				const byte* key = keys.data() + m.keyPos;
+				TLogRecordHeader h;
+				h.type = KVDB_LOG_PUT;
+				h.valueSize = m.from.valueSize;
+				h.flags = m.from.flags;
+
+				const size_t start = out.size();
+				out.resize(start + sizeof(h) + keySize + h.valueSize);
+				std::memcpy(out.data() + start + sizeof(h), key, keySize);
+				const ulong64 segment = m.from.segment;
+				ok = ok && sealed[segment]->read(m.from.valuePos, out.data() + start + sizeof(h) + keySize, h.valueSize);
+				std::memcpy(out.data() + start, &h, sizeof(h));
+				const size_t offset = sizeof(h.checksum);
+				h.checksum = checksum(out.data() + start + offset, out.size() - start - offset);
+				std::memcpy(out.data() + start, &h.checksum, sizeof(h.checksum));
+
+				m.to = TLogRecord{ mergedId, written + start + sizeof(h) + keySize, h.valueSize, h.flags };
+				putHintEntry(hint, KVDB_LOG_PUT, key, keySize, m.to.valuePos, m.to.valueSize, m.to.flags);
+
+				if (out.size() >= (1 << 20)) {
+					ulong64 pos;
+					ok = ok && merged->append(out.data(), out.size(), pos);
+					written += out.size();
+					out.clear();
 				}
+			}
 
-				entry.header.dataLength = valueData.size();
-				entry.header.initialDataLength = valueData.size();
-				dataBody.insert(std::end(dataBody), std::begin(valueData), std::end(valueData));
-				outFilePtr << entry;
+			ulong64 pos;
+			ok = ok && merged->append(out.data(), out.size(), pos);
+			merged->sync();
+
+			std::error_code ec;
+			if (ok) std::filesystem::rename(mergedPath + ".tmp", mergedPath, ec);
+			if (!ok || ec) {
+				merged = nullptr;
+				std::filesystem::remove(mergedPath + ".tmp", ec);
+				return false;
 			}
+			writeHint(mergedId, hint, merged->size());
 
-			if (test.size() < max_key_records) {
-				// add empty records
-				const ulong64 emptyRecords = max_key_records - test.size();
-				for (ulong64 i = 0; i < emptyRecords; i++) {
-					TKeyEntry key;
-					writeKey(outFilePtr, key, sizeof(K));
+			std::lock_guard<std::shared_mutex> guard(fileSharedMutex);
+
+			// keys changed during merge keep their newer records
+			for (const auto& m : moves) {
+				TLogRecord* r = index.find(keys.data() + m.keyPos);
+				if (r && r->segment == m.from.segment && r->valuePos == m.from.valuePos) {
+					*r = m.to;
+					liveBytes[mergedId] += recordSize(m.to.valueSize);
 				}
 			}
-
-			outFilePtr->write((char*)dataBody.data(), dataBody.size());
-			outFile.close();
+			segments[mergedId] = std::move(merged);
+
+			// oldest first: a record left after crash is never older than remaining tombstone for it
+			for (const auto& s : sealed) {
+				segments.erase(s.first);
+				liveBytes.erase(s.first);
+				std::filesystem::remove(pathOf(s.first, KVDB_LOG_SEGMENT_EXT), ec);
+				std::filesystem::remove(pathOf(s.first, KVDB_LOG_HINT_EXT), ec);
+			}
 			return true;
 		}
 
-		static bool create_empty(const std::string& file, ulong64 max_key_records = KVDB_RESERVED_TABLE_SIZE) {
-			std::ofstream outFile(file, std::ios::out | std::ios::binary);
-			if (!outFile) return false;
-			std::ofstream* outFilePtr = &outFile;
+		bool isExist(const TKeyData& kd) const {
+			return (kd.size() == keySize) && isExistKey(kd.data());
+		}
 
-			// save file header
-			TFileHeader fileHeader{ .keySize = sizeof(K) };
-			outFilePtr << fileHeader;
+		ulong64 k_flags(const TKeyData& kd) const {
+			return (kd.size() == keySize) ? flagsOf(kd.data()) : 0;
+		}
 
-			TTableHeader tableHeader{0, 0};
-			outFilePtr << tableHeader;
+		TValueDataPtr loadData(const TKeyData& kd) const {
+			return (kd.size() == keySize) ? loadKey(kd.data()) : nullptr;
+		}
 
-			// add empty records
-			const ulong64 emptyRecords = max_key_records;
-			for (ulong64 i = 0; i < emptyRecords; i++) {
-				TKeyEntry key;
-				writeKey(outFilePtr, key, sizeof(K));
+		// all records of batch are appended by one write, after crash batch is replayed whole or not at all
+		void saveBatch(const TWriteBatch& batch) {
+			if (!isOpen() || batch.size() == 0) return;
+			std::lock_guard<std::shared_mutex> guard(fileSharedMutex);
+			appendBatch(batch);
+		}
+
+		void save(const TKeyData& kd, const TValueData& valueData, const ulong64 k_flags = 0x0) {
+			TWriteBatch batch;
+			batch.put(kd, valueData, k_flags);
+			saveBatch(batch);
+		}
+
+		// tombstone is written only for existing key
+		void erase(const TKeyData& kd) {
+			if (!isExist(kd)) return;
+			TWriteBatch batch;
+			batch.erase(kd);
+			saveBatch(batch);
+		}
+
+		void forEachKey(std::function<void(const TKeyData& kd)> func) const {
+			if (!isOpen()) return;
+			std::shared_lock<std::shared_mutex> lock(fileSharedMutex);
+			index.forEach([&](const byte* key, const TLogRecord&) { func(TKeyData(key, key + keySize)); });
+		}
+	};
+
+	// KvFile interface over log-structured storage, path is a directory
+	template <typename K, typename V>
+	class KvLogFile : public KvLogRawFile {
+
+	public:
+		typedef typename KvFile<K, V>::TBatch TBatch;
+
+	private:
+		static const byte* keyBytes(const K& k) {
+			return reinterpret_cast<const byte*>(&k);
+		}
+
+		static TKeyData toKeyData(const K& k) {
+			return TKeyData(keyBytes(k), keyBytes(k) + sizeof(K));
+		}
+
+		static TValueData valueToData(const V& v) {
+			if constexpr (std::is_same<V, TValueData>::value) {
+				return v;
+			} else {
+				return TValueData((const byte*)&v, (const byte*)&v + sizeof(V));
 			}
+		}
 
-			outFile.close();
+		static std::shared_ptr<V> valueFromData(TValueDataPtr dataPtr) {
+			if (dataPtr == nullptr) return nullptr;
+
+			if constexpr (std::is_same<V, TValueData>::value) {
+				return dataPtr;
+			} else {
+				std::shared_ptr<V> value(new V());
+				std::memcpy((void*)value.get(), dataPtr->data(), std::min(sizeof(V), dataPtr->size()));
+				return value;
+			}
+		}
+
+	public:
+		KvLogFile() : KvLogRawFile() {
+			keySize = sizeof(K);
+		}
+
+		static bool create(const std::string& dir) {
+			return KvLogRawFile::create(dir, sizeof(K));
+		}
+
+		static bool create(const std::string& dir, const std::unordered_map<K, V>& data) {
+			if (!create(dir)) return false;
+			if (data.empty()) return true;
+
+			KvLogFile file;
+			if (file.open(dir) != KVDB_OK) return false;
+			TBatch batch;
+			for (const auto& e : data) batch.put(e.first, e.second);
+			file.saveBatch(batch);
+			file.close();
 			return true;
 		}
 
-		// ====================================================================================
-		
-		void info(std::vector<TKeyEntry>& active, std::vector<TKeyEntry>& reserve, std::vector<TKeyEntry>& deleted) {
-			if (!isOpen()) return;
-			std::lock_guard<std::mutex> guard(fileSharedMutex);
-			
-			active.clear();
-			active.reserve(dataMap.size());
-			std::for_each(dataMap.cbegin(), dataMap.cend(), [&](const auto& p){ active.push_back(p.second()); });
+		bool isExist(const K& k) const {
+			return isExistKey<sizeof(K)>(keyBytes(k));
+		}
 
-			reserve.clear();
-			reserve.reserve(reservedKeyList.size());
-			std::for_each(reservedKeyList.cbegin(), reservedKeyList.cend(), [&](const auto& p){ reserve.push_back(p); });
-            
-			deleted.clear();
-			deleted.reserve(deletedKeyList.size());
-			std::for_each(deletedKeyList.cbegin(), deletedKeyList.cend(), [&](const auto& p){ deleted.push_back(p); });
+		ulong64 k_flags(const K& k) const {
+			return flagsOf<sizeof(K)>(keyBytes(k));
+		}
+
+		TValueDataPtr loadData(const K& k) const {
+			return loadKey<sizeof(K)>(keyBytes(k));
+		}
+
+		std::shared_ptr<V> load(const K& k) const {
+			return valueFromData(loadData(k));
+		}
+
+		std::shared_ptr<V> operator[] (const K& k) {
+			return load(k);
 		}
-		// ====================================================================================
 
+		void save(const K& k, const V& v, const ulong64 k_flags = 0x0) {
+			KvLogRawFile::save(toKeyData(k), valueToData(v), k_flags);
+		}
+
+		void erase(const K& k) {
+			KvLogRawFile::erase(toKeyData(k));
+		}
+
+		void forEachKey(std::function<void(K key)> func) const {
+			KvLogRawFile::forEachKey([&](const TKeyData& kd) {
+				K key;
+				std::memcpy((void*)&key, kd.data(), sizeof(K));
+				func(key);
+			});
+		}
 	};
 	//-----------------------------------------------------------------------------
 }
\ No newline at end of file
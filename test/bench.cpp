@@ -0,0 +1,903 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <unordered_map>
+#include <filesystem>
+
+#include "../kvdb.hpp"
+#include "VoxelIndex.h"
+
+#define BENCH_FILE "bench.dat"
+
+typedef kvdb::KvFile<TVoxelIndex, TValueData> TBenchFile;
+
+const int bench_size = 24;        // 24^3 keys
+const int bench_value_size = 1024;
+const double bench_seconds = 1.0;
+
+std::string bench_filter; // run only benchmarks with this prefix
+
+TVoxelIndex random_key(std::mt19937 &rng) {
+    return TVoxelIndex(rng() % bench_size, rng() % bench_size, rng() % bench_size);
+}
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void remove_bench_file(const std::string &file_name = BENCH_FILE) {
+    std::remove(file_name.c_str());
+    std::remove((file_name + ".idx").c_str());
+    std::remove((file_name + ".wal").c_str());
+}
+
+bool selected(const std::string &name) {
+    return bench_filter.empty() || name.compare(0, bench_filter.size(), bench_filter) == 0;
+}
+
+//=====================================================================================
+// latency samples and results
+//=====================================================================================
+
+class TLatency {
+
+public:
+    void add(double ns) {
+        samples.push_back(ns);
+    }
+
+    // time of one call of func
+    template <typename F>
+    void measure(F func) {
+        auto start = std::chrono::steady_clock::now();
+        func();
+        add(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    void merge(const TLatency &other) {
+        samples.insert(samples.end(), other.samples.begin(), other.samples.end());
+    }
+
+    // p in 0..1, nanoseconds
+    double percentile(double p) {
+        if (samples.empty()) return 0;
+        std::sort(samples.begin(), samples.end());
+        return samples[std::min(samples.size() - 1, (size_t)(p * samples.size()))];
+    }
+
+private:
+    std::vector<double> samples;
+};
+
+typedef struct TBenchResult {
+    std::string name;
+    std::string params;
+    double ops;
+    double p50;
+    double p99;
+    double p999;
+} TBenchResult;
+
+std::vector<TBenchResult> results;
+
+void report(const std::string &name, const std::string &params, double ops, TLatency &latency) {
+    TBenchResult r{name, params, ops, latency.percentile(0.5), latency.percentile(0.99), latency.percentile(0.999)};
+    results.push_back(r);
+    printf("%-16s %-34s ops/sec: %10.0f   p50: %9.0f ns   p99: %9.0f ns   p999: %9.0f ns\n", r.name.c_str(), r.params.c_str(), r.ops, r.p50, r.p99, r.p999);
+}
+
+// one JSON object per line, params are "key=value" pairs separated by spaces
+bool write_json(const std::string &file_name) {
+    FILE *f = fopen(file_name.c_str(), "w");
+    if (f == nullptr) return false;
+
+    for (const auto &r : results) {
+        fprintf(f, "{\"name\":\"%s\",\"file_version\":%d", r.name.c_str(), KVDB_FILE_VERSION);
+        size_t pos = 0;
+        while (pos < r.params.size()) {
+            size_t end = r.params.find(' ', pos);
+            if (end == std::string::npos) end = r.params.size();
+            const std::string param = r.params.substr(pos, end - pos);
+            const size_t eq = param.find('=');
+            if (eq != std::string::npos) {
+                fprintf(f, ",\"%s\":\"%s\"", param.substr(0, eq).c_str(), param.substr(eq + 1).c_str());
+            }
+            pos = end + 1;
+        }
+        fprintf(f, ",\"ops_per_sec\":%.0f,\"p50_ns\":%.0f,\"p99_ns\":%.0f,\"p999_ns\":%.0f}\n", r.ops, r.p50, r.p99, r.p999);
+    }
+
+    fclose(f);
+    return true;
+}
+
+//=====================================================================================
+// key and value size sweep on raw file
+//=====================================================================================
+
+template <size_t N>
+struct TBenchKey {
+    byte b[N];
+};
+
+template <size_t N>
+void run_size_sweep(size_t value_size) {
+    const std::string params = "key_size=" + std::to_string(N) + " value_size=" + std::to_string(value_size);
+    const size_t count = std::max<size_t>(500, std::min<size_t>(20000, (64 << 20) / value_size));
+
+    remove_bench_file();
+    kvdb::KvFile<TBenchKey<N>, TValueData>::create_empty(BENCH_FILE);
+
+    kvdb::KvRawFile kv_file;
+    kv_file.open(BENCH_FILE);
+
+    std::mt19937 rng(N * 1000 + value_size);
+    std::vector<TKeyData> keys(count, TKeyData(N));
+    for (auto &k : keys) {
+        for (auto &b : k) b = (byte)rng();
+    }
+    const TValueData value(value_size, 7);
+
+    TLatency save_latency;
+    auto start = std::chrono::steady_clock::now();
+    for (const auto &k : keys) {
+        save_latency.measure([&]() { kv_file.save(k, value); });
+    }
+    report("save", params, count / seconds_since(start), save_latency);
+
+    std::shuffle(keys.begin(), keys.end(), rng);
+    TLatency load_latency;
+    start = std::chrono::steady_clock::now();
+    for (const auto &k : keys) {
+        load_latency.measure([&]() {
+            if (kv_file.loadData(k) == nullptr) exit(-1);
+        });
+    }
+    report("load", params, count / seconds_since(start), load_latency);
+
+    TLatency erase_latency;
+    start = std::chrono::steady_clock::now();
+    for (const auto &k : keys) {
+        erase_latency.measure([&]() { kv_file.erase(k); });
+    }
+    report("erase", params, count / seconds_since(start), erase_latency);
+
+    kv_file.close();
+    remove_bench_file();
+}
+
+void run_size_sweeps() {
+    if (!selected("save") && !selected("load") && !selected("erase")) return;
+
+    for (size_t value_size : {16, 256, 4096, 65536}) {
+        run_size_sweep<4>(value_size);
+        run_size_sweep<12>(value_size);
+        run_size_sweep<32>(value_size);
+    }
+}
+
+//=====================================================================================
+// bench file of bench_size^3 keys
+//=====================================================================================
+
+void create_bench_file() {
+    remove_bench_file();
+
+    std::unordered_map<TVoxelIndex, TValueData> data;
+    for (int x = 0; x < bench_size; x++) {
+        for (int y = 0; y < bench_size; y++) {
+            for (int z = 0; z < bench_size; z++) {
+                data[TVoxelIndex(x, y, z)] = TValueData(bench_value_size, (byte)(x + y + z));
+            }
+        }
+    }
+
+    TBenchFile::create(BENCH_FILE, data, KVDB_RESERVED_TABLE_SIZE, kvdb::mortonKeyOrder);
+}
+
+//=====================================================================================
+// sequential and random access
+//=====================================================================================
+
+void run_access_order() {
+    if (!selected("access")) return;
+
+    create_bench_file();
+    TBenchFile kv_file;
+    kv_file.open(BENCH_FILE);
+
+    // values are laid out in Morton order by create()
+    std::vector<TVoxelIndex> keys;
+    for (int x = 0; x < bench_size; x++) {
+        for (int y = 0; y < bench_size; y++) {
+            for (int z = 0; z < bench_size; z++) {
+                keys.push_back(TVoxelIndex(x, y, z));
+            }
+        }
+    }
+    std::sort(keys.begin(), keys.end(), [](const TVoxelIndex &a, const TVoxelIndex &b) {
+        return kvdb::mortonCode(a.X, a.Y, a.Z) < kvdb::mortonCode(b.X, b.Y, b.Z);
+    });
+
+    for (int random = 0; random < 2; random++) {
+        if (random) {
+            std::mt19937 rng(11);
+            std::shuffle(keys.begin(), keys.end(), rng);
+        }
+
+        TLatency latency;
+        auto start = std::chrono::steady_clock::now();
+        for (const auto &k : keys) {
+            latency.measure([&]() {
+                if (kv_file.loadData(k) == nullptr) exit(-1);
+            });
+        }
+        report("access_load", random ? "order=random" : "order=sequential", keys.size() / seconds_since(start), latency);
+    }
+
+    kv_file.close();
+
+    // new keys appended in order or at random
+    for (int random = 0; random < 2; random++) {
+        remove_bench_file();
+        TBenchFile::create_empty(BENCH_FILE);
+        kv_file.open(BENCH_FILE);
+
+        std::mt19937 rng(12);
+        if (random) std::shuffle(keys.begin(), keys.end(), rng);
+
+        const TValueData value(bench_value_size, 1);
+        TLatency latency;
+        auto start = std::chrono::steady_clock::now();
+        for (const auto &k : keys) {
+            latency.measure([&]() { kv_file.save(k, value); });
+        }
+        report("access_save", random ? "order=random" : "order=sequential", keys.size() / seconds_since(start), latency);
+        kv_file.close();
+    }
+
+    remove_bench_file();
+}
+
+//=====================================================================================
+// rewrite of value that fits its extent and value that has to move
+//=====================================================================================
+
+void run_update() {
+    if (!selected("update")) return;
+
+    const int keys = bench_size * bench_size * bench_size;
+
+    // in place, relocate, in place with key table page buffer, partial update of 16 bytes
+    for (int variant = 0; variant < 4; variant++) {
+        const int relocate = variant == 1;
+        create_bench_file();
+        TBenchFile kv_file;
+        if (variant == 2) kv_file.enableTableBuffer();
+        kv_file.enableStats();
+        kv_file.open(BENCH_FILE);
+
+        std::mt19937 rng(13);
+        TLatency latency;
+        ulong64 n = 0;
+        auto start = std::chrono::steady_clock::now();
+        while (seconds_since(start) < bench_seconds) {
+            // every pass over all keys grows values, so they do not fit old extents
+            const size_t size = relocate ? bench_value_size + 64 * (1 + n / keys) : bench_value_size;
+            const TValueData value(size, (byte)n);
+            const int i = (int)(n % keys);
+            const TVoxelIndex k = relocate ? TVoxelIndex(i % bench_size, i / bench_size % bench_size, i / (bench_size * bench_size)) : random_key(rng);
+            if (variant == 3) {
+                const TValueData bytes(16, (byte)n);
+                const ulong64 offset = rng() % (bench_value_size - bytes.size());
+                latency.measure([&]() { kv_file.update(k, offset, bytes); });
+            } else {
+                latency.measure([&]() { kv_file.save(k, value); });
+            }
+            n++;
+        }
+        const kvdb::TFileStats s = kv_file.stats();
+        char writes[64];
+        snprintf(writes, sizeof(writes), " writes_per_op=%.2f bytes_per_op=%.0f", (double)s.writes / std::max<ulong64>(n, 1), (double)s.bytesWritten / std::max<ulong64>(n, 1));
+        const char *path = relocate ? "path=relocate" : (variant == 3 ? "path=partial" : "path=in_place");
+        report("update", std::string(path) + (variant == 2 ? " table_buffer=on" : "") + writes, n / seconds_since(start), latency);
+
+        kv_file.close();
+    }
+
+    remove_bench_file();
+}
+
+//=====================================================================================
+// open time by key count, with index snapshot and with scan of key tables
+//=====================================================================================
+
+void run_open() {
+    if (!selected("open")) return;
+
+    for (int keys : {1000, 10000, 100000}) {
+        remove_bench_file();
+        std::unordered_map<TVoxelIndex, TValueData> data;
+        for (int i = 0; i < keys; i++) {
+            data[TVoxelIndex(i % 100, i / 100 % 100, i / 10000)] = TValueData(16, (byte)i);
+        }
+        TBenchFile::create(BENCH_FILE, data);
+
+        for (int scan = 0; scan < 2; scan++) {
+            TLatency latency;
+            const int rounds = keys >= 100000 ? 5 : 20;
+            auto start = std::chrono::steady_clock::now();
+            for (int r = 0; r < rounds; r++) {
+                TBenchFile kv_file;
+                kv_file.enableIndexSnapshot(scan == 0);
+                latency.measure([&]() { kv_file.open(BENCH_FILE); });
+                kv_file.close();
+            }
+            report("open", "keys=" + std::to_string(keys) + (scan ? " index=scan" : " index=snapshot"), rounds / seconds_since(start), latency);
+        }
+    }
+
+    // key tables added by saves, fixed size or growing
+    for (int growth = 0; growth < 2; growth++) {
+        const int keys = 200000;
+        remove_bench_file();
+        const std::unordered_map<TVoxelIndex, TValueData> empty;
+        TBenchFile::create(BENCH_FILE, empty);
+
+        size_t tables = 0;
+        {
+            TBenchFile kv_file;
+            kv_file.setTableGrowth(KVDB_RESERVED_TABLE_SIZE, growth ? KVDB_TABLE_GROWTH : 1.0);
+            kv_file.open(BENCH_FILE);
+            TBenchFile::TBatch batch;
+            for (int i = 0; i < keys; i++) {
+                batch.put(TVoxelIndex(i % 100, i / 100 % 100, i / 10000), TValueData(16, (byte)i));
+            }
+            kv_file.saveBatch(batch);
+            tables = kv_file.tableCount();
+        }
+
+        TLatency latency;
+        const int rounds = 5;
+        auto start = std::chrono::steady_clock::now();
+        for (int r = 0; r < rounds; r++) {
+            TBenchFile kv_file;
+            kv_file.enableIndexSnapshot(false);
+            latency.measure([&]() { kv_file.open(BENCH_FILE); });
+            kv_file.close();
+        }
+        report("open", "keys=" + std::to_string(keys) + " index=scan tables=" + std::to_string(tables), rounds / seconds_since(start), latency);
+    }
+
+    remove_bench_file();
+}
+
+//=====================================================================================
+// readers and optional writers run for fixed time
+//=====================================================================================
+
+void run_mix(TBenchFile &kv_file, int readers, int writers) {
+    std::atomic<bool> stop{false};
+    std::atomic<ulong64> reads{0};
+    std::atomic<ulong64> writes{0};
+    std::vector<TLatency> read_latency(readers);
+    std::vector<TLatency> write_latency(writers);
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < readers; t++) {
+        threads.emplace_back([&, t]() {
+            std::mt19937 rng(t + 1);
+            ulong64 n = 0;
+            while (!stop.load(std::memory_order_relaxed)) {
+                const TVoxelIndex k = random_key(rng);
+                read_latency[t].measure([&]() {
+                    if (kv_file.loadData(k) == nullptr) {
+                        printf("read failed\n");
+                        exit(-1);
+                    }
+                });
+                n++;
+            }
+            reads += n;
+        });
+    }
+
+    for (int t = 0; t < writers; t++) {
+        threads.emplace_back([&, t]() {
+            std::mt19937 rng(1000 + t);
+            TValueData value(bench_value_size, (byte)t);
+            ulong64 n = 0;
+            while (!stop.load(std::memory_order_relaxed)) {
+                const TVoxelIndex k = random_key(rng);
+                write_latency[t].measure([&]() { kv_file.save(k, value); });
+                n++;
+            }
+            writes += n;
+        });
+    }
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(bench_seconds));
+    stop = true;
+
+    for (auto &th : threads) {
+        th.join();
+    }
+
+    const std::string params = "readers=" + std::to_string(readers) + " writers=" + std::to_string(writers);
+    TLatency all_reads, all_writes;
+    for (auto &l : read_latency) all_reads.merge(l);
+    for (auto &l : write_latency) all_writes.merge(l);
+    report("mix_read", params, reads / bench_seconds, all_reads);
+    if (writers > 0) report("mix_write", params, writes / bench_seconds, all_writes);
+}
+
+void run_mixes(int max_threads) {
+    if (!selected("mix")) return;
+
+    create_bench_file();
+    TBenchFile kv_file;
+    if (kv_file.open(BENCH_FILE) != KVDB_OK) {
+        printf("open failed\n");
+        exit(-1);
+    }
+
+    for (int writers = 0; writers < 2; writers++) {
+        for (int t = 1; t <= max_threads; t *= 2) {
+            run_mix(kv_file, t, writers);
+        }
+    }
+
+    kv_file.close();
+    remove_bench_file();
+}
+
+//=====================================================================================
+// asynchronous loads kept in flight by one thread
+//=====================================================================================
+
+void run_async() {
+    if (!selected("async")) return;
+
+    create_bench_file();
+
+    for (int uring = 1; uring >= 0; uring--) {
+        TBenchFile kv_file;
+        kv_file.enableAsync(0, uring == 1);
+        kv_file.open(BENCH_FILE);
+
+        std::mt19937 rng(3);
+        std::vector<kvdb::TAsync<std::shared_ptr<TValueData>>> loads;
+        TLatency latency; // of batch of 64 loads
+        ulong64 n = 0;
+        auto start = std::chrono::steady_clock::now();
+        while (seconds_since(start) < bench_seconds) {
+            latency.measure([&]() {
+                loads.clear();
+                for (int i = 0; i < 64; i++) {
+                    loads.push_back(kv_file.loadAsync(random_key(rng)));
+                }
+                for (auto &l : loads) {
+                    if (l.get() == nullptr) {
+                        printf("read failed\n");
+                        exit(-1);
+                    }
+                }
+            });
+            n += loads.size();
+        }
+
+        report("async_load", std::string("batch=64 backend=") + (kv_file.isUringActive() ? "io_uring" : "thread_pool"), n / seconds_since(start), latency);
+        kv_file.close();
+    }
+
+    remove_bench_file();
+}
+
+//=====================================================================================
+// cube of keys loaded one by one and with loadMany
+//=====================================================================================
+
+void run_multi_get() {
+    if (!selected("multi_get")) return;
+
+    create_bench_file();
+    TBenchFile kv_file;
+    kv_file.open(BENCH_FILE);
+
+    std::mt19937 rng(5);
+    const int side = 6;
+
+    for (int many = 0; many < 2; many++) {
+        TLatency latency; // of whole cube
+        ulong64 n = 0;
+        auto start = std::chrono::steady_clock::now();
+        while (seconds_since(start) < bench_seconds) {
+            const TVoxelIndex base = TVoxelIndex(rng() % (bench_size - side), rng() % (bench_size - side), rng() % (bench_size - side));
+            std::vector<TVoxelIndex> keys;
+            for (int i = 0; i < side * side * side; i++) {
+                keys.push_back(TVoxelIndex(base.X + i % side, base.Y + i / side % side, base.Z + i / (side * side)));
+            }
+
+            latency.measure([&]() {
+                if (many) {
+                    for (const auto &v : kv_file.loadMany(keys)) {
+                        if (v == nullptr) exit(-1);
+                    }
+                } else {
+                    for (const auto &k : keys) {
+                        if (kv_file.load(k) == nullptr) exit(-1);
+                    }
+                }
+            });
+            n += keys.size();
+        }
+
+        report("multi_get", std::string("keys=216 api=") + (many ? "loadMany" : "load_loop"), n / seconds_since(start), latency);
+    }
+
+    kv_file.close();
+    remove_bench_file();
+}
+
+//=====================================================================================
+// writers on one file and on one shard per writer thread
+//=====================================================================================
+
+typedef kvdb::KvShardedFile<TVoxelIndex, TValueData> TBenchShardedFile;
+
+void run_sharded_writes(int threads, int shards) {
+    const std::unordered_map<TVoxelIndex, TValueData> empty;
+    TBenchShardedFile::create(BENCH_FILE, shards, empty, 1 << 16);
+
+    TBenchShardedFile kv_file(shards);
+    kv_file.open(BENCH_FILE);
+
+    std::atomic<bool> stop{false};
+    std::atomic<ulong64> writes{0};
+    std::vector<TLatency> latency(threads);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&, t]() {
+            std::mt19937 rng(t + 1);
+            TValueData value(bench_value_size, (byte)t);
+            ulong64 n = 0;
+            while (!stop.load(std::memory_order_relaxed)) {
+                const TVoxelIndex k(rng() % 64, rng() % 64, rng() % 64);
+                latency[t].measure([&]() { kv_file.save(k, value); });
+                n++;
+            }
+            writes += n;
+        });
+    }
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(bench_seconds));
+    stop = true;
+    for (auto &w : workers) {
+        w.join();
+    }
+
+    kv_file.close();
+    for (int i = 0; i < shards; i++) {
+        remove_bench_file(TBenchShardedFile::shardPath(BENCH_FILE, i));
+    }
+    std::remove((std::string(BENCH_FILE) + KVDB_SHARD_FILE_EXT).c_str());
+
+    TLatency all;
+    for (auto &l : latency) all.merge(l);
+    report("sharded_write", "threads=" + std::to_string(threads) + " shards=" + std::to_string(shards), writes / bench_seconds, all);
+}
+
+void run_sharded(int max_threads) {
+    if (!selected("sharded")) return;
+
+    for (int t = 1; t <= max_threads; t *= 2) {
+        run_sharded_writes(t, 1);
+        if (t > 1) run_sharded_writes(t, t);
+    }
+}
+
+//=====================================================================================
+// compression ratio and codec throughput on voxel chunks like in test.cpp
+//=====================================================================================
+
+// chunk of 16^3 voxels: stone below surface, air above, some random ore
+TValueData make_voxel_chunk(std::mt19937 &rng, int seed) {
+    TValueData data(16 * 16 * 16);
+    for (int x = 0; x < 16; x++) {
+        for (int z = 0; z < 16; z++) {
+            const int height = 4 + (x * 3 + z * 5 + seed) % 8;
+            for (int y = 0; y < 16; y++) {
+                byte v = (y < height) ? 1 : 0;
+                if (v == 1 && rng() % 50 == 0) v = 2;
+                data[(x * 16 + z) * 16 + y] = v;
+            }
+        }
+    }
+    return data;
+}
+
+void run_compression() {
+    if (!selected("compress") && !selected("decompress")) return;
+
+    std::mt19937 rng(7);
+    std::vector<TValueData> chunks;
+    for (int i = 0; i < 256; i++) {
+        chunks.push_back(make_voxel_chunk(rng, i));
+    }
+
+    std::vector<TValueData> packed(chunks.size());
+    const size_t raw_bytes = chunks.size() * chunks[0].size();
+    size_t packed_bytes = 0;
+
+    TLatency compress_latency;
+    ulong64 n = 0;
+    auto start = std::chrono::steady_clock::now();
+    while (seconds_since(start) < bench_seconds) {
+        for (size_t i = 0; i < chunks.size(); i++) {
+            compress_latency.measure([&]() { kvdb::TLzCodec::compress(chunks[i].data(), chunks[i].size(), packed[i]); });
+        }
+        n += chunks.size();
+    }
+
+    for (const auto &p : packed) {
+        packed_bytes += p.size();
+    }
+    char ratio[32];
+    snprintf(ratio, sizeof(ratio), "%.2f", (double)raw_bytes / packed_bytes);
+    report("compress_codec", std::string("value_size=4096 ratio=") + ratio, n / seconds_since(start), compress_latency);
+
+    TValueData out(chunks[0].size());
+    TLatency decompress_latency;
+    n = 0;
+    start = std::chrono::steady_clock::now();
+    while (seconds_since(start) < bench_seconds) {
+        for (const auto &p : packed) {
+            decompress_latency.measure([&]() { kvdb::TLzCodec::decompress(p.data(), p.size(), out.data(), out.size()); });
+        }
+        n += packed.size();
+    }
+    report("decompress_codec", "value_size=4096", n / seconds_since(start), decompress_latency);
+
+    // same chunks stored with and without compression
+    for (int compress = 0; compress < 2; compress++) {
+        remove_bench_file();
+        const std::unordered_map<TVoxelIndex, TValueData> empty;
+        TBenchFile::create(BENCH_FILE, empty);
+
+        TBenchFile kv_file;
+        kv_file.enableCompression(compress == 1);
+        kv_file.open(BENCH_FILE);
+
+        TBenchFile::TBatch batch;
+        for (int i = 0; i < 4096; i++) {
+            batch.put(TVoxelIndex(i % 16, i / 16 % 16, i / 256), chunks[i % chunks.size()]);
+        }
+        kv_file.saveBatch(batch);
+
+        const size_t file_size = std::filesystem::file_size(BENCH_FILE);
+
+        TLatency latency;
+        n = 0;
+        start = std::chrono::steady_clock::now();
+        while (seconds_since(start) < bench_seconds) {
+            const TVoxelIndex k(rng() % 16, rng() % 16, rng() % 16);
+            latency.measure([&]() {
+                auto ptr = kv_file.loadData(k);
+                if (ptr == nullptr || ptr->size() != chunks[0].size()) {
+                    printf("read failed\n");
+                    exit(-1);
+                }
+            });
+            n++;
+        }
+
+        report("compress_load", std::string("compression=") + (compress ? "on" : "off") + " file_size=" + std::to_string(file_size), n / seconds_since(start), latency);
+
+        kv_file.close();
+    }
+
+    remove_bench_file();
+}
+
+//=====================================================================================
+// log-structured file: overwrites of growing values, loads, open from hints and merge
+//=====================================================================================
+
+void run_log() {
+    if (!selected("log")) return;
+
+    typedef kvdb::KvLogFile<TVoxelIndex, TValueData> TLogFile;
+    const std::string dir = std::string(BENCH_FILE) + ".log";
+    const int keys = bench_size * bench_size * bench_size;
+
+    std::unordered_map<TVoxelIndex, TValueData> data;
+    for (int i = 0; i < keys; i++) {
+        data[TVoxelIndex(i % bench_size, i / bench_size % bench_size, i / (bench_size * bench_size))] = TValueData(bench_value_size, (byte)i);
+    }
+    TLogFile::create(dir, data);
+
+    TLogFile kv_file;
+    kv_file.setSegmentSize(16 << 20);
+    kv_file.open(dir);
+
+    std::mt19937 rng(17);
+    TLatency save_latency;
+    ulong64 n = 0;
+    auto start = std::chrono::steady_clock::now();
+    while (seconds_since(start) < bench_seconds) {
+        const TValueData value(bench_value_size + 64 * (1 + n / keys), (byte)n);
+        const TVoxelIndex k = random_key(rng);
+        save_latency.measure([&]() { kv_file.save(k, value); });
+        n++;
+    }
+    report("log_save", "path=relocate", n / seconds_since(start), save_latency);
+
+    TLatency load_latency;
+    n = 0;
+    start = std::chrono::steady_clock::now();
+    while (seconds_since(start) < bench_seconds) {
+        const TVoxelIndex k = random_key(rng);
+        load_latency.measure([&]() { kv_file.loadData(k); });
+        n++;
+    }
+    report("log_load", "order=random", n / seconds_since(start), load_latency);
+
+    char ratio[32];
+    snprintf(ratio, sizeof(ratio), "%.2f", kv_file.deadRatio());
+    TLatency merge_latency;
+    start = std::chrono::steady_clock::now();
+    merge_latency.measure([&]() { kv_file.merge(); });
+    report("log_merge", std::string("dead_ratio=") + ratio, 1 / seconds_since(start), merge_latency);
+    kv_file.close();
+
+    TLatency open_latency;
+    const int rounds = 10;
+    start = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; r++) {
+        TLogFile f;
+        open_latency.measure([&]() { f.open(dir); });
+    }
+    report("log_open", "keys=" + std::to_string(keys) + " index=hint", rounds / seconds_since(start), open_latency);
+
+    std::filesystem::remove_all(dir);
+}
+
+//=====================================================================================
+// large chunk loads, unaligned, block aligned and aligned with direct I/O
+//=====================================================================================
+
+void run_direct_io() {
+    if (!selected("direct_io")) return;
+
+    const int keys = 2048;
+    const size_t chunk_size = 24 * 1024 + 100;
+    const char *modes[] = { "off", "aligned", "direct" };
+
+    for (int mode = 0; mode < 3; mode++) {
+        remove_bench_file();
+        const std::unordered_map<TVoxelIndex, TValueData> empty;
+        TBenchFile::create(BENCH_FILE, empty, keys);
+
+        TBenchFile kv_file;
+        if (mode == 1) kv_file.setValueAlignment();
+        if (mode == 2) kv_file.enableDirectIo();
+        kv_file.open(BENCH_FILE);
+
+        std::mt19937 rng(23);
+        TLatency save_latency;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < keys; i++) {
+            const TValueData value(chunk_size + rng() % 512, (byte)i);
+            save_latency.measure([&]() { kv_file.save(TVoxelIndex(i % 16, i / 16 % 16, i / 256), value); });
+        }
+        report("direct_io_save", std::string("value=24k alignment=") + modes[mode], keys / seconds_since(start), save_latency);
+
+        TLatency load_latency;
+        ulong64 n = 0;
+        start = std::chrono::steady_clock::now();
+        while (seconds_since(start) < bench_seconds) {
+            const int i = rng() % keys;
+            load_latency.measure([&]() {
+                if (kv_file.load(TVoxelIndex(i % 16, i / 16 % 16, i / 256)) == nullptr) exit(-1);
+            });
+            n++;
+        }
+        report("direct_io_load", std::string("value=24k alignment=") + modes[mode], n / seconds_since(start), load_latency);
+
+        kv_file.close();
+    }
+
+    remove_bench_file();
+}
+
+//=====================================================================================
+// appends to growing values, with geometric capacity and without room to grow
+//=====================================================================================
+
+void run_append() {
+    if (!selected("append")) return;
+
+    const int keys = 512;
+
+    for (int growth = 0; growth < 2; growth++) {
+        remove_bench_file();
+        const std::unordered_map<TVoxelIndex, TValueData> empty;
+        TBenchFile::create(BENCH_FILE, empty, keys);
+
+        TBenchFile kv_file;
+        kv_file.setAppendGrowth(growth ? KVDB_APPEND_GROWTH : 1.0);
+        kv_file.enableStats();
+        kv_file.open(BENCH_FILE);
+
+        const TValueData bytes(64, 1);
+        TLatency latency;
+        ulong64 n = 0;
+        auto start = std::chrono::steady_clock::now();
+        while (seconds_since(start) < bench_seconds && n < keys * 256) {
+            const int i = (int)(n % keys);
+            latency.measure([&]() { kv_file.append(TVoxelIndex(i % 8, i / 8 % 8, i / 64), bytes); });
+            n++;
+        }
+
+        char params[64];
+        snprintf(params, sizeof(params), "growth=%.1f bytes_per_op=%.0f", growth ? KVDB_APPEND_GROWTH : 1.0, (double)kv_file.stats().bytesWritten / std::max<ulong64>(n, 1));
+        report("append", params, n / seconds_since(start), latency);
+
+        kv_file.close();
+    }
+
+    remove_bench_file();
+}
+
+// bench_kvdb [max threads] [--json file] [--filter name prefix]
+int main(int argc, char **argv) {
+    int max_threads = (int)std::thread::hardware_concurrency();
+    std::string json_file;
+
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            json_file = argv[++i];
+        } else if (std::strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            bench_filter = argv[++i];
+        } else {
+            max_threads = atoi(argv[i]);
+        }
+    }
+
+    if (max_threads < 1) {
+        max_threads = 1;
+    }
+
+    printf("\nRun KVDB benchmark, up to %d threads\n\n", max_threads);
+
+    run_size_sweeps();
+    run_access_order();
+    run_update();
+    run_open();
+    run_mixes(max_threads);
+    run_async();
+    run_multi_get();
+    run_sharded(max_threads);
+    run_compression();
+    run_log();
+    run_direct_io();
+    run_append();
+
+    if (!json_file.empty()) {
+        if (!write_json(json_file)) {
+            printf("can't write %s\n", json_file.c_str());
+            return -1;
+        }
+        printf("\nresults: %s\n", json_file.c_str());
+    }
+
+    printf("\n");
+    return 0;
+}
@@ -4,12 +4,18 @@
 #include <string>
 #include <unordered_map>
 #include <bit>
+#include <filesystem>
+#include <thread>
+#include <mutex>
+#include <random>
+#include <coroutine>
 
 #include "../kvdb.hpp"
 #include "VoxelIndex.h"
 
 #define TEST_FILE1 "test1.dat"
 #define TEST_FILE2 "test2.dat"
+#define TEST_FILE3 "test3.dat"
 
 struct TTT {
     double T1 = 0;
@@ -209,7 +215,7 @@ void test3(std::unordered_map<TVoxelIndex, TTestStructItem> &test_data_map) {
     }
 
     print_assert(kv_file.size() == test_data_map.size(), "File size");
-    print_assert(kv_file.reserved() == 999, "Check reserved keys");
+    print_assert(kv_file.reserved() == (size_t)(KVDB_TABLE_GROWTH * KVDB_RESERVED_TABLE_SIZE) - 1, "Check reserved keys"); // second table is larger
 
     printf("=========================== \n\n");
 }
@@ -272,6 +278,95 @@ void test4(std::unordered_map<TVoxelIndex, TTestStructItem> &test_data_map) {
     printf("=========================== \n\n");
 }
 
+//=====================================================================================
+
+void test_mmap(std::unordered_map<TVoxelIndex, TTestStructItem> &test_data_map) {
+    print_test_name("Test#7", "Memory mapped read...");
+
+    std::string file_name = TEST_FILE1;
+
+    kvdb::KvFile<TVoxelIndex, TTT> kv_file;
+    kv_file.enableMmap();
+    bool is_exist = (kv_file.open(file_name) == KVDB_OK);
+    print_assert(is_exist, "Open file");
+
+    bool ok = true;
+    for (const auto &test_pair : test_data_map) {
+        const auto &ti = test_pair.second;
+        auto ref = kv_file.loadRef(ti.key);
+        if (!ref || !(*ref == ti.value)) {
+            ok = false;
+            break;
+        }
+    }
+
+    print_assert(ok, "Check mapped values");
+
+    auto view = kv_file.loadView(TVoxelIndex(0, 1, 2));
+    print_assert(view && view.size() == sizeof(TTT), "Hold view");
+
+    // grow file and force remap
+    for (int i = 0; i < 2000; i++) {
+        TVoxelIndex index(100 + i, 0, 0);
+        TTT test{(double)i, 0, 0, 0};
+        test_data_map[index] = TTestStructItem{index, test, 0};
+        kv_file.save(index, test);
+    }
+
+    auto ref = kv_file.loadRef(TVoxelIndex(2099, 0, 0));
+    print_assert(ref && ref->T1 == 1999, "Read after file growth");
+
+    TTT held;
+    std::memcpy(&held, view.data(), sizeof(TTT));
+    print_assert(held == test_data_map[TVoxelIndex(0, 1, 2)].value, "Old view still valid");
+
+    print_assert(!kv_file.loadView(TVoxelIndex(-100, 0, 0)), "Missing key");
+
+    // mapped view keeps its value while key is rewritten, erased or moved
+    {
+        typedef kvdb::KvFile<TVoxelIndex, TValueData> TFile;
+        std::string view_name = TEST_FILE3;
+        std::remove(view_name.c_str());
+        std::remove((view_name + ".idx").c_str());
+
+        std::unordered_map<TVoxelIndex, TValueData> data;
+        for (int i = 0; i < 100; i++) data[TVoxelIndex(i, 0, 0)] = TValueData(64, (byte)i);
+        TFile::create(view_name, data);
+
+        TFile view_file;
+        view_file.enableMmap();
+        view_file.enableStats();
+        view_file.open(view_name);
+        kvdb::TValueView views[3] = { view_file.loadView(TVoxelIndex(1, 0, 0)), view_file.loadView(TVoxelIndex(2, 0, 0)), view_file.loadView(TVoxelIndex(99, 0, 0)) };
+
+        view_file.save(TVoxelIndex(1, 0, 0), TValueData(64, 201));
+        view_file.erase(TVoxelIndex(2, 0, 0));
+        view_file.save(TVoxelIndex(200, 0, 0), TValueData(64, 202));
+        for (int i = 10; i < 60; i++) view_file.erase(TVoxelIndex(i, 0, 0));
+        view_file.compact();
+
+        bool same = true;
+        const byte expected[3] = { 1, 2, 99 };
+        for (int n = 0; n < 3; n++) {
+            same = same && views[n] && views[n].size() == 64;
+            for (size_t i = 0; same && i < views[n].size(); i++) same = views[n].data()[i] == expected[n];
+        }
+        auto changed = view_file.load(TVoxelIndex(1, 0, 0));
+        print_assert(same && changed && (*changed)[0] == 201 && !view_file.isExist(TVoxelIndex(2, 0, 0)), "View keeps value after writes");
+
+        for (auto &v : views) v = kvdb::TValueView();
+        view_file.resetStats();
+        view_file.save(TVoxelIndex(3, 0, 0), TValueData(64, 203));
+        print_assert(view_file.stats().relocations == 0, "Released view allows rewrite in place");
+
+        view_file.close();
+        std::remove(view_name.c_str());
+        std::remove((view_name + ".idx").c_str());
+    }
+
+    printf("=========================== \n\n");
+}
+
 //=====================================================================================
 // test null values
 //=====================================================================================
@@ -500,30 +595,2259 @@ void test_big1(std::unordered_map<TVoxelIndex, TTestDataItem> test_data_map) {
 
 //=====================================================================================
 
-int main() {
+bool check_data(const kvdb::KvFile<TVoxelIndex, TValueData> &kv_file, const std::unordered_map<TVoxelIndex, TValueData> &test_map) {
+    if (kv_file.size() != test_map.size()) {
+        printf("size: %d %d\n", (int)kv_file.size(), (int)test_map.size());
+        return false;
+    }
 
-    if constexpr (std::endian::native == std::endian::big)
-        std::cout << "big-endian\n";
-    else if constexpr (std::endian::native == std::endian::little)
-        std::cout << "little-endian\n";
-    else
-        std::cout << "mixed-endian\n";
+    for (const auto &a : test_map) {
+        const auto ptr = kv_file.load(a.first);
+        if (ptr == nullptr || *ptr != a.second) {
+            printf("key: %d %d %d \n", a.first.X, a.first.Y, a.first.Z);
+            return false;
+        }
+    }
 
-    printf("\nRun KVDB tests... \n\n");
+    return true;
+}
 
-    // basic functionality
-    std::unordered_map<TVoxelIndex, TTestStructItem> test_data_map;
-    test1(test_data_map);
-    test2(test_data_map);
-    test3(test_data_map);
-    test4(test_data_map);
+void test_batch() {
+    print_test_name("Test#8", "Write batch...");
 
-    // keys with zero length values
-    std::unordered_map<TVoxelIndex, TTestDataItem> test_data_map2;
-    test_null_val1(test_data_map2);
+    std::string file_name = TEST_FILE3;
+    std::remove(file_name.c_str());
 
-    std::unordered_map<TVoxelIndex, TTestDataItem> test_data_map3;
-    test_big1(test_data_map3);
+    const std::unordered_map<TVoxelIndex, TValueData> empty;
+    kvdb::KvFile<TVoxelIndex, TValueData>::create(file_name, empty);
+
+    std::unordered_map<TVoxelIndex, TValueData> test_map;
+
+    {
+        kvdb::KvFile<TVoxelIndex, TValueData> kv_file;
+        print_assert(kv_file.open(file_name) == KVDB_OK, "Open file");
+
+        kvdb::KvFile<TVoxelIndex, TValueData>::TBatch batch;
+        for (int i = 0; i < 2500; i++) {
+            TVoxelIndex index(i, 0, 0);
+            TValueData data;
+            make_test_data(data, 10 + i % 50);
+            batch.put(index, data, i);
+            test_map[index] = data;
+        }
+
+        kv_file.saveBatch(batch);
+        print_assert(check_data(kv_file, test_map), "Check batch values");
+
+        batch.clear();
+        for (int i = 0; i < 2500; i += 3) {
+            TVoxelIndex index(i, 0, 0);
+            if (i % 2 == 0) {
+                batch.erase(index);
+                test_map.erase(index);
+            } else {
+                TValueData data;
+                make_test_data(data, 200); // grow, relocate
+                batch.put(index, data);
+                test_map[index] = data;
+            }
+        }
+
+        // same key twice, last wins
+        TValueData first(5, 1);
+        TValueData second(7, 2);
+        batch.put(TVoxelIndex(-1, -1, -1), first);
+        batch.put(TVoxelIndex(-1, -1, -1), second);
+        test_map[TVoxelIndex(-1, -1, -1)] = second;
+
+        kv_file.saveBatch(batch);
+        print_assert(check_data(kv_file, test_map), "Check changed values");
+    }
+
+    kvdb::KvFile<TVoxelIndex, TValueData> kv_file;
+    print_assert(kv_file.open(file_name) == KVDB_OK, "Reopen file");
+    print_assert(check_data(kv_file, test_map), "Check values after reopen");
+
+    printf("=========================== \n\n");
+}
+
+//=====================================================================================
+
+void test_free_space() {
+    print_test_name("Test#9", "Free space reuse...");
+
+    typedef kvdb::KvFile<TVoxelIndex, TValueData> TFile;
+
+    std::string file_name = TEST_FILE3;
+    std::remove(file_name.c_str());
+
+    const std::unordered_map<TVoxelIndex, TValueData> empty;
+    TFile::create(file_name, empty);
+
+    TFile kv_file;
+    print_assert(kv_file.open(file_name) == KVDB_OK, "Open file");
+
+    std::unordered_map<TVoxelIndex, TValueData> test_map;
+    for (int i = 0; i < 6; i++) {
+        TValueData data((i == 1) ? 200 : 500, (byte)i);
+        test_map[TVoxelIndex(i, 0, 0)] = data;
+        kv_file.save(TVoxelIndex(i, 0, 0), data);
+    }
+
+    // 1000 byte hole from two adjacent extents
+    kv_file.erase(TVoxelIndex(3, 0, 0));
+    kv_file.erase(TVoxelIndex(4, 0, 0));
+    test_map.erase(TVoxelIndex(3, 0, 0));
+    test_map.erase(TVoxelIndex(4, 0, 0));
+    print_assert(kv_file.deleted() == 1, "Merge adjacent extents");
+
+    // 200 byte hole
+    kv_file.erase(TVoxelIndex(1, 0, 0));
+    test_map.erase(TVoxelIndex(1, 0, 0));
+    print_assert(kv_file.deleted() == 2, "Separate extents");
+
+    TValueData small(150, 10);
+    kv_file.save(TVoxelIndex(10, 0, 0), small);
+    test_map[TVoxelIndex(10, 0, 0)] = small;
+
+    std::vector<kvdb::TKeyEntry> active, reserve, deleted;
+    kv_file.info(active, reserve, deleted);
+    print_assert(deleted.size() == 1 && deleted[0].header.initialDataLength == 1000, "Best fit");
+
+    TValueData medium(300, 11);
+    kv_file.save(TVoxelIndex(11, 0, 0), medium);
+    test_map[TVoxelIndex(11, 0, 0)] = medium;
+
+    kv_file.info(active, reserve, deleted);
+    print_assert(deleted.size() == 1 && deleted[0].header.initialDataLength == 700, "Split extent");
+
+    print_assert(check_data(kv_file, test_map), "Check values");
+
+    // churn: grow and shrink values
+    for (int round = 0; round < 50; round++) {
+        for (int i = 0; i < 20; i++) {
+            TValueData data;
+            make_test_data(data, 100 + rand() % 1000);
+            test_map[TVoxelIndex(100 + i, 0, 0)] = data;
+            kv_file.save(TVoxelIndex(100 + i, 0, 0), data);
+        }
+    }
+
+    kv_file.close();
+
+    const auto file_size = std::filesystem::file_size(file_name);
+    printf("File size after churn: %d \n", (int)file_size);
+    print_assert(file_size < 200000, "File growth is bounded");
+
+    print_assert(kv_file.open(file_name) == KVDB_OK, "Reopen file");
+    print_assert(check_data(kv_file, test_map), "Check values after reopen");
+
+    printf("=========================== \n\n");
+}
+
+//=====================================================================================
+
+void test_compact() {
+    print_test_name("Test#10", "Online compaction...");
+
+    typedef kvdb::KvFile<TVoxelIndex, TValueData> TFile;
+
+    std::string file_name = TEST_FILE3;
+    std::remove(file_name.c_str());
+
+    const std::unordered_map<TVoxelIndex, TValueData> empty;
+    TFile::create(file_name, empty);
+
+    TFile kv_file;
+    kv_file.enableMmap();
+    print_assert(kv_file.open(file_name) == KVDB_OK, "Open file");
+
+    std::unordered_map<TVoxelIndex, TValueData> test_map;
+    for (int i = 0; i < 400; i++) {
+        TValueData data(1000, (byte)i);
+        test_map[TVoxelIndex(i, 0, 0)] = data;
+        kv_file.save(TVoxelIndex(i, 0, 0), data);
+    }
+
+    // free every second value
+    for (int i = 0; i < 400; i += 2) {
+        kv_file.erase(TVoxelIndex(i, 0, 0));
+        test_map.erase(TVoxelIndex(i, 0, 0));
+    }
+
+    const auto size_before = std::filesystem::file_size(file_name);
+
+    {
+        // outstanding view blocks truncation
+        auto view = kv_file.loadView(TVoxelIndex(399, 0, 0));
+        auto r = kv_file.compact(10000);
+        print_assert(r.valuesMoved == 10 && r.bytesReclaimed == 0 && !r.done, "Rate limited step");
+        print_assert(view && view.data()[0] == (byte)399, "View survives compaction");
+    }
+
+    kvdb::TCompactResult total;
+    do {
+        auto r = kv_file.compact(50000);
+        total.bytesReclaimed += r.bytesReclaimed;
+        total.done = r.done;
+    } while (!total.done);
+
+    const auto size_after = std::filesystem::file_size(file_name);
+    printf("File size: %d -> %d, reclaimed: %d \n", (int)size_before, (int)size_after, (int)total.bytesReclaimed);
+
+    print_assert(total.bytesReclaimed >= 190000 && size_before - size_after == total.bytesReclaimed, "Reclaimed space");
+    print_assert(kv_file.deadBytes() == 0, "No dead space");
+    print_assert(check_data(kv_file, test_map), "Check values");
+
+    kv_file.close();
+    print_assert(kv_file.open(file_name) == KVDB_OK, "Reopen file");
+    print_assert(check_data(kv_file, test_map), "Check values after reopen");
+
+    printf("=========================== \n\n");
+}
+
+//=====================================================================================
+
+void test_index_snapshot() {
+    print_test_name("Test#11", "Index snapshot...");
+
+    typedef kvdb::KvFile<TVoxelIndex, TValueData> TFile;
+
+    std::string file_name = TEST_FILE3;
+    std::string copy_name = std::string(TEST_FILE3) + ".copy";
+    std::remove(file_name.c_str());
+    std::remove(copy_name.c_str());
+    std::remove((copy_name + ".idx").c_str());
+
+    const std::unordered_map<TVoxelIndex, TValueData> empty;
+    TFile::create(file_name, empty);
+
+    std::unordered_map<TVoxelIndex, TValueData> test_map;
+
+    {
+        TFile kv_file;
+        kv_file.enableIndexSnapshot();
+        print_assert(kv_file.open(file_name) == KVDB_OK, "Open file");
+        print_assert(!kv_file.isIndexLoaded(), "New file has no snapshot");
+
+        for (int i = 0; i < 3000; i++) {
+            TValueData data(10 + i % 100, (byte)i);
+            test_map[TVoxelIndex(i, 1, 1)] = data;
+            kv_file.save(TVoxelIndex(i, 1, 1), data, i);
+        }
+
+        for (int i = 0; i < 3000; i += 7) {
+            kv_file.erase(TVoxelIndex(i, 1, 1));
+            test_map.erase(TVoxelIndex(i, 1, 1));
+        }
+    }
+
+    size_t reserved, deleted;
+
+    {
+        TFile kv_file;
+        kv_file.enableIndexSnapshot();
+        print_assert(kv_file.open(file_name) == KVDB_OK, "Open file");
+        print_assert(kv_file.isIndexLoaded(), "Snapshot loaded");
+        print_assert(check_data(kv_file, test_map), "Check values");
+
+        TValueData data(50, 1);
+        kv_file.save(TVoxelIndex(-1, -1, -1), data);
+        test_map[TVoxelIndex(-1, -1, -1)] = data;
+        reserved = kv_file.reserved();
+        deleted = kv_file.deleted();
+
+        // copy of modified file without close, like after crash
+        std::filesystem::copy_file(file_name, copy_name);
+        std::filesystem::copy_file(file_name + ".idx", copy_name + ".idx");
+    }
+
+    {
+        TFile kv_file;
+        kv_file.enableIndexSnapshot();
+        print_assert(kv_file.open(copy_name) == KVDB_OK, "Open copy");
+        print_assert(!kv_file.isIndexLoaded(), "Stale snapshot ignored");
+        print_assert(check_data(kv_file, test_map), "Check values");
+    }
+
+    {
+        TFile kv_file;
+        kv_file.enableIndexSnapshot(false);
+        print_assert(kv_file.open(file_name) == KVDB_OK, "Open with table scan");
+        print_assert(!kv_file.isIndexLoaded(), "Snapshot not used");
+        print_assert(check_data(kv_file, test_map), "Check values");
+        print_assert(kv_file.reserved() == reserved && kv_file.deleted() == deleted, "Same free lists");
+    }
+
+    // damaged counts in header: no allocation of garbage size, tables are scanned
+    {
+        std::fstream f(file_name + ".idx", std::ios::in | std::ios::out | std::ios::binary);
+        const ulong64 huge = 1ULL << 60;
+        f.seekp(offsetof(kvdb::TIndexHeader, liveCount));
+        f.write((const char *)&huge, sizeof(huge));
+    }
+
+    {
+        TFile kv_file;
+        kv_file.enableIndexSnapshot();
+        print_assert(kv_file.open(file_name) == KVDB_OK && !kv_file.isIndexLoaded() && check_data(kv_file, test_map), "Damaged snapshot ignored");
+    }
+
+    // snapshot is off unless enabled
+    std::remove((file_name + ".idx").c_str());
+    bool opened = false;
+    {
+        TFile kv_file;
+        opened = kv_file.open(file_name) == KVDB_OK;
+        kv_file.save(TVoxelIndex(-2, -2, -2), TValueData(10, 2));
+    }
+    print_assert(opened && !std::filesystem::exists(file_name + ".idx"), "Snapshot off by default");
+
+    std::remove(copy_name.c_str());
+    std::remove((copy_name + ".idx").c_str());
+
+    printf("=========================== \n\n");
+}
+
+//=====================================================================================
+
+void test_wal() {
+    print_test_name("Test#12", "Write-ahead log...");
+
+    typedef kvdb::KvFile<TVoxelIndex, TValueData> TFile;
+
+    std::string file_name = TEST_FILE3;
+    std::string crash_name = std::string(TEST_FILE3) + ".crash";
+    std::remove(file_name.c_str());
+    std::remove((file_name + ".wal").c_str());
+    std::remove(crash_name.c_str());
+    std::remove((crash_name + ".wal").c_str());
+
+    const std::unordered_map<TVoxelIndex, TValueData> empty;
+    TFile::create(file_name, empty);
+
+    // data file before any write
+    std::filesystem::copy_file(file_name, crash_name);
+
+    std::unordered_map<TVoxelIndex, TValueData> test_map;
+
+    {
+        TFile kv_file;
+        kv_file.enableWal(KVDB_DURABILITY_COMMIT);
+        print_assert(kv_file.open(file_name) == KVDB_OK, "Open file");
+
+        std::vector<std::thread> threads;
+        std::mutex map_mutex;
+        for (int t = 0; t < 4; t++) {
+            threads.emplace_back([&, t]() {
+                for (int i = 0; i < 100; i++) {
+                    TVoxelIndex index(i, t, 0);
+                    TValueData data(20 + i, (byte)(i + t));
+                    kv_file.save(index, data, i);
+                    std::lock_guard<std::mutex> guard(map_mutex);
+                    test_map[index] = data;
+                }
+            });
+        }
+
+        for (auto &th : threads) {
+            th.join();
+        }
+
+        TFile::TBatch batch;
+        for (int i = 0; i < 100; i += 2) {
+            batch.erase(TVoxelIndex(i, 0, 0));
+            test_map.erase(TVoxelIndex(i, 0, 0));
+        }
+        kv_file.saveBatch(batch);
+
+        const int commits = 4 * 100 + 1; // saves and batch
+        printf("Commits: %d, log syncs: %d \n", commits, (int)kv_file.walSyncCount());
+        print_assert(kv_file.walSyncCount() > 0 && kv_file.walSyncCount() <= commits, "Log synced");
+        print_assert(check_data(kv_file, test_map), "Check values");
+
+        // log of unclean shutdown with torn last record
+        std::filesystem::copy_file(file_name + ".wal", crash_name + ".wal");
+        std::ofstream torn(crash_name + ".wal", std::ios::out | std::ios::binary | std::ios::app);
+        torn.write("\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0a\x0b\x0c\x0d\x0e\x0f\x10\x11\x12\x13\x14\x15\x16\x17\x18\x19\x1a\x1b\x1c\x1d\x1e\x1f\x20\x21\x22\x23", 35);
+    }
+
+    print_assert(std::filesystem::file_size(file_name + ".wal") == 0, "Log emptied on close");
+
+    {
+        TFile kv_file;
+        kv_file.enableWal(KVDB_DURABILITY_PERIODIC, 10);
+        print_assert(kv_file.open(crash_name) == KVDB_OK, "Open after crash");
+        print_assert(check_data(kv_file, test_map), "Log replayed");
+    }
+
+    {
+        TFile kv_file;
+        print_assert(kv_file.open(crash_name) == KVDB_OK, "Reopen without log");
+        print_assert(check_data(kv_file, test_map), "Check values");
+    }
+
+    std::remove(crash_name.c_str());
+    std::remove((crash_name + ".wal").c_str());
+    std::remove((crash_name + ".idx").c_str());
+
+    printf("=========================== \n\n");
+}
+
+//=====================================================================================
+// index memory and dense key map after many erases
+//=====================================================================================
+
+void test_index_memory() {
+    print_test_name("Test#13", "Index memory...");
+
+    typedef kvdb::KvFile<TVoxelIndex, TValueData> TFile;
+
+    std::string file_name = TEST_FILE3;
+    std::remove(file_name.c_str());
+    std::remove((file_name + ".idx").c_str());
+
+    const std::unordered_map<TVoxelIndex, TValueData> empty;
+    TFile::create(file_name, empty);
+
+    std::unordered_map<TVoxelIndex, TValueData> test_map;
+    const int n = 50000;
+
+    TFile kv_file;
+    kv_file.enableIndexSnapshot(false);
+    print_assert(kv_file.open(file_name) == KVDB_OK, "Open file");
+
+    TFile::TBatch batch;
+    for (int i = 0; i < n; i++) {
+        TValueData data(4, (byte)i);
+        test_map[TVoxelIndex(i, -i, i % 17)] = data;
+        batch.put(TVoxelIndex(i, -i, i % 17), data);
+    }
+    kv_file.saveBatch(batch);
+
+    const size_t per_key = kv_file.memoryUsage() / n;
+    printf("index bytes per key: %zu\n", per_key);
+    print_assert(per_key < 100, "Index bytes per key");
+
+    for (int i = 0; i < n; i += 3) {
+        kv_file.erase(TVoxelIndex(i, -i, i % 17));
+        test_map.erase(TVoxelIndex(i, -i, i % 17));
+    }
+
+    print_assert(check_data(kv_file, test_map), "Check values after erase");
+    kv_file.close();
+
+    print_assert(kv_file.open(file_name) == KVDB_OK, "Reopen file");
+    print_assert(check_data(kv_file, test_map), "Check values after reopen");
+    kv_file.close();
+
+    std::remove(file_name.c_str());
+
+    printf("=========================== \n\n");
+}
+
+//=====================================================================================
+// value cache hits, invalidation and scan resistance
+//=====================================================================================
+
+void test_cache() {
+    print_test_name("Test#14", "Value cache...");
+
+    typedef kvdb::KvFile<TVoxelIndex, TValueData> TFile;
+
+    std::string file_name = TEST_FILE3;
+    std::remove(file_name.c_str());
+    std::remove((file_name + ".idx").c_str());
+
+    const std::unordered_map<TVoxelIndex, TValueData> empty;
+    TFile::create(file_name, empty);
+
+    TFile kv_file;
+    kv_file.enableCache(64 * 1024);
+    print_assert(kv_file.open(file_name) == KVDB_OK, "Open file");
+
+    for (int i = 0; i < 1000; i++) {
+        kv_file.save(TVoxelIndex(i, 0, 0), TValueData(1000, (byte)i));
+    }
+
+    auto first = kv_file.loadData(TVoxelIndex(1, 0, 0));
+    auto second = kv_file.loadData(TVoxelIndex(1, 0, 0));
+    kvdb::TCacheStats stats = kv_file.cacheStats();
+    print_assert(stats.hits == 1 && stats.misses == 1, "Second load is hit");
+    print_assert(first == second, "Cached buffer is shared");
+
+    kv_file.save(TVoxelIndex(1, 0, 0), TValueData(10, 77));
+    auto changed = kv_file.loadData(TVoxelIndex(1, 0, 0));
+    print_assert(changed != nullptr && *changed == TValueData(10, 77), "Save invalidates cache");
+    print_assert((*first)[0] == 1, "Old buffer is not changed");
+
+    kv_file.erase(TVoxelIndex(1, 0, 0));
+    print_assert(kv_file.loadData(TVoxelIndex(1, 0, 0)) == nullptr, "Erase invalidates cache");
+
+    // hot values are read twice, then a scan over all values runs once
+    for (int n = 0; n < 2; n++) {
+        for (int i = 2; i < 12; i++) kv_file.loadData(TVoxelIndex(i, 0, 0));
+    }
+
+    for (int i = 100; i < 1000; i++) {
+        auto ptr = kv_file.loadData(TVoxelIndex(i, 0, 0));
+        if (ptr == nullptr || (*ptr)[0] != (byte)i) {
+            print_assert(false, "Check scanned value");
+        }
+    }
+
+    stats = kv_file.cacheStats();
+    print_assert(stats.evictions > 0, "Values evicted");
+    print_assert(stats.bytes <= 64 * 1024, "Cache within budget");
+
+    kv_file.resetCacheStats();
+    for (int i = 2; i < 12; i++) kv_file.loadData(TVoxelIndex(i, 0, 0));
+    print_assert(kv_file.cacheStats().hits == 10, "Hot values survive scan");
+
+    // larger cache is split into shards
+    kv_file.enableCache(4 << 20);
+    print_assert(kv_file.cacheStats().entries == 0, "Resized cache starts empty");
+    for (int n = 0; n < 2; n++) {
+        for (int i = 2; i < 1000; i++) kv_file.loadData(TVoxelIndex(i, 0, 0));
+    }
+    stats = kv_file.cacheStats();
+    print_assert(stats.entries == 998 && stats.hits >= 10 + 998, "Sharded cache keeps all values");
+
+    kv_file.save(TVoxelIndex(500, 0, 0), TValueData(10, 55));
+    auto shardValue = kv_file.loadData(TVoxelIndex(500, 0, 0));
+    print_assert(shardValue != nullptr && *shardValue == TValueData(10, 55), "Save invalidates sharded cache");
+
+    kv_file.close();
+    std::remove(file_name.c_str());
+    std::remove((file_name + ".idx").c_str());
+
+    printf("=========================== \n\n");
+}
+
+//=====================================================================================
+// compressed values
+//=====================================================================================
+
+// chunk of 16^3 voxels: stone below surface, air above, some random ore
+TValueData make_voxel_chunk(int seed) {
+    TValueData data(16 * 16 * 16);
+    for (int x = 0; x < 16; x++) {
+        for (int z = 0; z < 16; z++) {
+            const int height = 4 + (x * 3 + z * 5 + seed) % 8;
+            for (int y = 0; y < 16; y++) {
+                byte v = (y < height) ? 1 : 0;
+                if (v == 1 && rand() % 50 == 0) v = 2;
+                data[(x * 16 + z) * 16 + y] = v;
+            }
+        }
+    }
+    return data;
+}
+
+void test_compression() {
+    print_test_name("Test#15", "Value compression...");
+
+    typedef kvdb::KvFile<TVoxelIndex, TValueData> TFile;
+
+    // codec round trip
+    bool codec_ok = true;
+    for (int n = 0; n < 200; n++) {
+        TValueData raw(rand() % 5000);
+        const int period = 1 + rand() % 40;
+        for (size_t i = 0; i < raw.size(); i++) raw[i] = (n % 3 == 0) ? (byte)rand() : (byte)(i % period);
+
+        TValueData packed;
+        if (kvdb::TLzCodec::compress(raw.data(), raw.size(), packed)) {
+            TValueData unpacked(kvdb::TLzCodec::rawSize(packed.data(), packed.size()));
+            codec_ok = codec_ok && kvdb::TLzCodec::decompress(packed.data(), packed.size(), unpacked.data(), unpacked.size()) && unpacked == raw;
+
+            packed.resize(packed.size() - 1); // truncated input must be rejected
+            codec_ok = codec_ok && !kvdb::TLzCodec::decompress(packed.data(), packed.size(), unpacked.data(), unpacked.size());
+        }
+    }
+    print_assert(codec_ok, "Codec round trip");
+
+    std::string file_name = TEST_FILE3;
+    std::remove(file_name.c_str());
+    std::remove((file_name + ".idx").c_str());
+
+    const std::unordered_map<TVoxelIndex, TValueData> empty;
+    TFile::create(file_name, empty);
+
+    std::unordered_map<TVoxelIndex, TValueData> test_map;
+    size_t raw_bytes = 0;
+
+    {
+        TFile kv_file;
+        kv_file.enableCompression();
+        print_assert(kv_file.open(file_name) == KVDB_OK, "Open file");
+
+        for (int i = 0; i < 200; i++) {
+            TValueData data;
+            if (i % 10 == 0) {
+                make_test_data(data, 500); // does not compress
+            } else if (i % 10 == 1) {
+                data = TValueData(i % 30, 7); // small
+            } else {
+                data = make_voxel_chunk(i);
+            }
+            raw_bytes += data.size();
+            test_map[TVoxelIndex(i, 2, 3)] = data;
+            kv_file.save(TVoxelIndex(i, 2, 3), data);
+        }
+
+        // compressed value rewritten in place and with bigger value
+        test_map[TVoxelIndex(2, 2, 3)] = TValueData(100, 1);
+        kv_file.save(TVoxelIndex(2, 2, 3), TValueData(100, 1));
+        make_test_data(test_map[TVoxelIndex(3, 2, 3)], 4000);
+        kv_file.save(TVoxelIndex(3, 2, 3), test_map[TVoxelIndex(3, 2, 3)]);
+
+        print_assert(check_data(kv_file, test_map), "Check values");
+    }
+
+    const size_t file_size = std::filesystem::file_size(file_name);
+    printf("raw bytes: %zu  file size: %zu\n", raw_bytes, file_size);
+    print_assert(file_size * 2 < raw_bytes, "File is smaller than raw values");
+
+    {
+        TFile kv_file;
+        kv_file.enableMmap();
+        print_assert(kv_file.open(file_name) == KVDB_OK, "Reopen without compression");
+        print_assert(check_data(kv_file, test_map), "Check values");
+
+        kvdb::TValueView view = kv_file.loadView(TVoxelIndex(5, 2, 3));
+        const TValueData& expected = test_map[TVoxelIndex(5, 2, 3)];
+        print_assert(view.size() == expected.size() && std::memcmp(view.data(), expected.data(), view.size()) == 0, "View of compressed value");
+
+        test_map[TVoxelIndex(4, 2, 3)] = TValueData(300, 9);
+        kv_file.save(TVoxelIndex(4, 2, 3), TValueData(300, 9));
+        print_assert(check_data(kv_file, test_map), "Raw value over compressed one");
+    }
+
+    std::remove(file_name.c_str());
+    std::remove((file_name + ".idx").c_str());
+
+    printf("=========================== \n\n");
+}
+
+//=====================================================================================
+// values of neighbouring keys are placed together
+//=====================================================================================
+
+// every aligned 4x4x4 block of 16^3 region is one contiguous extent
+bool check_clustered(kvdb::KvFile<TVoxelIndex, TValueData> &kv_file, ulong64 value_size) {
+    std::vector<kvdb::TKeyEntry> active, reserve, deleted;
+    kv_file.info(active, reserve, deleted);
+
+    std::unordered_map<TVoxelIndex, ulong64> pos;
+    for (const auto &e : active) {
+        int32_t c[3];
+        std::memcpy(c, e.freeKeyData.data(), sizeof(c));
+        pos[TVoxelIndex(c[0], c[1], c[2])] = e.header.dataPos;
+    }
+
+    for (int bx = 0; bx < 16; bx += 4) {
+        for (int by = 0; by < 16; by += 4) {
+            for (int bz = 0; bz < 16; bz += 4) {
+                ulong64 lo = ULLONG_MAX, hi = 0;
+                for (int i = 0; i < 64; i++) {
+                    const ulong64 p = pos[TVoxelIndex(bx + i % 4, by + i / 4 % 4, bz + i / 16)];
+                    lo = std::min(lo, p);
+                    hi = std::max(hi, p);
+                }
+                if (hi - lo != 63 * value_size) return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+void test_key_order() {
+    print_test_name("Test#16", "Key order placement...");
+
+    typedef kvdb::KvFile<TVoxelIndex, TValueData> TFile;
+
+    std::string file_name = TEST_FILE3;
+    std::remove(file_name.c_str());
+    std::remove((file_name + ".idx").c_str());
+
+    const ulong64 origin = kvdb::mortonCode(0, 0, 0);
+    print_assert(kvdb::mortonCode(1, 0, 0) - origin == 1 && kvdb::mortonCode(0, 1, 0) - origin == 2 && kvdb::mortonCode(0, 0, 1) - origin == 4, "Morton code");
+    print_assert(kvdb::mortonCode(-1, 0, 0) < kvdb::mortonCode(0, 0, 0), "Negative coordinates");
+
+    std::unordered_map<TVoxelIndex, TValueData> test_map;
+    for (int i = 0; i < 4096; i++) {
+        test_map[TVoxelIndex(i % 16, i / 16 % 16, i / 256)] = TValueData(100, (byte)i);
+    }
+
+    TFile::create(file_name, test_map, KVDB_RESERVED_TABLE_SIZE, kvdb::mortonKeyOrder);
+
+    {
+        TFile kv_file;
+        print_assert(kv_file.open(file_name) == KVDB_OK, "Open file");
+        print_assert(check_clustered(kv_file, 100), "Created file is clustered");
+    }
+
+    // region written in random order after filler values, then fillers are erased
+    const std::unordered_map<TVoxelIndex, TValueData> empty;
+    TFile::create(file_name, empty, 10000);
+
+    {
+        TFile kv_file;
+        kv_file.enableIndexSnapshot(false);
+        kv_file.setKeyOrder(kvdb::mortonKeyOrder);
+        print_assert(kv_file.open(file_name) == KVDB_OK, "Open file");
+
+        std::vector<TVoxelIndex> keys;
+        for (const auto &e : test_map) keys.push_back(e.first);
+        std::shuffle(keys.begin(), keys.end(), std::mt19937(1));
+
+        for (size_t i = 0; i < keys.size(); i++) {
+            kv_file.save(TVoxelIndex(1000, 1000, (int)i), TValueData(100, 0));
+        }
+
+        for (size_t i = 0; i < keys.size(); i++) {
+            kv_file.save(keys[i], test_map[keys[i]]);
+        }
+
+        for (size_t i = 0; i < keys.size(); i++) {
+            kv_file.erase(TVoxelIndex(1000, 1000, (int)i));
+        }
+
+        print_assert(!check_clustered(kv_file, 100), "Random writes are scattered");
+
+        while (!kv_file.compact().done) {
+        }
+
+        print_assert(check_clustered(kv_file, 100), "Compacted file is clustered");
+        print_assert(check_data(kv_file, test_map), "Check values");
+    }
+
+    std::remove(file_name.c_str());
+
+    printf("=========================== \n\n");
+}
+
+//=====================================================================================
+// range scans over ordered key index
+//=====================================================================================
+
+std::vector<TVoxelIndex> range_keys(const kvdb::KvFile<TVoxelIndex, TValueData> &kv_file, const TVoxelIndex &lo, const TVoxelIndex &hi) {
+    std::vector<TVoxelIndex> keys;
+    for (const auto &key : kv_file.range(lo, hi)) {
+        keys.push_back(key);
+    }
+    return keys;
+}
+
+void test_range() {
+    print_test_name("Test#17", "Ordered index range scan...");
+
+    typedef kvdb::KvFile<TVoxelIndex, TValueData> TFile;
+
+    std::string file_name = TEST_FILE3;
+    std::remove(file_name.c_str());
+    std::remove((file_name + ".idx").c_str());
+
+    const std::unordered_map<TVoxelIndex, TValueData> empty;
+    TFile::create(file_name, empty);
+
+    TFile kv_file;
+    kv_file.setKeyOrder(kvdb::mortonKeyOrder);
+    kv_file.enableOrderedIndex();
+    print_assert(kv_file.open(file_name) == KVDB_OK, "Open file");
+
+    TFile::TBatch batch;
+    for (int i = 0; i < 4096; i++) {
+        batch.put(TVoxelIndex(i % 16 - 4, i / 16 % 16, i / 256), TValueData(10, (byte)i));
+    }
+    kv_file.saveBatch(batch);
+
+    // every third key of the cube is erased
+    std::vector<TVoxelIndex> expected;
+    for (int x = 0; x < 8; x++) {
+        for (int y = 0; y < 8; y++) {
+            for (int z = 0; z < 8; z++) {
+                if ((x + y + z) % 3 == 0) {
+                    kv_file.erase(TVoxelIndex(x, y, z));
+                } else {
+                    expected.push_back(TVoxelIndex(x, y, z));
+                }
+            }
+        }
+    }
+
+    std::sort(expected.begin(), expected.end(), [](const TVoxelIndex &a, const TVoxelIndex &b) { 
+        return kvdb::mortonCode(a.X, a.Y, a.Z) < kvdb::mortonCode(b.X, b.Y, b.Z); 
+    });
+
+    const TVoxelIndex lo(0, 0, 0), hi(7, 7, 7);
+    std::vector<TVoxelIndex> keys = range_keys(kv_file, lo, hi);
+    print_assert(keys == expected, "Cube keys in Morton order");
+
+    kv_file.enableOrderedIndex(false);
+    print_assert(range_keys(kv_file, lo, hi) == expected, "Same keys without ordered index");
+    kv_file.enableOrderedIndex();
+
+    // writes between batches of one scan
+    size_t n = 0;
+    bool seen_erased = false;
+    for (const auto &key : kv_file.range(TVoxelIndex(-4, 0, 0), TVoxelIndex(11, 15, 15))) {
+        if (n++ == 10) {
+            kv_file.erase(expected.back());
+            kv_file.save(TVoxelIndex(7, 7, 7), TValueData(1, 1));
+        }
+        if (n > 10 && key == expected.back()) seen_erased = true;
+    }
+    print_assert(n > KVDB_RANGE_BATCH && !seen_erased, "Writes during scan");
+
+    kv_file.close();
+    print_assert(kv_file.open(file_name) == KVDB_OK, "Reopen file");
+    expected.pop_back();
+    expected.push_back(TVoxelIndex(7, 7, 7));
+    print_assert(range_keys(kv_file, lo, hi) == expected, "Range after reopen");
+    kv_file.close();
+
+    std::remove(file_name.c_str());
+    std::remove((file_name + ".idx").c_str());
+
+    printf("=========================== \n\n");
+}
+
+//=====================================================================================
+
+// coroutine that starts at once and is not awaited by anybody
+struct TDetachedTask {
+    struct promise_type {
+        TDetachedTask get_return_object() { return {}; }
+        std::suspend_never initial_suspend() { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+typedef kvdb::KvFile<TVoxelIndex, TValueData> TAsyncFile;
+
+TDetachedTask load_chain(TAsyncFile &kv_file, int count, std::atomic<int> &matched, std::atomic<bool> &done) {
+    for (int i = 0; i < count; i++) {
+        auto value = co_await kv_file.loadAsync(TVoxelIndex(i % 16, i / 16 % 16, 0));
+        if (value && value->size() == 100 && (*value)[0] == (byte)i) matched++;
+    }
+    done = true;
+}
+
+// resumes on writer thread, possibly while close() finishes queued saves
+TDetachedTask save_then_query(TAsyncFile &kv_file, std::atomic<bool> &done) {
+    co_await kv_file.saveAsync(TVoxelIndex(2, 2, 2), TValueData(3, 4));
+    kv_file.isUringActive();
+    done = true;
+}
+
+void test_async_file(bool use_uring) {
+    std::string file_name = TEST_FILE3;
+    std::remove(file_name.c_str());
+    std::remove((file_name + ".idx").c_str());
+
+    const std::unordered_map<TVoxelIndex, TValueData> empty;
+    TAsyncFile::create(file_name, empty);
+
+    TAsyncFile kv_file;
+    kv_file.enableAsync(2, use_uring);
+    print_assert(kv_file.open(file_name) == KVDB_OK, "Open file");
+
+    std::vector<kvdb::TAsync<int>> saves;
+    for (int i = 0; i < 256; i++) {
+        saves.push_back(kv_file.saveAsync(TVoxelIndex(i % 16, i / 16, 0), TValueData(100, (byte)i)));
+    }
+    for (auto &s : saves) s.wait();
+    print_assert(saves.back().get() == KVDB_OK && kv_file.loadData(TVoxelIndex(15, 15, 0)) != nullptr, "Save async");
+
+    // later save of same key wins
+    kv_file.saveAsync(TVoxelIndex(0, 0, 1), TValueData(5, 1));
+    kv_file.saveAsync(TVoxelIndex(0, 0, 1), TValueData(7, 2)).wait();
+    auto last = kv_file.loadData(TVoxelIndex(0, 0, 1));
+    print_assert(last && last->size() == 7 && (*last)[0] == 2, "Saves keep order");
+
+    if (use_uring) {
+        print_assert(kv_file.isUringActive(), "io_uring active");
+    } else {
+        print_assert(!kv_file.isUringActive(), "Thread pool");
+    }
+
+    std::vector<kvdb::TAsync<std::shared_ptr<TValueData>>> loads;
+    for (int i = 0; i < 1024; i++) {
+        loads.push_back(kv_file.loadAsync(TVoxelIndex(i % 16, i / 16 % 16, 0)));
+    }
+    bool ok = true;
+    for (int i = 0; i < 1024; i++) {
+        auto v = loads[i].get();
+        ok = ok && v && v->size() == 100 && (*v)[0] == (byte)(i % 256);
+    }
+    print_assert(ok, "Load async");
+    print_assert(kv_file.loadAsync(TVoxelIndex(99, 99, 99)).get() == nullptr, "Missing key");
+
+    std::atomic<int> matched{0};
+    std::atomic<bool> done{false};
+    load_chain(kv_file, 256, matched, done);
+    while (!done) std::this_thread::yield();
+    print_assert(matched == 256, "Coroutine co_await");
+
+    // values are rewritten while loads are in flight, result is old or new value but never mixed
+    kv_file.enableCompression();
+    std::atomic<bool> stop{false};
+    std::thread writer([&]() {
+        for (int n = 0; !stop; n++) {
+            const int i = n % 256;
+            kv_file.save(TVoxelIndex(i % 16, i / 16, 0), TValueData(100 + (n / 256) % 200, (byte)i));
+        }
+    });
+    ok = true;
+    for (int round = 0; round < 20; round++) {
+        loads.clear();
+        for (int i = 0; i < 256; i++) {
+            loads.push_back(kv_file.loadAsync(TVoxelIndex(i % 16, i / 16, 0)));
+        }
+        for (int i = 0; i < 256; i++) {
+            auto v = loads[i].get();
+            ok = ok && v && v->size() >= 100 && std::all_of(v->begin(), v->end(), [i](byte b) { return b == (byte)i; });
+        }
+    }
+    stop = true;
+    writer.join();
+    print_assert(ok, "Load async during writes");
+
+    // pending saves are finished by close, their continuations can use file
+    std::atomic<bool> resumed{false};
+    for (int i = 0; i < 1000; i++) kv_file.saveAsync(TVoxelIndex(1, 1, 1), TValueData(3, 3));
+    save_then_query(kv_file, resumed);
+    kv_file.close();
+    print_assert(resumed && kv_file.open(file_name) == KVDB_OK && kv_file.loadData(TVoxelIndex(1, 1, 1)) != nullptr, "Close waits for saves");
+    kv_file.close();
+
+    std::remove(file_name.c_str());
+    std::remove((file_name + ".idx").c_str());
+}
+
+void test_async() {
+    print_test_name("Test#18", "Asynchronous load and save...");
+
+    test_async_file(true);
+    test_async_file(false);
+
+    printf("=========================== \n\n");
+}
+
+void test_multi_get() {
+    print_test_name("Test#19", "Multi-get...");
+
+    typedef kvdb::KvFile<TVoxelIndex, TValueData> TFile;
+
+    std::string file_name = TEST_FILE3;
+    std::remove(file_name.c_str());
+    std::remove((file_name + ".idx").c_str());
+
+    const std::unordered_map<TVoxelIndex, TValueData> empty;
+    TFile::create(file_name, empty);
+
+    std::mt19937 rng(19);
+    TFile kv_file;
+    kv_file.enableCompression();
+    print_assert(kv_file.open(file_name) == KVDB_OK, "Open file");
+
+    // mix of small, compressible and empty values
+    TFile::TBatch batch;
+    for (int i = 0; i < 2048; i++) {
+        const TVoxelIndex key(i % 16, i / 16 % 16, i / 256);
+        if (i % 7 == 0) {
+            batch.put(key, make_voxel_chunk(i));
+        } else {
+            batch.put(key, TValueData(1 + i % 300, (byte)i));
+        }
+    }
+    kv_file.saveBatch(batch);
+    kv_file.erase(TVoxelIndex(3, 3, 3));
+    kv_file.erase(TVoxelIndex(4, 4, 4));
+
+    // random order with missing and repeated keys
+    std::vector<TVoxelIndex> keys;
+    for (int i = 0; i < 1000; i++) {
+        keys.push_back(TVoxelIndex(rng() % 18, rng() % 16, rng() % 9));
+    }
+    keys.push_back(TVoxelIndex(3, 3, 3));
+    keys.push_back(TVoxelIndex(4, 4, 4));
+    keys.push_back(TVoxelIndex(1, 2, 3));
+    keys.push_back(TVoxelIndex(1, 2, 3));
+
+    auto same_as_load = [&](TFile &f) {
+        auto values = f.loadMany(keys);
+        if (values.size() != keys.size()) return false;
+        for (size_t i = 0; i < keys.size(); i++) {
+            auto v = f.load(keys[i]);
+            if ((v == nullptr) != (values[i] == nullptr)) return false;
+            if (v && *v != *values[i]) return false;
+        }
+        return true;
+    };
+
+    print_assert(same_as_load(kv_file), "Same values as load");
+    auto values = kv_file.loadMany(keys);
+    print_assert(values[keys.size() - 4] == nullptr && values[keys.size() - 3] == nullptr, "Erased keys");
+    print_assert(values.back() && *values.back() == *values[keys.size() - 2], "Repeated key");
+
+    kv_file.enableCache(1 << 20);
+    kv_file.loadMany(keys);
+    print_assert(kv_file.cacheStats().entries > 0 && same_as_load(kv_file), "Values cached");
+    kv_file.close();
+
+    // fixed size values go to one buffer
+    typedef kvdb::KvFile<TVoxelIndex, TTT> TStructFile;
+    std::remove(file_name.c_str());
+    std::remove((file_name + ".idx").c_str());
+
+    std::unordered_map<TVoxelIndex, TTT> items;
+    for (int i = 0; i < 512; i++) {
+        TTT t;
+        t.T1 = i;
+        t.L1 = i * 3;
+        items[TVoxelIndex(i % 8, i / 8 % 8, i / 64)] = t;
+    }
+    TStructFile::create(file_name, items);
+
+    TStructFile struct_file;
+    print_assert(struct_file.open(file_name) == KVDB_OK, "Open struct file");
+
+    std::vector<TVoxelIndex> struct_keys;
+    for (int i = 0; i < 300; i++) {
+        struct_keys.push_back(TVoxelIndex(rng() % 9, rng() % 8, rng() % 8));
+    }
+    std::vector<TTT> out(struct_keys.size());
+    std::vector<bool> found = struct_file.loadMany(struct_keys, out.data());
+
+    bool ok = found.size() == struct_keys.size();
+    for (size_t i = 0; ok && i < struct_keys.size(); i++) {
+        auto it = items.find(struct_keys[i]);
+        ok = (it != items.end()) == found[i] && (!found[i] || out[i] == it->second);
+    }
+    print_assert(ok, "Struct values in one buffer");
+    struct_file.close();
+
+    std::remove(file_name.c_str());
+    std::remove((file_name + ".idx").c_str());
+
+    printf("=========================== \n\n");
+}
+
+void remove_shards(const std::string &file_name, uint32 shards) {
+    for (uint32 i = 0; i < shards; i++) {
+        const std::string path = kvdb::KvShardedFile<TVoxelIndex, TValueData>::shardPath(file_name, i);
+        std::remove(path.c_str());
+        std::remove((path + ".idx").c_str());
+    }
+    std::remove((file_name + KVDB_SHARD_FILE_EXT).c_str());
+}
+
+void test_sharded() {
+    print_test_name("Test#20", "Sharded file...");
+
+    typedef kvdb::KvShardedFile<TVoxelIndex, TValueData> TFile;
+
+    std::string file_name = TEST_FILE3;
+    remove_shards(file_name, 4);
+
+    std::unordered_map<TVoxelIndex, TValueData> data;
+    for (int i = 0; i < 1000; i++) {
+        data[TVoxelIndex(i % 10, i / 10 % 10, i / 100)] = TValueData(20, (byte)i);
+    }
+    print_assert(TFile::create(file_name, 4, data), "Create shards");
+
+    TFile kv_file(4);
+    print_assert(kv_file.open(file_name) == KVDB_OK && kv_file.size() == data.size(), "Open shards");
+
+    bool spread = true;
+    for (uint32 i = 0; i < kv_file.shardCount(); i++) {
+        spread = spread && kv_file.shard(i).size() > 150;
+    }
+    print_assert(spread, "Keys spread over shards");
+
+    // key map tags are the top hash bits, keys of one shard must not share them
+    std::set<uint32> tags;
+    for (const auto &e : data) {
+        const ulong64 h = kvdb::hashKey((const byte*)&e.first, sizeof(e.first));
+        if (kvdb::hashShard((const byte*)&e.first, sizeof(e.first), 4) == 0) tags.insert((uint32)(h >> 57));
+    }
+    print_assert(tags.size() > 96, "Shard keys spread over tags");
+
+    bool ok = true;
+    for (const auto &e : data) {
+        auto v = kv_file.load(e.first);
+        ok = ok && v && *v == e.second;
+    }
+    print_assert(ok, "Load");
+
+    kv_file.save(TVoxelIndex(50, 50, 50), TValueData(5, 5));
+    kv_file.erase(TVoxelIndex(1, 1, 1));
+    print_assert(kv_file.isExist(TVoxelIndex(50, 50, 50)) && !kv_file.isExist(TVoxelIndex(1, 1, 1)), "Save and erase");
+
+    // batch over all shards
+    TFile::TBatch batch;
+    for (int i = 0; i < 200; i++) {
+        batch.put(TVoxelIndex(i, -1, 0), TValueData(8, (byte)i));
+    }
+    batch.erase(TVoxelIndex(2, 2, 2));
+    kv_file.saveBatch(batch);
+
+    size_t keys = 0;
+    kv_file.forEachKey([&](TVoxelIndex) { keys++; });
+    print_assert(keys == 1000 + 1 - 2 + 200 && keys == kv_file.size(), "Batch over shards");
+
+    std::vector<TVoxelIndex> many = { TVoxelIndex(5, -1, 0), TVoxelIndex(1, 1, 1), TVoxelIndex(3, 4, 5), TVoxelIndex(199, -1, 0) };
+    auto values = kv_file.loadMany(many);
+    print_assert(values[0] && (*values[0])[0] == 5 && values[1] == nullptr && (*values[2])[0] == (byte)543 && (*values[3])[0] == 199, "Multi-get over shards");
+
+    kv_file.close();
+    print_assert(kv_file.open(file_name) == KVDB_OK && kv_file.size() == keys, "Reopen");
+    kv_file.close();
+
+    TFile wrong_count(5);
+    print_assert(wrong_count.open(file_name) == KVDB_ERROR_SHARD_COUNT, "More shards than created");
+    TFile fewer_shards(3);
+    print_assert(fewer_shards.open(file_name) == KVDB_ERROR_SHARD_COUNT && !fewer_shards.isOpen(), "Fewer shards than created");
+    print_assert(TFile::storedShardCount(file_name) == 4, "Stored shard count");
+
+    for (int n = 0; n < 50; n++) {
+        TFile::TBatch small;
+        for (int i = 0; i < 8; i++) small.put(TVoxelIndex(i, n, -2), TValueData(4, (byte)n));
+        kv_file.open(file_name);
+        kv_file.saveBatch(small);
+        kv_file.close();
+    }
+    print_assert(kv_file.open(file_name) == KVDB_OK && kv_file.size() == keys + 50 * 8 && (*kv_file.load(TVoxelIndex(7, 49, -2)))[0] == 49, "Repeated batches");
+    kv_file.close();
+
+    // neighbours stay together with Morton sharding
+    remove_shards(file_name, 4);
+    TFile::create(file_name, 4, data, KVDB_RESERVED_TABLE_SIZE, kvdb::mortonShard);
+    TFile morton_file(4, kvdb::mortonShard);
+    morton_file.open(file_name);
+    uint32 shards_used = 0;
+    for (uint32 i = 0; i < morton_file.shardCount(); i++) {
+        if (morton_file.shard(i).isExist(TVoxelIndex(0, 0, 0)) || morton_file.shard(i).isExist(TVoxelIndex(7, 7, 7))) shards_used++;
+    }
+    print_assert(shards_used == 1 && morton_file.size() == data.size(), "Morton blocks");
+    morton_file.close();
+
+    remove_shards(file_name, 5);
+
+    printf("=========================== \n\n");
+}
+
+void test_snapshot() {
+    print_test_name("Test#21", "Snapshots...");
+
+    typedef kvdb::KvFile<TVoxelIndex, TValueData> TFile;
+
+    std::string file_name = TEST_FILE3;
+    std::remove(file_name.c_str());
+    std::remove((file_name + ".idx").c_str());
+
+    const std::unordered_map<TVoxelIndex, TValueData> empty;
+    TFile::create(file_name, empty);
+
+    TFile kv_file;
+    print_assert(kv_file.open(file_name) == KVDB_OK, "Open file");
+
+    for (int i = 0; i < 500; i++) {
+        kv_file.save(TVoxelIndex(i, 0, 0), TValueData(300, 1));
+    }
+
+    auto old_values_ok = [](const TFile::TSnapshot &snap) {
+        bool ok = snap.size() == 500;
+        for (int i = 0; ok && i < 500; i++) {
+            auto v = snap.load(TVoxelIndex(i, 0, 0));
+            ok = v && v->size() == 300 && std::all_of(v->begin(), v->end(), [](byte b) { return b == 1; });
+        }
+        return ok && !snap.isExist(TVoxelIndex(0, 1, 0));
+    };
+
+    {
+        TFile::TSnapshot snap = kv_file.snapshot();
+
+        // same size rewrites would go in place without snapshot
+        for (int i = 0; i < 500; i++) {
+            if (i % 5 == 0) {
+                kv_file.erase(TVoxelIndex(i, 0, 0));
+            } else {
+                kv_file.save(TVoxelIndex(i, 0, 0), TValueData(300, 2));
+            }
+            kv_file.save(TVoxelIndex(i, 1, 0), TValueData(100, 3));
+        }
+        print_assert(old_values_ok(snap), "Snapshot keeps old values");
+
+        auto v = kv_file.load(TVoxelIndex(1, 0, 0));
+        print_assert(v && (*v)[0] == 2 && kv_file.size() == 900 && !kv_file.isExist(TVoxelIndex(0, 0, 0)), "File has new values");
+
+        // scan of snapshot while writer rewrites all keys, fixed write count gives same layout every run
+        std::atomic<bool> done{false};
+        std::thread writer([&]() {
+            for (int n = 0; n < 2000; n++) {
+                kv_file.save(TVoxelIndex(n % 500, 0, 0), TValueData(300 + n % 50, (byte)(10 + n % 100)));
+            }
+            done = true;
+        });
+        bool ok = true;
+        for (int round = 0; round < 5 || !done; round++) {
+            ok = ok && old_values_ok(snap);
+            size_t keys = 0;
+            snap.forEachKey([&](TVoxelIndex) { keys++; });
+            ok = ok && keys == 500;
+        }
+        writer.join();
+        print_assert(ok, "Snapshot scan during writes");
+    }
+
+    // extents freed while snapshot was alive are reused now
+    const size_t file_size = std::filesystem::file_size(file_name);
+    for (int i = 0; i < 500; i++) {
+        kv_file.save(TVoxelIndex(i, 2, 0), TValueData(300, 4));
+    }
+    print_assert(kv_file.deleted() > 0 && std::filesystem::file_size(file_name) == file_size, "Free space reused after release");
+
+    auto late = kv_file.snapshot();
+    kv_file.save(TVoxelIndex(1, 0, 0), TValueData(10, 5));
+    kv_file.close();
+    print_assert(kv_file.open(file_name) == KVDB_OK && (*kv_file.load(TVoxelIndex(1, 0, 0)))[0] == 5, "Reopen with released extents");
+    print_assert(late.load(TVoxelIndex(1, 0, 0)) == nullptr && late.load(TVoxelIndex(2, 0, 0)) == nullptr, "Snapshot of previous session");
+    kv_file.enableStats();
+    kv_file.resetStats();
+    kv_file.save(TVoxelIndex(1, 0, 0), TValueData(10, 6));
+    print_assert((*kv_file.load(TVoxelIndex(1, 0, 0)))[0] == 6 && kv_file.stats().relocations == 0, "New session not pinned by old snapshot");
+    kv_file.close();
+    print_assert(late.load(TVoxelIndex(1, 0, 0)) == nullptr, "Snapshot of closed file");
+
+    std::remove(file_name.c_str());
+    std::remove((file_name + ".idx").c_str());
+
+    printf("=========================== \n\n");
+}
+
+void test_stats() {
+    print_test_name("Test#22", "Runtime statistics...");
+
+    typedef kvdb::KvFile<TVoxelIndex, TValueData> TFile;
+
+    std::string file_name = TEST_FILE3;
+    std::remove(file_name.c_str());
+    std::remove((file_name + ".idx").c_str());
+
+    const std::unordered_map<TVoxelIndex, TValueData> empty;
+    TFile::create(file_name, empty);
+
+    TFile kv_file;
+    print_assert(kv_file.open(file_name) == KVDB_OK, "Open file");
+
+    kv_file.save(TVoxelIndex(0, 5, 0), TValueData(300, 1));
+    kvdb::TFileStats s = kv_file.stats();
+    print_assert(s.save.count == 0 && s.writes == 0 && s.reuseMisses == 0, "Counters off by default");
+
+    kv_file.enableStats();
+
+    for (int i = 0; i < 100; i++) {
+        kv_file.save(TVoxelIndex(i, 0, 0), TValueData(300, 1));
+    }
+    s = kv_file.stats();
+    print_assert(s.save.count == 100 && s.reuseMisses == 100 && s.reuseHits == 0 && s.bytesWritten >= 100 * 300 && s.writes >= 200, "Save counters");
+
+    for (int i = 0; i < 100; i++) {
+        kv_file.load(TVoxelIndex(i, 0, 0));
+    }
+    s = kv_file.stats();
+    print_assert(s.load.count == 100 && s.reads == 100 && s.bytesRead == 100 * 300, "Load counters");
+    print_assert(s.load.percentile(0.5) > 0 && s.load.percentile(0.5) <= s.load.percentile(0.999) && s.load.meanNs() > 0, "Latency histogram");
+
+    for (int i = 0; i < 100; i += 2) {
+        kv_file.erase(TVoxelIndex(i, 0, 0));
+    }
+    s = kv_file.stats();
+    print_assert(s.erase.count == 50 && s.freeExtents == 50 && s.freeBytes == 50 * 300 && s.deadRatio > 0 && s.fragmentation > 0.9, "Free space");
+
+    for (int i = 0; i < 10; i++) {
+        kv_file.save(TVoxelIndex(i, 1, 0), TValueData(200, 2));
+    }
+    kv_file.save(TVoxelIndex(1, 0, 0), TValueData(1000, 3));
+    s = kv_file.stats();
+    print_assert(s.reuseHits == 10 && s.relocations == 1, "Reuse and relocation");
+
+    kv_file.resetStats();
+    TFile::TBatch batch;
+    for (int i = 0; i < KVDB_RESERVED_TABLE_SIZE; i++) {
+        batch.put(TVoxelIndex(i, 2, 0), TValueData(16, 4));
+    }
+    kv_file.saveBatch(batch);
+    s = kv_file.stats();
+    print_assert(s.save.count == 0 && s.load.count == 0 && s.batch.count == 1 && s.tablesCreated == 1 && s.fileBytes > 0, "Reset and batch");
+
+    kv_file.close();
+    std::remove(file_name.c_str());
+    std::remove((file_name + ".idx").c_str());
+
+    printf("=========================== \n\n");
+}
+
+void test_log_file() {
+    print_test_name("Test#23", "Log-structured file...");
+
+    typedef kvdb::KvLogFile<TVoxelIndex, TValueData> TFile;
+
+    const std::string dir = "test_log";
+    const std::unordered_map<TVoxelIndex, TValueData> empty;
+    print_assert(TFile::create(dir, empty), "Create store");
+
+    TFile kv_file;
+    kv_file.setSegmentSize(4096);
+    print_assert(kv_file.open(dir) == KVDB_OK, "Open store");
+
+    for (int i = 0; i < 100; i++) {
+        kv_file.save(TVoxelIndex(i, 0, 0), TValueData(100, (unsigned char)i));
+    }
+    for (int i = 0; i < 100; i += 2) {
+        kv_file.save(TVoxelIndex(i, 0, 0), TValueData(50, 0xaa));
+    }
+    for (int i = 1; i < 100; i += 4) {
+        kv_file.erase(TVoxelIndex(i, 0, 0));
+    }
+
+    auto check = [](const TFile& f) {
+        if (f.size() != 75) return false;
+        for (int i = 0; i < 100; i++) {
+            auto v = f.loadData(TVoxelIndex(i, 0, 0));
+            if (i % 4 == 1) {
+                if (v != nullptr) return false;
+            } else if (i % 2 == 0) {
+                if (v == nullptr || *v != TValueData(50, 0xaa)) return false;
+            } else {
+                if (v == nullptr || *v != TValueData(100, (unsigned char)i)) return false;
+            }
+        }
+        return true;
+    };
+
+    print_assert(check(kv_file), "Put, overwrite and erase");
+    print_assert(kv_file.segmentCount() > 1 && kv_file.deadRatio() > 0.3, "Segments rolled over");
+
+    kv_file.close();
+    print_assert(kv_file.open(dir) == KVDB_OK && check(kv_file), "Reopen from hint files");
+
+    print_assert(kv_file.merge() && kv_file.segmentCount() == 2 && kv_file.deadRatio() == 0 && check(kv_file), "Merge sealed segments");
+    kv_file.close();
+    print_assert(kv_file.open(dir) == KVDB_OK && check(kv_file), "Reopen after merge");
+
+    // files not named like segments are skipped
+    const std::string strays[] = { dir + "/backup.seg", dir + "/000000000000zzzz.seg", dir + "/00000000000001.seg" };
+    for (const auto& stray : strays) std::ofstream(stray) << "x";
+    kv_file.close();
+    bool reopened = false;
+    try {
+        reopened = kv_file.open(dir) == KVDB_OK && check(kv_file);
+    } catch (...) {
+    }
+    for (const auto& stray : strays) std::filesystem::remove(stray);
+    print_assert(reopened, "Stray segment names skipped");
+
+    // batch cut in the middle is dropped, earlier batch stays
+    TFile::TBatch batch;
+    batch.put(TVoxelIndex(200, 0, 0), TValueData(10, 1));
+    batch.put(TVoxelIndex(201, 0, 0), TValueData(10, 2));
+    kv_file.saveBatch(batch);
+    kv_file.save(TVoxelIndex(202, 0, 0), TValueData(1000, 3));
+    kv_file.close();
+
+    std::string last;
+    for (const auto& entry : std::filesystem::directory_iterator(dir)) {
+        if (entry.path().extension() == KVDB_LOG_SEGMENT_EXT && entry.path().string() > last) last = entry.path().string();
+        if (entry.path().extension() == KVDB_LOG_HINT_EXT) std::filesystem::remove(entry.path());
+    }
+    std::filesystem::resize_file(last, std::filesystem::file_size(last) - 500);
+
+    print_assert(kv_file.open(dir) == KVDB_OK, "Open with torn tail");
+    print_assert(kv_file.isExist(TVoxelIndex(200, 0, 0)) && kv_file.isExist(TVoxelIndex(201, 0, 0)) && !kv_file.isExist(TVoxelIndex(202, 0, 0)), "Torn record dropped");
+    kv_file.save(TVoxelIndex(203, 0, 0), TValueData(10, 4));
+    kv_file.close();
+    print_assert(kv_file.open(dir) == KVDB_OK && kv_file.size() == 78 && *kv_file.load(TVoxelIndex(203, 0, 0)) == TValueData(10, 4), "Append after recovery");
+    kv_file.close();
+
+    // bad record in sealed segment is reported, segment is not cut
+    std::string first = last;
+    for (const auto& entry : std::filesystem::directory_iterator(dir)) {
+        if (entry.path().extension() == KVDB_LOG_SEGMENT_EXT && entry.path().string() < first) first = entry.path().string();
+        if (entry.path().extension() == KVDB_LOG_HINT_EXT) std::filesystem::remove(entry.path());
+    }
+    const size_t first_size = std::filesystem::file_size(first);
+    auto flip_byte = [&]() {
+        std::fstream f(first, std::ios::in | std::ios::out | std::ios::binary);
+        f.seekg(first_size / 2);
+        char c = (char)f.get();
+        f.seekp(first_size / 2);
+        f.put((char)(c ^ 0xff));
+    };
+    flip_byte();
+    print_assert(first != last && kv_file.open(dir) == KVDB_ERROR_DAMAGED_FILE && !kv_file.isOpen() && std::filesystem::file_size(first) == first_size, "Damaged sealed segment");
+    flip_byte();
+    print_assert(kv_file.open(dir) == KVDB_OK && kv_file.size() == 78, "Open after repair");
+    kv_file.close();
+
+    kv_file.enableMerge(0.3, 10);
+    kv_file.open(dir);
+    for (int n = 0; n < 5; n++) {
+        for (int i = 0; i < 100; i += 2) kv_file.save(TVoxelIndex(i, 0, 0), TValueData(50, 0xaa));
+    }
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (kv_file.deadRatio() >= 0.3 && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    print_assert(kv_file.deadRatio() < 0.3 && kv_file.size() == 78 && *kv_file.load(TVoxelIndex(98, 0, 0)) == TValueData(50, 0xaa), "Background merge");
+
+    // updates and appends are stored as whole values
+    TFile::TBatch patches;
+    patches.update(TVoxelIndex(0, 0, 0), 10, TValueData(5, 1));
+    patches.append(TVoxelIndex(0, 0, 0), TValueData(5, 2));
+    patches.append(TVoxelIndex(300, 0, 0), TValueData(3, 3));
+    patches.update(TVoxelIndex(301, 0, 0), 0, TValueData(3, 4));
+    kv_file.saveBatch(patches);
+
+    TValueData patched(50, 0xaa);
+    std::fill(patched.begin() + 10, patched.begin() + 15, 1);
+    patched.insert(patched.end(), 5, 2);
+    auto check_patched = [&]() {
+        return *kv_file.load(TVoxelIndex(0, 0, 0)) == patched && *kv_file.load(TVoxelIndex(300, 0, 0)) == TValueData(3, 3) && !kv_file.isExist(TVoxelIndex(301, 0, 0));
+    };
+    print_assert(check_patched(), "Updates in batch");
+    kv_file.close();
+    print_assert(kv_file.open(dir) == KVDB_OK && check_patched(), "Updates after reopen");
+
+    kv_file.close();
+    std::filesystem::remove_all(dir);
+
+    printf("=========================== \n\n");
+}
+
+void test_table_buffer() {
+    print_test_name("Test#24", "Key table page buffer...");
+
+    typedef kvdb::KvFile<TVoxelIndex, TValueData> TFile;
+
+    std::string file_name = TEST_FILE3;
+    std::string crash_name = std::string(TEST_FILE3) + ".crash";
+
+    std::unordered_map<TVoxelIndex, TValueData> test_map;
+    for (int i = 0; i < 3000; i++) {
+        test_map[TVoxelIndex(i % 20, i / 20 % 20, i / 400)] = TValueData(64, 1);
+    }
+
+    ulong64 writes[2];
+    for (int buffered = 0; buffered < 2; buffered++) {
+        std::remove(file_name.c_str());
+        std::remove((file_name + ".idx").c_str());
+        TFile::create(file_name, test_map);
+
+        TFile kv_file;
+        if (buffered) kv_file.enableTableBuffer(1 << 20, 60000);
+        kv_file.enableStats();
+        kv_file.open(file_name);
+
+        std::mt19937 rng(5);
+        for (int i = 0; i < 3000; i++) {
+            const int n = rng() % 3000;
+            const TVoxelIndex k(n % 20, n / 20 % 20, n / 400);
+            test_map[k] = TValueData(64, (byte)(i + 2));
+            kv_file.save(k, test_map[k]);
+        }
+        writes[buffered] = kv_file.stats().writes;
+
+        if (buffered) {
+            print_assert(check_data(kv_file, test_map), "Values before flush");
+        }
+    }
+
+    printf("Writes: %d unbuffered, %d buffered \n", (int)writes[0], (int)writes[1]);
+    print_assert(writes[1] * 3 < writes[0] * 2, "Fewer writes");
+
+    {
+        TFile kv_file;
+        kv_file.enableIndexSnapshot(false);
+        print_assert(kv_file.open(file_name) == KVDB_OK && check_data(kv_file, test_map), "Tables written on close");
+    }
+
+    // unflushed pages after crash are restored by log
+    std::remove(crash_name.c_str());
+    std::remove((crash_name + ".wal").c_str());
+    {
+        TFile kv_file;
+        kv_file.enableWal(KVDB_DURABILITY_COMMIT);
+        kv_file.enableTableBuffer(1 << 20, 60000);
+        kv_file.enableIndexSnapshot(false);
+        kv_file.open(file_name);
+
+        std::mt19937 rng(6);
+        for (int i = 0; i < 500; i++) {
+            const int n = rng() % 4000;
+            const TVoxelIndex k(n % 20, n / 20 % 20, n / 400);
+            if (i % 5 == 0) {
+                test_map.erase(k);
+                kv_file.erase(k);
+            } else {
+                test_map[k] = TValueData(32 + rng() % 100, (byte)i);
+                kv_file.save(k, test_map[k]);
+            }
+        }
+
+        std::filesystem::copy_file(file_name, crash_name);
+        std::filesystem::copy_file(file_name + ".wal", crash_name + ".wal");
+    }
+
+    {
+        TFile kv_file;
+        kv_file.enableWal(KVDB_DURABILITY_COMMIT);
+        kv_file.enableIndexSnapshot(false);
+        print_assert(kv_file.open(crash_name) == KVDB_OK && check_data(kv_file, test_map), "Log replayed over stale tables");
+    }
+
+    // extent freed while stale key entry points at it is reused only after pages are written
+    std::remove(file_name.c_str());
+    std::remove(crash_name.c_str());
+    {
+        std::unordered_map<TVoxelIndex, TValueData> start;
+        start[TVoxelIndex(0, 0, 0)] = TValueData(100, 1);
+        TFile::create(file_name, start);
+
+        TFile kv_file;
+        kv_file.enableTableBuffer(1 << 20, 60000);
+        kv_file.enableIndexSnapshot(false);
+        kv_file.open(file_name);
+        kv_file.save(TVoxelIndex(0, 0, 0), TValueData(200, 2));
+        kv_file.save(TVoxelIndex(1, 0, 0), TValueData(100, 3));
+        std::filesystem::copy_file(file_name, crash_name);
+
+        const size_t file_size = std::filesystem::file_size(file_name);
+        kv_file.enableTableBuffer(0);
+        kv_file.save(TVoxelIndex(2, 0, 0), TValueData(100, 4));
+        print_assert(std::filesystem::file_size(file_name) == file_size, "Extent reused after pages are written");
+    }
+
+    {
+        TFile kv_file;
+        kv_file.enableIndexSnapshot(false);
+        auto v = (kv_file.open(crash_name) == KVDB_OK) ? kv_file.load(TVoxelIndex(0, 0, 0)) : nullptr;
+        print_assert(v && (*v == TValueData(100, 1) || *v == TValueData(200, 2)), "Stale entry keeps its value");
+    }
+
+    std::remove(file_name.c_str());
+    std::remove((file_name + ".idx").c_str());
+    std::remove((file_name + ".wal").c_str());
+    std::remove(crash_name.c_str());
+    std::remove((crash_name + ".wal").c_str());
+    std::remove((crash_name + ".idx").c_str());
+
+    printf("=========================== \n\n");
+}
+
+void test_table_directory() {
+    print_test_name("Test#25", "Table growth and table directory...");
+
+    typedef kvdb::KvFile<TVoxelIndex, TValueData> TFile;
+
+    std::string file_name = TEST_FILE3;
+    std::string copy_name = std::string(TEST_FILE3) + ".copy";
+    std::remove(file_name.c_str());
+    std::remove((file_name + ".idx").c_str());
+
+    const std::unordered_map<TVoxelIndex, TValueData> empty;
+    TFile::create(file_name, empty, 10);
+
+    std::unordered_map<TVoxelIndex, TValueData> test_map;
+    {
+        TFile kv_file;
+        kv_file.setTableGrowth(10, 2.0, 1000);
+        kv_file.open(file_name);
+        for (int i = 0; i < 3000; i++) {
+            const TVoxelIndex k(i % 20, i / 20 % 20, i / 400);
+            test_map[k] = TValueData(8, (byte)i);
+            kv_file.save(k, test_map[k]);
+        }
+
+        // 10, 20, 40, ... 640, then 1000 each
+        print_assert(kv_file.tableCount() == 9 && kv_file.reserved() == 3270 - 3000, "Tables grow geometrically");
+    }
+
+    // big tables are not written out as zeros
+    {
+        std::string big_name = std::string(TEST_FILE3) + ".big";
+        TFile::create(big_name, empty, 10);
+        TFile kv_file;
+        kv_file.setTableGrowth(10, 1 << 20, 1 << 20);
+        kv_file.open(big_name);
+        TFile::TBatch batch;
+        for (int i = 0; i < 20; i++) batch.put(TVoxelIndex(i, 0, 0), TValueData(8, (byte)i));
+        kv_file.saveBatch(batch);
+        kv_file.save(TVoxelIndex(0, 1, 0), TValueData(8, 1));
+        const bool grown = kv_file.tableCount() == 2 && kv_file.reserved() == (1 << 20) - 11;
+        kv_file.close();
+
+        struct stat st;
+        const bool sparse = stat(big_name.c_str(), &st) == 0 && (ulong64)st.st_size > (ulong64)(1 << 20) * 20 && (ulong64)st.st_blocks * 512 < (ulong64)st.st_size / 4;
+        print_assert(grown && sparse, "Big table allocated sparse");
+
+        std::unordered_map<TVoxelIndex, TValueData> big_map;
+        for (int i = 0; i < 20; i++) big_map[TVoxelIndex(i, 0, 0)] = TValueData(8, (byte)i);
+        big_map[TVoxelIndex(0, 1, 0)] = TValueData(8, 1);
+        print_assert(kv_file.open(big_name) == KVDB_OK && kv_file.size() == 21 && check_data(kv_file, big_map), "Keys in sparse table");
+        kv_file.close();
+        std::remove(big_name.c_str());
+        std::remove((big_name + ".idx").c_str());
+    }
+
+    {
+        TFile kv_file;
+        kv_file.enableIndexSnapshot(false);
+        print_assert(kv_file.open(file_name) == KVDB_OK && kv_file.isTableDirectoryLoaded(), "Tables found by directory");
+        print_assert(check_data(kv_file, test_map) && kv_file.tableCount() == 9 && kv_file.reserved() == 270, "Check values");
+    }
+
+    auto header_field = [](const std::string &name, size_t offset, ulong64 *set) {
+        std::fstream f(name, std::ios::in | std::ios::out | std::ios::binary);
+        ulong64 value = 0;
+        f.seekg(offset);
+        f.read((char *)&value, sizeof(value));
+        if (set) {
+            f.seekp(offset);
+            f.write((const char *)set, sizeof(ulong64));
+        }
+        return value;
+    };
+
+    // damaged directory: tables are found by links, next new table writes new directory
+    std::remove(copy_name.c_str());
+    std::filesystem::copy_file(file_name, copy_name);
+    const ulong64 directory = header_field(copy_name, offsetof(kvdb::TFileHeader, tableDirectory), nullptr);
+    ulong64 garbage = 12345;
+    header_field(copy_name, directory + offsetof(kvdb::TTableDirectoryHeader, checksum), &garbage);
+
+    {
+        TFile kv_file;
+        kv_file.enableIndexSnapshot(false);
+        print_assert(kv_file.open(copy_name) == KVDB_OK && !kv_file.isTableDirectoryLoaded() && check_data(kv_file, test_map), "Damaged directory ignored");
+
+        for (int i = 3000; i < 3500; i++) {
+            const TVoxelIndex k(i % 20, i / 20 % 20, i / 400);
+            test_map[k] = TValueData(8, (byte)i);
+            kv_file.save(k, test_map[k]);
+        }
+    }
+
+    {
+        TFile kv_file;
+        kv_file.enableIndexSnapshot(false);
+        print_assert(kv_file.open(copy_name) == KVDB_OK && kv_file.isTableDirectoryLoaded() && check_data(kv_file, test_map), "Directory rewritten");
+    }
+
+    // file without directory
+    ulong64 none = 0;
+    header_field(copy_name, offsetof(kvdb::TFileHeader, tableDirectory), &none);
+    {
+        TFile kv_file;
+        kv_file.enableIndexSnapshot(false);
+        print_assert(kv_file.open(copy_name) == KVDB_OK && !kv_file.isTableDirectoryLoaded() && check_data(kv_file, test_map), "Tables found by links");
+    }
+
+    std::remove(file_name.c_str());
+    std::remove((file_name + ".idx").c_str());
+    std::remove(copy_name.c_str());
+    std::remove((copy_name + ".idx").c_str());
+
+    printf("=========================== \n\n");
+}
+
+void test_value_alignment() {
+    print_test_name("Test#26", "Aligned values and direct I/O...");
+
+    typedef kvdb::KvFile<TVoxelIndex, TValueData> TFile;
+
+    std::string file_name = TEST_FILE3;
+    std::remove(file_name.c_str());
+    std::remove((file_name + ".idx").c_str());
+
+    const std::unordered_map<TVoxelIndex, TValueData> empty;
+    TFile::create(file_name, empty, 100);
+
+    auto all_aligned = [](TFile &kv_file) {
+        std::vector<kvdb::TKeyEntry> active, reserve, deleted;
+        kv_file.info(active, reserve, deleted);
+        for (const auto &e : active) {
+            if (e.header.dataLength >= KVDB_VALUE_ALIGNMENT && e.header.dataPos % KVDB_VALUE_ALIGNMENT != 0) return false;
+        }
+        return true;
+    };
+
+    std::unordered_map<TVoxelIndex, TValueData> test_map;
+    {
+        TFile kv_file;
+        kv_file.setValueAlignment();
+        kv_file.open(file_name);
+        for (int i = 0; i < 40; i++) {
+            const TVoxelIndex k(i, 0, 0);
+            test_map[k] = TValueData((i % 2) ? 100 + i : 5000 + i * 300, (byte)i);
+            kv_file.save(k, test_map[k]);
+        }
+        print_assert(all_aligned(kv_file) && check_data(kv_file, test_map), "Large values aligned");
+
+        // freed extents reused only if aligned
+        for (int i = 0; i < 40; i += 4) {
+            kv_file.erase(TVoxelIndex(i, 0, 0));
+            test_map.erase(TVoxelIndex(i, 0, 0));
+        }
+        for (int i = 40; i < 60; i++) {
+            const TVoxelIndex k(i, 0, 0);
+            test_map[k] = TValueData(4096 + i, (byte)i);
+            kv_file.save(k, test_map[k]);
+        }
+        for (int i = 1; i < 40; i += 4) {
+            const TVoxelIndex k(i, 0, 0);
+            test_map[k] = TValueData(6000, (byte)(i + 1));
+            kv_file.save(k, test_map[k]);
+        }
+        print_assert(all_aligned(kv_file) && check_data(kv_file, test_map), "Reuse and overwrite keep alignment");
+    }
+
+    {
+        TFile kv_file;
+        kv_file.enableDirectIo();
+        kv_file.open(file_name);
+        printf("direct I/O active: %d\n", kv_file.isDirectIoActive());
+        print_assert(check_data(kv_file, test_map), "Direct read");
+
+        for (int i = 60; i < 80; i++) {
+            const TVoxelIndex k(i, 0, 0);
+            test_map[k] = TValueData(4096 * (i % 3 + 1) + i, (byte)i);
+            kv_file.save(k, test_map[k]);
+        }
+        for (int i = 0; i < 80; i += 3) {
+            const TVoxelIndex k(i, 0, 0);
+            test_map[k] = TValueData(8000 + i, (byte)(i + 7));
+            kv_file.save(k, test_map[k]);
+        }
+        print_assert(all_aligned(kv_file) && check_data(kv_file, test_map), "Direct write");
+    }
+
+    {
+        TFile kv_file;
+        kv_file.open(file_name);
+        print_assert(check_data(kv_file, test_map), "Check values after reopen");
+    }
+
+    std::remove(file_name.c_str());
+    std::remove((file_name + ".idx").c_str());
+
+    printf("=========================== \n\n");
+}
+
+void test_partial_update() {
+    print_test_name("Test#27", "Partial value update...");
+
+    typedef kvdb::KvFile<TVoxelIndex, TValueData> TFile;
+
+    std::string file_name = TEST_FILE3;
+    std::string crash_name = std::string(TEST_FILE3) + ".crash";
+    std::remove(file_name.c_str());
+    std::remove((file_name + ".idx").c_str());
+
+    auto patch = [](TValueData &v, size_t offset, const TValueData &bytes) {
+        if (v.size() < offset + bytes.size()) v.resize(offset + bytes.size());
+        std::copy(bytes.begin(), bytes.end(), v.begin() + offset);
+    };
+
+    std::unordered_map<TVoxelIndex, TValueData> test_map;
+    for (int i = 0; i < 100; i++) {
+        test_map[TVoxelIndex(i, 0, 0)] = TValueData(4000, (byte)i);
+    }
+    TFile::create(file_name, test_map);
+
+    {
+        TFile kv_file;
+        kv_file.enableStats();
+        kv_file.open(file_name);
+        kv_file.resetStats();
+
+        for (int i = 0; i < 100; i++) {
+            const TValueData bytes(8, (byte)(i + 100));
+            patch(test_map[TVoxelIndex(i, 0, 0)], i * 30, bytes);
+            kv_file.update(TVoxelIndex(i, 0, 0), i * 30, bytes);
+        }
+        kvdb::TFileStats s = kv_file.stats();
+        printf("Bytes written by 100 updates: %d \n", (int)s.bytesWritten);
+        print_assert(s.partialUpdates == 100 && s.relocations == 0 && s.bytesWritten == 100 * 8 && check_data(kv_file, test_map), "Update in place");
+
+        // smaller value keeps its capacity, update grows it in place
+        test_map[TVoxelIndex(1, 0, 0)] = TValueData(1000, 7);
+        kv_file.save(TVoxelIndex(1, 0, 0), test_map[TVoxelIndex(1, 0, 0)]);
+        patch(test_map[TVoxelIndex(1, 0, 0)], 1000, TValueData(500, 8));
+        kv_file.update(TVoxelIndex(1, 0, 0), 1000, TValueData(500, 8));
+
+        // past capacity value is relocated
+        patch(test_map[TVoxelIndex(2, 0, 0)], 3000, TValueData(2000, 9));
+        kv_file.update(TVoxelIndex(2, 0, 0), 3000, TValueData(2000, 9));
+        s = kv_file.stats();
+        print_assert(s.partialUpdates == 101 && s.relocations == 1 && check_data(kv_file, test_map), "Update grows value");
+
+        print_assert(!kv_file.update(TVoxelIndex(3, 0, 0), 4001, TValueData(1, 0)) && !kv_file.update(TVoxelIndex(200, 0, 0), 0, TValueData(1, 0)), "Bad offset and missing key");
+
+        // updates after put of same key in one batch
+        TFile::TBatch batch;
+        batch.put(TVoxelIndex(3, 0, 0), TValueData(100, 1));
+        batch.update(TVoxelIndex(3, 0, 0), 50, TValueData(100, 2));
+        batch.update(TVoxelIndex(3, 0, 0), 0, TValueData(10, 3));
+        batch.update(TVoxelIndex(4, 0, 0), 10, TValueData(10, 4));
+        kv_file.saveBatch(batch);
+        test_map[TVoxelIndex(3, 0, 0)] = TValueData(100, 1);
+        patch(test_map[TVoxelIndex(3, 0, 0)], 50, TValueData(100, 2));
+        patch(test_map[TVoxelIndex(3, 0, 0)], 0, TValueData(10, 3));
+        patch(test_map[TVoxelIndex(4, 0, 0)], 10, TValueData(10, 4));
+        print_assert(check_data(kv_file, test_map), "Updates in batch");
+
+        // snapshot keeps value, update goes to new place
+        {
+            TFile::TSnapshot snap = kv_file.snapshot();
+            const TValueData old = test_map[TVoxelIndex(5, 0, 0)];
+            patch(test_map[TVoxelIndex(5, 0, 0)], 0, TValueData(16, 10));
+            kv_file.update(TVoxelIndex(5, 0, 0), 0, TValueData(16, 10));
+            auto v = snap.load(TVoxelIndex(5, 0, 0));
+            print_assert(v && *v == old && check_data(kv_file, test_map), "Snapshot sees old value");
+        }
+    }
+
+    // compressed values are patched whole
+    {
+        TFile kv_file;
+        kv_file.enableCompression();
+        kv_file.open(file_name);
+        test_map[TVoxelIndex(6, 0, 0)] = TValueData(3000, 1);
+        kv_file.save(TVoxelIndex(6, 0, 0), test_map[TVoxelIndex(6, 0, 0)]);
+        patch(test_map[TVoxelIndex(6, 0, 0)], 2990, TValueData(20, 2));
+        print_assert(kv_file.update(TVoxelIndex(6, 0, 0), 2990, TValueData(20, 2)) && check_data(kv_file, test_map), "Compressed value");
+    }
+
+    // updates replayed from log
+    std::remove(crash_name.c_str());
+    std::remove((crash_name + ".wal").c_str());
+    {
+        TFile kv_file;
+        kv_file.enableWal(KVDB_DURABILITY_COMMIT);
+        kv_file.enableTableBuffer(1 << 20, 60000);
+        kv_file.enableIndexSnapshot(false);
+        kv_file.open(file_name);
+        for (int i = 0; i < 100; i++) {
+            const TValueData bytes(i + 1, (byte)(i + 50));
+            patch(test_map[TVoxelIndex(i, 0, 0)], i * 10, bytes);
+            kv_file.update(TVoxelIndex(i, 0, 0), i * 10, bytes);
+        }
+        print_assert(std::filesystem::file_size(file_name + ".wal") < 100 * 200, "Log holds patches");
+
+        for (int i = 0; i < 100; i += 10) {
+            // grow past end of value, moved ones are logged whole
+            const TValueData bytes(i + 1, (byte)(i + 60));
+            const size_t offset = test_map[TVoxelIndex(i, 0, 0)].size() - i / 2;
+            patch(test_map[TVoxelIndex(i, 0, 0)], offset, bytes);
+            kv_file.update(TVoxelIndex(i, 0, 0), offset, bytes);
+        }
+        std::filesystem::copy_file(file_name, crash_name);
+        std::filesystem::copy_file(file_name + ".wal", crash_name + ".wal");
+    }
+
+    {
+        TFile kv_file;
+        kv_file.enableWal(KVDB_DURABILITY_COMMIT);
+        kv_file.enableIndexSnapshot(false);
+        print_assert(kv_file.open(crash_name) == KVDB_OK && check_data(kv_file, test_map), "Log replayed");
+    }
+
+    // key entry reached disk, moved value did not
+    std::remove(crash_name.c_str());
+    std::remove((crash_name + ".wal").c_str());
+    {
+        TFile kv_file;
+        kv_file.enableWal(KVDB_DURABILITY_COMMIT);
+        kv_file.enableIndexSnapshot(false);
+        kv_file.open(file_name);
+        const TVoxelIndex k(7, 0, 0);
+        const size_t offset = test_map[k].size() / 2;
+        const ulong64 before = std::filesystem::file_size(file_name);
+        patch(test_map[k], offset, TValueData(10000, 11));
+        kv_file.update(k, offset, TValueData(10000, 11));
+        const ulong64 after = std::filesystem::file_size(file_name);
+        std::filesystem::copy_file(file_name, crash_name);
+        std::filesystem::copy_file(file_name + ".wal", crash_name + ".wal");
+
+        std::fstream f(crash_name, std::ios::in | std::ios::out | std::ios::binary);
+        const std::vector<char> zeros(after - before, 0);
+        f.seekp(before);
+        f.write(zeros.data(), zeros.size());
+        print_assert(after > before + 10000 && (bool)f, "Moved extent zeroed");
+    }
+
+    {
+        TFile kv_file;
+        kv_file.enableWal(KVDB_DURABILITY_COMMIT);
+        kv_file.enableIndexSnapshot(false);
+        print_assert(kv_file.open(crash_name) == KVDB_OK && check_data(kv_file, test_map), "Moved value replayed whole");
+    }
+
+    std::remove(file_name.c_str());
+    std::remove((file_name + ".idx").c_str());
+    std::remove((file_name + ".wal").c_str());
+    std::remove(crash_name.c_str());
+    std::remove((crash_name + ".wal").c_str());
+    std::remove((crash_name + ".idx").c_str());
+
+    printf("=========================== \n\n");
+}
+
+void test_append() {
+    print_test_name("Test#28", "Value append...");
+
+    typedef kvdb::KvFile<TVoxelIndex, TValueData> TFile;
+
+    std::string file_name = TEST_FILE3;
+    std::string crash_name = std::string(TEST_FILE3) + ".crash";
+    std::remove(file_name.c_str());
+    std::remove((file_name + ".idx").c_str());
+
+    const std::unordered_map<TVoxelIndex, TValueData> empty;
+    TFile::create(file_name, empty);
+
+    auto append = [](TValueData &v, const TValueData &bytes) {
+        v.insert(v.end(), bytes.begin(), bytes.end());
+    };
+
+    std::unordered_map<TVoxelIndex, TValueData> test_map;
+    ulong64 written[2];
+    ulong64 relocations[2];
+    {
+        TFile kv_file;
+        kv_file.enableStats();
+        kv_file.open(file_name);
+
+        // growth 2.0 and no growth
+        for (int g = 0; g < 2; g++) {
+            kv_file.setAppendGrowth(g ? 1.0 : 2.0);
+            kv_file.resetStats();
+            const TVoxelIndex k(g, 0, 0);
+            for (int i = 0; i < 1000; i++) {
+                const TValueData bytes(16, (byte)i);
+                append(test_map[k], bytes);
+                kv_file.append(k, bytes);
+            }
+            written[g] = kv_file.stats().bytesWritten;
+            relocations[g] = kv_file.stats().relocations;
+        }
+
+        printf("Bytes written by 1000 appends: %d with growth, %d without \n", (int)written[0], (int)written[1]);
+        print_assert(check_data(kv_file, test_map), "Appended values");
+        print_assert(relocations[0] <= 12 && relocations[1] == 999, "Capacity grows geometrically");
+        print_assert(written[0] < 4 * 16000 + 1000 * 100 && written[0] * 5 < written[1], "Amortized writes");
+
+        kv_file.setAppendGrowth();
+
+        // snapshot keeps value, append goes to new place
+        {
+            TFile::TSnapshot snap = kv_file.snapshot();
+            const TValueData old = test_map[TVoxelIndex(0, 0, 0)];
+            append(test_map[TVoxelIndex(0, 0, 0)], TValueData(10, 1));
+            kv_file.append(TVoxelIndex(0, 0, 0), TValueData(10, 1));
+            auto v = snap.load(TVoxelIndex(0, 0, 0));
+            print_assert(v && *v == old && check_data(kv_file, test_map), "Snapshot sees old value");
+        }
+
+        // appends after put of same key in one batch
+        TFile::TBatch batch;
+        batch.put(TVoxelIndex(2, 0, 0), TValueData(10, 1));
+        batch.append(TVoxelIndex(2, 0, 0), TValueData(20, 2));
+        batch.append(TVoxelIndex(3, 0, 0), TValueData(5, 3));
+        batch.append(TVoxelIndex(3, 0, 0), TValueData(5, 4));
+        kv_file.saveBatch(batch);
+        test_map[TVoxelIndex(2, 0, 0)] = TValueData(10, 1);
+        append(test_map[TVoxelIndex(2, 0, 0)], TValueData(20, 2));
+        append(test_map[TVoxelIndex(3, 0, 0)], TValueData(5, 3));
+        append(test_map[TVoxelIndex(3, 0, 0)], TValueData(5, 4));
+        print_assert(check_data(kv_file, test_map), "Appends in batch");
+    }
+
+    // capacity is kept in key entry
+    {
+        TFile kv_file;
+        kv_file.enableStats();
+        kv_file.open(file_name);
+        kv_file.resetStats();
+        for (int i = 0; i < 10; i++) {
+            append(test_map[TVoxelIndex(0, 0, 0)], TValueData(8, (byte)i));
+            kv_file.append(TVoxelIndex(0, 0, 0), TValueData(8, (byte)i));
+        }
+        print_assert(kv_file.stats().relocations == 0 && check_data(kv_file, test_map), "Capacity after reopen");
+    }
+
+    // direct append keeps reserved capacity inside file, next value goes after it
+    {
+        TFile kv_file;
+        kv_file.enableDirectIo();
+        kv_file.open(file_name);
+        const TVoxelIndex k1(1, 2, 0);
+        const TVoxelIndex k2(2, 2, 0);
+        for (int i = 0; i < 2; i++) {
+            append(test_map[k1], TValueData(5000, (byte)(i + 1)));
+            kv_file.append(k1, TValueData(5000, (byte)(i + 1)));
+        }
+        test_map[k2] = TValueData(30000, 7);
+        kv_file.save(k2, test_map[k2]);
+        append(test_map[k1], TValueData(5000, 3));
+        kv_file.append(k1, TValueData(5000, 3));
+        auto v = kv_file.load(k2);
+        print_assert(v && *v == test_map[k2] && check_data(kv_file, test_map), "Direct append keeps next value");
+    }
+
+    // appends replayed from log, over stale key tables or over tables that already have them
+    for (int buffered = 1; buffered >= 0; buffered--) {
+        std::remove(crash_name.c_str());
+        std::remove((crash_name + ".wal").c_str());
+        std::remove((crash_name + ".idx").c_str());
+        {
+            TFile kv_file;
+            kv_file.enableWal(KVDB_DURABILITY_COMMIT);
+            if (buffered) kv_file.enableTableBuffer(1 << 20, 60000);
+            kv_file.enableIndexSnapshot(false);
+            kv_file.open(file_name);
+            for (int i = 0; i < 300; i++) {
+                const TVoxelIndex k(i % 10, 1, 0);
+                const TValueData bytes(i % 50 + 1, (byte)i);
+                append(test_map[k], bytes);
+                kv_file.append(k, bytes);
+            }
+            print_assert(std::filesystem::file_size(file_name + ".wal") < 300 * 120, "Log holds appended bytes");
+            std::filesystem::copy_file(file_name, crash_name);
+            std::filesystem::copy_file(file_name + ".wal", crash_name + ".wal");
+        }
+
+        {
+            TFile kv_file;
+            kv_file.enableWal(KVDB_DURABILITY_COMMIT);
+            kv_file.enableIndexSnapshot(false);
+            print_assert(kv_file.open(crash_name) == KVDB_OK && check_data(kv_file, test_map), buffered ? "Log replayed over stale tables" : "Log replayed over applied appends");
+        }
+    }
+
+    // key entry of outgrown value reached disk, its new extent did not
+    std::remove(crash_name.c_str());
+    std::remove((crash_name + ".wal").c_str());
+    std::remove((crash_name + ".idx").c_str());
+    {
+        TFile kv_file;
+        kv_file.enableWal(KVDB_DURABILITY_COMMIT);
+        kv_file.enableIndexSnapshot(false);
+        const TVoxelIndex k(0, 3, 0);
+        test_map[k] = TValueData(50000, 1);
+        kv_file.open(file_name);
+        kv_file.save(k, test_map[k]);
+        kv_file.close(); // log starts after the save
+        kv_file.open(file_name);
+        const ulong64 before = std::filesystem::file_size(file_name);
+        append(test_map[k], TValueData(100, 2));
+        kv_file.append(k, TValueData(100, 2));
+        const ulong64 after = std::filesystem::file_size(file_name);
+        std::filesystem::copy_file(file_name, crash_name);
+        std::filesystem::copy_file(file_name + ".wal", crash_name + ".wal");
+
+        std::fstream f(crash_name, std::ios::in | std::ios::out | std::ios::binary);
+        const std::vector<char> zeros(after - before, 0);
+        f.seekp(before);
+        f.write(zeros.data(), zeros.size());
+        print_assert(after > before + 50000 && (bool)f, "Outgrown extent zeroed");
+    }
+
+    {
+        TFile kv_file;
+        kv_file.enableWal(KVDB_DURABILITY_COMMIT);
+        kv_file.enableIndexSnapshot(false);
+        print_assert(kv_file.open(crash_name) == KVDB_OK && check_data(kv_file, test_map), "Outgrown value replayed whole");
+    }
+
+    std::remove(file_name.c_str());
+    std::remove((file_name + ".idx").c_str());
+    std::remove((file_name + ".wal").c_str());
+    std::remove(crash_name.c_str());
+    std::remove((crash_name + ".wal").c_str());
+    std::remove((crash_name + ".idx").c_str());
+
+    printf("=========================== \n\n");
+}
+
+void test_key_map() {
+    print_test_name("Test#29", "Key map...");
+
+    typedef kvdb::TKeyMap<kvdb::TKeyRecord> TMap;
+
+    auto key_of = [](uint32 i) {
+        TKeyData kd(12, 0);
+        std::memcpy(kd.data(), &i, sizeof(i));
+        return kd;
+    };
+
+    auto record_of = [](uint32 i) {
+        kvdb::TKeyRecord r;
+        r.dataPos = i;
+        r.dataLength = i * 2;
+        return r;
+    };
+
+    auto check = [&](const TMap &map, uint32 i) {
+        const kvdb::TKeyRecord *r = map.find(key_of(i).data());
+        return r && r->dataPos == i && r->dataLength == i * 2;
+    };
+
+    // erase in the middle moves last entry into the hole, it is found at new place
+    {
+        TMap map;
+        map.setKeySize(12);
+        for (uint32 i = 0; i < 100; i++) map.insert(key_of(i), record_of(i));
+
+        const byte *last = nullptr;
+        map.forEach([&](const byte *key, const kvdb::TKeyRecord &) { last = key; });
+        uint32 moved;
+        std::memcpy(&moved, last, sizeof(moved));
+
+        map.erase(key_of(50));
+        const byte *middle = nullptr;
+        int n = 0;
+        map.forEach([&](const byte *key, const kvdb::TKeyRecord &) { if (n++ == 50) middle = key; });
+
+        bool ok = map.size() == 99 && map.find(key_of(50).data()) == nullptr && check(map, moved) && middle && std::memcmp(middle, key_of(moved).data(), 12) == 0;
+        for (uint32 i = 0; i < 100; i++) ok = ok && (i == 50 || check(map, i));
+        print_assert(ok, "Erase moves last entry");
+
+        // find after every erase of the last entry and of the first one
+        for (uint32 i = 99; i > 80; i--) map.erase(key_of(i));
+        for (uint32 i = 0; i < 10; i++) map.erase(key_of(i));
+        ok = map.size() == 99 - 19 - 10;
+        for (uint32 i = 0; i < 100; i++) ok = ok && ((i < 10 || i == 50 || i > 80) ? map.find(key_of(i).data()) == nullptr : check(map, i));
+        print_assert(ok, "Find after erase of last and first entries");
+    }
+
+    // erased slots are reused, same keys go back without growth
+    {
+        TMap map;
+        map.setKeySize(12);
+        for (uint32 i = 0; i < 1000; i++) map.insert(key_of(i), record_of(i));
+        const size_t memory = map.memoryUsage();
+        for (uint32 i = 0; i < 1000; i += 2) map.erase(key_of(i));
+        for (uint32 i = 0; i < 1000; i += 2) map.insert(key_of(i), record_of(i));
+
+        bool ok = map.size() == 1000 && map.memoryUsage() == memory;
+        for (uint32 i = 0; i < 1000; i++) ok = ok && check(map, i);
+        print_assert(ok, "Tombstone reuse");
+    }
+
+    // many erase and insert cycles: tombstones are dropped by rehash, table does not grow
+    {
+        TMap map;
+        map.setKeySize(12);
+        for (uint32 i = 0; i < 1000; i++) map.insert(key_of(i), record_of(i));
+        const size_t memory = map.memoryUsage();
+
+        std::mt19937 rng(3);
+        std::vector<uint32> live(1000);
+        for (uint32 i = 0; i < 1000; i++) live[i] = i;
+        uint32 next = 1000;
+        bool ok = true;
+        for (int c = 0; c < 20000; c++) {
+            const size_t n = rng() % live.size();
+            ok = ok && map.erase(key_of(live[n]));
+            live[n] = next++;
+            map.insert(key_of(live[n]), record_of(live[n]));
+        }
+        for (uint32 i : live) ok = ok && check(map, i);
+        ok = ok && map.size() == 1000 && map.memoryUsage() <= memory;
+        for (uint32 i = 0; i < next; i++) {
+            const bool alive = std::find(live.begin(), live.end(), i) != live.end();
+            ok = ok && (alive || map.find(key_of(i).data()) == nullptr);
+        }
+        print_assert(ok, "Erase and insert cycles");
+    }
+
+    // growth while tombstones are present keeps every live key
+    {
+        TMap map;
+        map.setKeySize(12);
+        bool ok = true;
+        for (uint32 i = 0; i < 20000; i++) {
+            map.insert(key_of(i), record_of(i));
+            if (i % 3 == 0) map.erase(key_of(i / 2));
+        }
+        for (uint32 i = 0; i < 20000; i++) {
+            const bool erased = (i * 2 < 20000 && (i * 2) % 3 == 0) || (i * 2 + 1 < 20000 && (i * 2 + 1) % 3 == 0);
+            ok = ok && (erased ? map.find(key_of(i).data()) == nullptr : check(map, i));
+        }
+        print_assert(ok, "Grow and rehash with tombstones");
+    }
+
+    printf("=========================== \n\n");
+}
+
+int main() {
+
+    if constexpr (std::endian::native == std::endian::big)
+        std::cout << "big-endian\n";
+    else if constexpr (std::endian::native == std::endian::little)
+        std::cout << "little-endian\n";
+    else
+        std::cout << "mixed-endian\n";
+
+    printf("\nRun KVDB tests... \n\n");
+
+    // basic functionality
+    std::unordered_map<TVoxelIndex, TTestStructItem> test_data_map;
+    test1(test_data_map);
+    test2(test_data_map);
+    test3(test_data_map);
+    test4(test_data_map);
+    test_mmap(test_data_map);
+    test4(test_data_map);
+
+    // keys with zero length values
+    std::unordered_map<TVoxelIndex, TTestDataItem> test_data_map2;
+    test_null_val1(test_data_map2);
+
+    std::unordered_map<TVoxelIndex, TTestDataItem> test_data_map3;
+    test_big1(test_data_map3);
+
+    test_batch();
+    test_free_space();
+    test_compact();
+    test_index_snapshot();
+    test_wal();
+    test_index_memory();
+    test_cache();
+    test_compression();
+    test_key_order();
+    test_range();
+    test_async();
+    test_multi_get();
+    test_sharded();
+    test_snapshot();
+    test_stats();
+    test_log_file();
+    test_table_buffer();
+    test_table_directory();
+    test_value_alignment();
+    test_partial_update();
+    test_append();
+    test_key_map();
 
     printf("\n");
 }